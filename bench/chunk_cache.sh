@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# Time chunk cache inserts and lookups.
+#
+# Usage: bench/chunk_cache.sh [-n CHUNKS] PARTI...
+#
+# A disk with CHUNKS (default 200000) chunks at random positions is
+# written in --export-disk format and read back with --import-disk by each
+# PARTI binary given, e.g. builds of two git revisions:
+#
+#   git worktree add /tmp/parti-old <rev> && make -C /tmp/parti-old parti
+#   make parti && bench/chunk_cache.sh /tmp/parti-old/parti ./parti
+#
+# Each chunk has a single non-zero line, so parsing the file is cheap and
+# the run time is mostly spent in the chunk cache.
+
+chunks=200000
+
+if [ "$1" = "-n" ] ; then
+  chunks=$2
+  shift 2
+fi
+
+if [ -z "$1" ] ; then
+  echo "usage: $0 [-n CHUNKS] PARTI..."
+  exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# 8 GiB disk, chunks at random 4 KiB boundaries (fixed seed)
+# (the address is printed in two parts: some awks can't print 64 bit numbers)
+awk -v n=$chunks 'BEGIN {
+  srand(1)
+  print "# disk 0, size = 8589934592"
+  for(i = 0; i < n; i++) {
+    printf "%06x000  01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f 10  ................\n", int(rand() * 2097152)
+  }
+}' > "$tmp/disk.txt"
+
+for parti in "$@" ; do
+  start=$(date +%s%N)
+  "$parti" --import-disk "$tmp/disk.txt" > /dev/null 2>&1
+  end=$(date +%s%N)
+  printf "%s: %d chunks, %d ms\n" "$parti" $chunks $(( (end - start) / 1000000 ))
+done
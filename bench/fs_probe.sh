@@ -0,0 +1,74 @@
+#!/bin/bash
+#
+# Time file system probes.
+#
+# Usage: bench/fs_probe.sh [-n DISKS] PARTI...
+#
+# A small image is made for each file system type that has a mkfs tool
+# installed (ext2, ext4, xfs, btrfs, vfat, swap, iso9660). Each PARTI
+# binary given gets the same image DISKS (default 500) times on the command
+# line, so there is one probe per disk, e.g. to compare builds of two git
+# revisions:
+#
+#   git worktree add /tmp/parti-old <rev> && make -C /tmp/parti-old parti
+#   make parti && bench/fs_probe.sh /tmp/parti-old/parti ./parti
+#
+# The result includes program start and partition table checks; both are
+# small compared to a blkid probe.
+
+disks=500
+
+if [ "$1" = "-n" ] ; then
+  disks=$2
+  shift 2
+fi
+
+if [ -z "$1" ] ; then
+  echo "usage: $0 [-n DISKS] PARTI..."
+  exit 1
+fi
+
+export PATH="$PATH:/sbin:/usr/sbin"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# make image $1 of size $2 MiB with the remaining arguments as mkfs command
+mk_image() {
+  local name=$1 size=$2
+  shift 2
+  type -p $1 > /dev/null || return
+  truncate -s ${size}M "$tmp/$name.img"
+  "$@" "$tmp/$name.img" > /dev/null 2>&1 || rm -f "$tmp/$name.img"
+}
+
+mk_image ext2 16 mkfs.ext2 -q -F
+mk_image ext4 16 mkfs.ext4 -q -F
+mk_image xfs 300 mkfs.xfs -q -f
+mk_image btrfs 128 mkfs.btrfs -q -f
+mk_image vfat 64 mkfs.vfat
+mk_image swap 16 mkswap
+
+mkdir "$tmp/iso"
+echo foo > "$tmp/iso/foo"
+if type -p xorriso > /dev/null ; then
+  xorriso -as mkisofs -quiet -o "$tmp/iso9660.img" "$tmp/iso" > /dev/null 2>&1
+elif type -p genisoimage > /dev/null ; then
+  genisoimage -quiet -o "$tmp/iso9660.img" "$tmp/iso" > /dev/null 2>&1
+fi
+
+for img in "$tmp"/*.img ; do
+  name=$(basename "$img" .img)
+  args=()
+  for (( i = 0; i < disks; i++ )) ; do
+    args+=("$img")
+  done
+
+  for parti in "$@" ; do
+    start=$(date +%s%N)
+    "$parti" "${args[@]}" > /dev/null 2>&1
+    end=$(date +%s%N)
+    ms=$(( (end - start) / 1000000 ))
+    printf "%s: %s, %d probes, %d ms, %d probes/s\n" "$parti" $name $disks $ms $(( disks * 1000 / (ms > 0 ? ms : 1) ))
+  done
+done
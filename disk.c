@@ -5,218 +5,1674 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <setjmp.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 #include <linux/fs.h>   /* BLKGETSIZE64 */
+#include <stddef.h>
+#include <endian.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <sys/prctl.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#ifdef __WITH_IO_URING__
+#include <liburing.h>
+#endif
 
 #include "util.h"
 #include "disk.h" 
 
 extern json_object *json_root;
 
+// persistent cache file header; followed by the cache key and the chunks
+typedef struct {
+  char magic[8];
+  uint64_t size;	// disk size
+  uint64_t digest;	// digest of disk head and tail
+  uint64_t chunks;
+  uint32_t key_len;
+  uint32_t chunk_size;
+} disk_cache_header_t;
+
+#define DISK_CACHE_MAGIC	"parti.c1"
+// chunk number flag in cache file: zero chunk, no data follow
+#define DISK_CACHE_ZERO		(1ull << 63)
+
+// reader thread, for reads that can time out; one per disk, started on first use
+typedef struct disk_reader_s {
+  pthread_mutex_t mutex;
+  pthread_cond_t request;	// a request is pending, or the reader is to quit
+  pthread_cond_t done;		// the request is done (uses CLOCK_MONOTONIC)
+  int fd;
+  void *buffer;			// the reader's own: the caller's may be gone when a read returns late
+  size_t buffer_size;
+  size_t len;
+  off_t offset;
+  ssize_t result;
+  int err;
+  unsigned busy:1;		// request pending
+  unsigned quit:1;		// the disk is done with the reader; it frees itself
+} disk_reader_t;
+
+#ifdef SECCOMP_FILTER_FLAG_NEW_LISTENER
+// for disk_lazy_run(): func runs in a thread of its own, with a seccomp filter
+typedef struct {
+  int fd;
+  int listener;			// seccomp notification fd (-1 = no filter)
+  sem_t ready;			// listener is set
+  int (*func)(int fd, void *data);
+  void *data;
+  int result;
+} disk_lazy_t;
+
+// offset of the lower 32 bits of a syscall argument in struct seccomp_data
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define DISK_LAZY_ARG_LOW	0
+#else
+#define DISK_LAZY_ARG_LOW	4
+#endif
+#endif
+
+static unsigned disk_hash(uint64_t chunk_nr, unsigned bits);
+static void disk_hash_add(disk_t *disk, unsigned idx);
+static int disk_hash_resize(disk_t *disk, unsigned bits);
+static int disk_chunk_cmp(const void *a, const void *b);
+static void *disk_alloc_chunk(disk_t *disk);
+static int disk_io_read(disk_io_t *io);
+static int disk_cache_add(disk_t *disk, uint64_t chunk_nr, uint8_t *data, unsigned flags);
+static int disk_range_cmp(const void *a, const void *b);
+static void disk_free_chunk(disk_t *disk, uint8_t *data);
+static int disk_cache_evict(void);
+static void disk_cache_remove(disk_t *disk, unsigned idx);
+static unsigned disk_hash_slot(disk_t *disk, unsigned idx);
+static void disk_io_extend(disk_io_t *io, uint64_t start, uint64_t end);
+static int disk_io_extend_done(disk_io_t *io, int err);
+static void disk_read_around(disk_t *disk, uint64_t *start, uint64_t *end);
+static void disk_map_read_around(disk_t *disk, uint64_t chunk_nr);
+static int disk_sysfs_read(struct stat *sbuf, char *attr, char *buf, unsigned len);
+static char *disk_cache_key(struct stat *sbuf);
+static char *disk_cache_file(disk_t *disk);
+static int disk_cache_digest(disk_t *disk, uint64_t *digest);
+static void disk_cache_load(disk_t *disk);
+static void disk_direct_off(disk_t *disk);
+static int disk_chunk_is_zero(uint8_t *data);
+static ssize_t disk_pread(disk_t *disk, void *buffer, size_t len, uint64_t offset);
+static disk_reader_t *disk_reader_start(disk_t *disk);
+static void *disk_reader_thread(void *arg);
+static void disk_reader_stop(disk_reader_t *reader);
+static void disk_reader_free(disk_reader_t *reader);
+static void disk_cache_poison(disk_t *disk, uint64_t chunk_nr, unsigned count);
+static void disk_import_chunk(disk_t *disk, uint64_t chunk_nr, uint8_t *data, char *file_name);
+static void disk_map_holes(disk_t *disk);
+static int disk_hole_lookup(disk_t *disk, uint64_t chunk_nr, uint64_t *next);
+static int disk_map_read(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned *count);
+static void disk_map_sigbus(int sig);
+static int disk_map_copy(void *dst, void *src, size_t len);
+static int disk_memfd_write(disk_t *disk, disk_chunk_t *chunk);
+static int disk_memfd_area(disk_t *disk, uint64_t chunk_nr);
+#ifdef SECCOMP_FILTER_FLAG_NEW_LISTENER
+static void *disk_lazy_thread(void *arg);
+#endif
+#ifdef __WITH_IO_URING__
+static void disk_uring_read(disk_io_t *io, unsigned count);
+#endif
+
 unsigned disk_list_size;
 disk_t *disk_list;
 
+// chunks in cache (over all disks) that count against the cache budget: not
+// pinned chunks, and not chunks without own data (mapped, zero, unreadable)
+static uint64_t disk_cache_chunks;
+
+// aligned buffers for extended read requests, for reuse
+static struct {
+  void *list[DISK_IO_BATCH];
+  unsigned len;
+} disk_io_pool;
+
+// cache eviction: current position (disk, chunk list index)
+static struct {
+  unsigned disk;
+  unsigned idx;
+} disk_clock;
+
+// reading from a file mapping: where to continue if the file can't be read
+static sigjmp_buf disk_map_jmp;
+static volatile sig_atomic_t disk_map_active;
+
 int disk_read(disk_t *disk, void *buffer, uint64_t block_nr, unsigned count)
 {
-  unsigned factor = disk->block_size / DISK_CHUNK_SIZE;
+  unsigned factor = disk->block_size / DISK_CHUNK_SIZE;
+
+  // fprintf(stderr, "read: %llu - %u (factor = %u)\n", (unsigned long long) block_nr, count, factor);
+
+  uint64_t chunk_nr = block_nr * factor;
+
+  count *= factor;
+
+  disk_io_t io[DISK_IO_BATCH];
+  unsigned io_cnt = 0;
+  int bad = 0;
+
+  for(unsigned u = 0; u < count; ) {
+    // fprintf(stderr, "read request: disk %u, addr %08"PRIx64"\n", disk->index, (chunk_nr + u) * DISK_CHUNK_SIZE);
+    int i = disk_cache_read(disk, &(disk_chunk_t) { .nr = chunk_nr + u, .data = buffer + u * DISK_CHUNK_SIZE });
+    // for unreadable chunks, go on to get at least the other data
+    if(i == 3) bad = 3;
+    if(!i || i == 3) {
+      u++;
+      continue;
+    }
+
+    // the chunks are in the mapped part of the file: copy them from there
+    // (if the mapping can't be read, read the chunk the usual way)
+    if(disk->map) {
+      unsigned len = count - u;
+      int err = disk_map_read(disk, buffer + u * DISK_CHUNK_SIZE, chunk_nr + u, &len);
+      if(err == 4) return err;
+      if(!err) {
+        u += len;
+        continue;
+      }
+    }
+
+    // holes in sparse files are just zeros
+    uint64_t next;
+    if(disk->holes.len && disk_hole_lookup(disk, chunk_nr + u, &next)) {
+      memset(buffer + u * DISK_CHUNK_SIZE, 0, DISK_CHUNK_SIZE);
+      int err = disk_cache_store(disk, &(disk_chunk_t) { .nr = chunk_nr + u, .data = buffer + u * DISK_CHUNK_SIZE });
+      if(err) return err;
+      disk->stats.holes++;
+      u++;
+      continue;
+    }
+
+    // read all consecutive missing chunks at once
+    int match = 0;
+    unsigned len = 1;
+    while(u + len < count && (disk_find_chunk(disk, chunk_nr + u + len, &match), !match)) len++;
+
+    io[io_cnt++] = (disk_io_t) { .disk = disk, .buffer = buffer + u * DISK_CHUNK_SIZE, .chunk_nr = chunk_nr + u, .count = len };
+
+    if(io_cnt == DISK_IO_BATCH) {
+      int err = disk_read_batch(io, io_cnt);
+      if(err) return err;
+      io_cnt = 0;
+    }
+
+    u += len;
+  }
+
+  int err = io_cnt ? disk_read_batch(io, io_cnt) : 0;
+
+  return err ?: bad;
+}
+
+
+/*
+ * Read 'len' bytes at byte offset 'pos'.
+ *
+ * Return value as for disk_read().
+ */
+int disk_read_bytes(disk_t *disk, void *buffer, uint64_t pos, unsigned len)
+{
+  uint64_t block_nr = pos / disk->block_size;
+  unsigned ofs = pos % disk->block_size;
+  unsigned count = (ofs + len + disk->block_size - 1) / disk->block_size;
+
+  if(!len) return 0;
+
+  uint8_t *buf = calloc(count, disk->block_size);
+
+  if(!buf) return 4;
+
+  int err = disk_read(disk, buf, block_nr, count);
+
+  memcpy(buffer, buf + ofs, len);
+
+  free(buf);
+
+  return err;
+}
+
+
+/*
+ * Run a batch of read requests and add the data to the cache.
+ *
+ * Each request is read with a single syscall (if possible). With io_uring
+ * support, all requests are submitted at once.
+ *
+ * Return 0 if all requests could be completed, else the error of the first
+ * failed request.
+ */
+int disk_read_batch(disk_io_t *io, unsigned count)
+{
+  int err = 0;
+
+  for(unsigned u = 0; u < count; u++) {
+    disk_t *disk = io[u].disk;
+    uint64_t start = io[u].chunk_nr, end = start + io[u].count;
+
+    if(disk->read_around) disk_read_around(disk, &start, &end);
+
+    // direct i/o needs full logical blocks and an aligned buffer
+    if(disk->direct) {
+      unsigned align = disk->logical_block_size / DISK_CHUNK_SIZE ?: 1;
+      start = start / align * align;
+      end = (end + align - 1) / align * align;
+    }
+
+    if(disk->direct || start != io[u].chunk_nr || end != io[u].chunk_nr + io[u].count) {
+      disk_io_extend(io + u, start, end);
+    }
+  }
+
+#ifdef __WITH_IO_URING__
+  // io_uring requests can't be abandoned if the device hangs
+  if(!opt.timeout) disk_uring_read(io, count);
+#endif
+
+  for(unsigned u = 0; u < count; u++) {
+    int i = disk_io_read(io + u);
+    if(io[u].orig.buffer) i = disk_io_extend_done(io + u, i);
+    if(!err) err = i;
+  }
+
+  return err;
+}
+
+
+/*
+ * Finish a read request using pread() and add the data to the cache.
+ *
+ * io->len is the number of bytes already read.
+ *
+ * After a read error, the failing chunk is read again alone a few times.
+ * If it still fails, it is marked as unreadable and the remaining chunks
+ * are read. If the device stops responding, all remaining chunks are
+ * marked as unreadable.
+ *
+ * Return 0 if all chunks could be read.
+ */
+static int disk_io_read(disk_io_t *io)
+{
+  disk_t *disk = io->disk;
+  size_t len = (size_t) io->count * DISK_CHUNK_SIZE;
+  int bad = 0;
+
+  if(disk->fd == -1) {
+    // fprintf(stderr, "cache miss: disk %u, addr %08"PRIx64"\n", disk->index, io->chunk_nr * DISK_CHUNK_SIZE);
+    memset(io->buffer, 0, len);
+    io->len = len;
+  }
+
+  // fprintf(stderr, "read: %llu[%u]\n", (unsigned long long) io->chunk_nr, io->count);
+
+  if(disk->fd != -1) disk->stats.chunks += io->count;
+
+  while(io->len < len) {
+    size_t todo = len - io->len;
+
+    // don't read holes, and don't read across them
+    if(disk->holes.len && !(io->len % DISK_CHUNK_SIZE)) {
+      uint64_t nr = io->chunk_nr + io->len / DISK_CHUNK_SIZE, next;
+      int hole = disk_hole_lookup(disk, nr, &next);
+      if(next - nr < todo / DISK_CHUNK_SIZE) todo = (next - nr) * DISK_CHUNK_SIZE;
+      if(hole) {
+        memset(io->buffer + io->len, 0, todo);
+        io->len += todo;
+        disk->stats.chunks -= todo / DISK_CHUNK_SIZE;
+        disk->stats.holes += todo / DISK_CHUNK_SIZE;
+        continue;
+      }
+    }
+
+    ssize_t i = disk_pread(disk, io->buffer + io->len, todo, io->chunk_nr * DISK_CHUNK_SIZE + io->len);
+    disk->stats.reads++;
+    disk->stats.syscalls++;
+    if(i < 0 && errno == EINVAL && disk->direct) {
+      disk_direct_off(disk);
+      continue;
+    }
+    if(i > 0) {
+      io->len += i;
+      continue;
+    }
+    if(i == 0) break;
+
+    // read error: retry just the failing chunk (or logical block, for direct i/o)
+    io->len -= io->len % DISK_CHUNK_SIZE;
+    size_t unit = disk->direct && disk->logical_block_size > DISK_CHUNK_SIZE ? disk->logical_block_size : DISK_CHUNK_SIZE;
+    if(unit > len - io->len) unit = len - io->len;
+
+    for(unsigned u = 0; u < DISK_READ_RETRIES && i < 0 && !disk->hung; u++) {
+      usleep((DISK_RETRY_DELAY << u) * 1000);
+      i = disk_pread(disk, io->buffer + io->len, unit, io->chunk_nr * DISK_CHUNK_SIZE + io->len);
+      disk->stats.reads++;
+      disk->stats.syscalls++;
+      disk->stats.retries++;
+    }
+    if(i > 0) {
+      io->len += i;
+      continue;
+    }
+    if(i == 0) break;
+
+    // give up on that chunk - or on all remaining chunks, if the device hangs
+    // (the timeout has been reported already)
+    uint64_t nr = io->chunk_nr + io->len / DISK_CHUNK_SIZE;
+
+    if(disk->hung) {
+      unit = len - io->len;
+    }
+    // failures outside the original request are not worth a message
+    else if(!io->orig.buffer || (nr + unit / DISK_CHUNK_SIZE > io->orig.chunk_nr && nr < io->orig.chunk_nr + io->orig.count)) {
+      fprintf(stderr, "error reading sector %"PRIu64"\n", nr);
+    }
+
+    memset(io->buffer + io->len, 0, unit);
+    disk_cache_poison(disk, nr, unit / DISK_CHUNK_SIZE);
+    io->len += unit;
+    bad = 3;
+  }
+
+  // unreadable chunks are already in the cache and not stored again
+  for(unsigned u = 0; u < io->len / DISK_CHUNK_SIZE; u++) {
+    uint64_t nr = io->chunk_nr + u;
+    // chunks outside the original request were read in advance
+    unsigned flags = io->orig.buffer && (nr < io->orig.chunk_nr || nr >= io->orig.chunk_nr + io->orig.count) ? DISK_CHUNK_SPECULATIVE : 0;
+    int err = disk_cache_store(disk, &(disk_chunk_t) { .nr = nr, .data = io->buffer + u * DISK_CHUNK_SIZE, .flags = flags });
+    if(err) return err;
+  }
+
+  if(io->len < len) {
+    uint64_t nr = io->chunk_nr + io->len / DISK_CHUNK_SIZE;
+
+    // failures after the original request are not worth a message
+    if(!io->orig.buffer || nr < io->orig.chunk_nr + io->orig.count) {
+      fprintf(stderr, "error reading sector %"PRIu64"\n", nr);
+    }
+
+    return 3;
+  }
+
+  return bad;
+}
+
+
+/*
+ * Read from disk, like pread().
+ *
+ * With a timeout set, the actual read is done by the disk's reader thread.
+ * If it does not finish in time, the thread is left alone and the disk is
+ * marked as hung. Further reads from that disk fail immediately.
+ */
+static ssize_t disk_pread(disk_t *disk, void *buffer, size_t len, uint64_t offset)
+{
+  if(!opt.timeout) return pread(disk->fd, buffer, len, (off_t) offset);
+
+  if(disk->hung) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+
+  if(!disk->reader) disk->reader = disk_reader_start(disk);
+
+  disk_reader_t *reader = disk->reader;
+
+  if(!reader) return pread(disk->fd, buffer, len, (off_t) offset);
+
+  // the reader is idle: its buffer can be replaced
+  if(len > reader->buffer_size) {
+    void *new_buffer;
+    if(posix_memalign(&new_buffer, DISK_IO_BUF_ALIGN, len)) return pread(disk->fd, buffer, len, (off_t) offset);
+    free(reader->buffer);
+    reader->buffer = new_buffer;
+    reader->buffer_size = len;
+  }
+
+  // a monotonic clock: changing the system time must not affect the timeout
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += opt.timeout;
+
+  pthread_mutex_lock(&reader->mutex);
+
+  reader->len = len;
+  reader->offset = (off_t) offset;
+  reader->busy = 1;
+  pthread_cond_signal(&reader->request);
+
+  while(reader->busy && pthread_cond_timedwait(&reader->done, &reader->mutex, &deadline) != ETIMEDOUT);
+
+  if(reader->busy) {
+    reader->quit = 1;
+    pthread_mutex_unlock(&reader->mutex);
+    disk->reader = NULL;
+    fprintf(stderr, "%s: read timed out, giving up\n", disk->name);
+    disk->hung = 1;
+    errno = ETIMEDOUT;
+
+    return -1;
+  }
+
+  ssize_t result = reader->result;
+  int err = reader->err;
+
+  if(result > 0) memcpy(buffer, reader->buffer, (size_t) result);
+
+  pthread_mutex_unlock(&reader->mutex);
+
+  errno = err;
+
+  return result;
+}
+
+
+/*
+ * Start reader thread for disk.
+ *
+ * Return NULL if that's not possible.
+ */
+static disk_reader_t *disk_reader_start(disk_t *disk)
+{
+  disk_reader_t *reader = calloc(1, sizeof *reader);
+  pthread_condattr_t cond_attr;
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  if(!reader) return NULL;
+
+  reader->fd = disk->fd;
+
+  pthread_mutex_init(&reader->mutex, NULL);
+  pthread_cond_init(&reader->request, NULL);
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&reader->done, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  // nobody waits for the thread to end: a hung one may never do
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int err = pthread_create(&thread, &attr, disk_reader_thread, reader);
+  pthread_attr_destroy(&attr);
+
+  if(err) {
+    disk_reader_free(reader);
+    return NULL;
+  }
+
+  return reader;
+}
+
+
+static void *disk_reader_thread(void *arg)
+{
+  disk_reader_t *reader = arg;
+
+  pthread_mutex_lock(&reader->mutex);
+
+  for(;;) {
+    while(!reader->busy && !reader->quit) pthread_cond_wait(&reader->request, &reader->mutex);
+
+    if(reader->quit) break;
+
+    pthread_mutex_unlock(&reader->mutex);
+
+    ssize_t result = pread(reader->fd, reader->buffer, reader->len, reader->offset);
+    int err = errno;
+
+    pthread_mutex_lock(&reader->mutex);
+
+    reader->result = result;
+    reader->err = err;
+    reader->busy = 0;
+    pthread_cond_signal(&reader->done);
+  }
+
+  pthread_mutex_unlock(&reader->mutex);
+
+  disk_reader_free(reader);
+
+  return NULL;
+}
+
+
+// Tell idle reader thread to quit; it frees the reader.
+static void disk_reader_stop(disk_reader_t *reader)
+{
+  pthread_mutex_lock(&reader->mutex);
+  reader->quit = 1;
+  pthread_cond_signal(&reader->request);
+  pthread_mutex_unlock(&reader->mutex);
+}
+
+
+static void disk_reader_free(disk_reader_t *reader)
+{
+  pthread_mutex_destroy(&reader->mutex);
+  pthread_cond_destroy(&reader->request);
+  pthread_cond_destroy(&reader->done);
+  free(reader->buffer);
+  free(reader);
+}
+
+
+/*
+ * Extend read request to chunks [start, end[.
+ *
+ * The data are read into an aligned buffer; the original request is
+ * restored in disk_io_extend_done().
+ */
+static void disk_io_extend(disk_io_t *io, uint64_t start, uint64_t end)
+{
+  size_t size = (end - start) * DISK_CHUNK_SIZE;
+  void *buffer = NULL;
+
+  if(size <= DISK_IO_BUF_SIZE && disk_io_pool.len) {
+    buffer = disk_io_pool.list[--disk_io_pool.len];
+  }
+  else if(posix_memalign(&buffer, DISK_IO_BUF_ALIGN, size < DISK_IO_BUF_SIZE ? DISK_IO_BUF_SIZE : size)) {
+    // just read what was requested; for direct i/o, if that fails, direct i/o is turned off
+    return;
+  }
+
+  io->orig.buffer = io->buffer;
+  io->orig.chunk_nr = io->chunk_nr;
+  io->orig.count = io->count;
+
+  io->buffer = buffer;
+  io->chunk_nr = start;
+  io->count = end - start;
+}
+
+
+/*
+ * Finish extended read request.
+ *
+ * Copy the data to the original buffer and put the aligned buffer back
+ * into the pool.
+ *
+ * 'err' is the result of the extended read; return the result for the
+ * original request.
+ */
+static int disk_io_extend_done(disk_io_t *io, int err)
+{
+  size_t skip = (io->orig.chunk_nr - io->chunk_nr) * DISK_CHUNK_SIZE;
+  size_t len = (size_t) io->orig.count * DISK_CHUNK_SIZE;
+  size_t size = (size_t) io->count * DISK_CHUNK_SIZE;
+  size_t avail = io->len > skip ? io->len - skip : 0;
+
+  if(avail > len) avail = len;
+
+  memcpy(io->orig.buffer, io->buffer + skip, avail);
+
+  if(size <= DISK_IO_BUF_SIZE && disk_io_pool.len < DISK_IO_BATCH) {
+    disk_io_pool.list[disk_io_pool.len++] = io->buffer;
+  }
+  else {
+    free(io->buffer);
+  }
+
+  io->buffer = io->orig.buffer;
+  io->chunk_nr = io->orig.chunk_nr;
+  io->count = io->orig.count;
+  io->len = avail;
+  io->orig.buffer = NULL;
+
+  if(avail < len) return err ?: 3;
+
+  // failures in the extra chunks don't matter
+  for(uint64_t nr = io->chunk_nr; err && nr < io->chunk_nr + io->count; nr++) {
+    int match;
+    unsigned u = disk_find_chunk(io->disk, nr, &match);
+    if(match && (io->disk->chunks.list[u].flags & DISK_CHUNK_POISONED)) return err;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Widen chunk range [start, end[ to the surrounding read-around window.
+ *
+ * The window is aligned to its size and limited by the disk size. Chunks
+ * already in the cache are not read again.
+ */
+static void disk_read_around(disk_t *disk, uint64_t *start, uint64_t *end)
+{
+  uint64_t size = disk->read_around;
+  uint64_t win_start = *start / size * size;
+  uint64_t win_end = (*end + size - 1) / size * size;
+  uint64_t disk_end = disk->size_in_bytes / DISK_CHUNK_SIZE;
+  int match;
+
+  if(win_end > disk_end) win_end = disk_end;
+
+  while(*start > win_start && (disk_find_chunk(disk, *start - 1, &match), !match)) (*start)--;
+  while(*end < win_end && (disk_find_chunk(disk, *end, &match), !match)) (*end)++;
+}
+
+
+/*
+ * Ask the kernel to read the read-around window of a chunk in the mapped
+ * file.
+ *
+ * Page faults then find the data in the page cache. Each window is
+ * requested once; consecutive misses usually hit the same window.
+ */
+static void disk_map_read_around(disk_t *disk, uint64_t chunk_nr)
+{
+  uint64_t size = disk->read_around;
+  uint64_t win_start = chunk_nr / size * size;
+  uint64_t page_mask = (uint64_t) sysconf(_SC_PAGESIZE) - 1;
+  uint64_t map_start = (win_start * DISK_CHUNK_SIZE) & ~page_mask;
+  uint64_t map_end = (win_start + size) * DISK_CHUNK_SIZE;
+
+  if(disk->map_window == win_start + 1) return;
+
+  disk->map_window = win_start + 1;
+
+  if(map_end > disk->map_size) map_end = disk->map_size;
+  if(map_start >= map_end) return;
+
+  madvise(disk->map + map_start, map_end - map_start, MADV_WILLNEED);
+  disk->stats.map_windows++;
+}
+
+
+/*
+ * Read attribute of a block device from sysfs.
+ *
+ * If the device has no such attribute, try its parent device (so for
+ * partitions, you get the attributes of the disk).
+ *
+ * Only the first line is returned, without trailing white space.
+ *
+ * Return 0 if ok.
+ */
+static int disk_sysfs_read(struct stat *sbuf, char *attr, char *buf, unsigned len)
+{
+  char path[128];
+  FILE *f = NULL;
+
+  for(unsigned u = 0; u < 2 && !f; u++) {
+    snprintf(path, sizeof path, "/sys/dev/block/%u:%u/%s%s",
+      major(sbuf->st_rdev), minor(sbuf->st_rdev), u ? "../" : "", attr
+    );
+    f = fopen(path, "r");
+  }
+
+  if(!f) return 1;
+
+  int ok = fgets(buf, (int) len, f) != NULL;
+
+  fclose(f);
+
+  if(!ok) return 1;
+
+  size_t buf_len = strlen(buf);
+  while(buf_len && (buf[buf_len - 1] == '\n' || buf[buf_len - 1] == ' ')) buf[--buf_len] = 0;
+
+  return !buf_len;
+}
+
+
+// Device does not support direct i/o: switch to regular reads.
+static void disk_direct_off(disk_t *disk)
+{
+  int flags = fcntl(disk->fd, F_GETFL);
+
+  if(flags != -1) fcntl(disk->fd, F_SETFL, flags & ~O_DIRECT);
+
+  disk->direct = 0;
+}
+
+
+#ifdef __WITH_IO_URING__
+/*
+ * Submit read requests via io_uring and wait for all of them.
+ *
+ * Requests that could not be (completely) read are left to disk_io_read().
+ * If io_uring is not available, nothing is done.
+ *
+ * If the kernel does not take all requests, the ring is shut down after
+ * the ones it took have completed: the rest must not be submitted later,
+ * when their buffers are gone. The same happens if waiting for requests
+ * fails.
+ */
+static void disk_uring_read(disk_io_t *io, unsigned count)
+{
+  static struct io_uring ring;
+  static int ring_state;	// 0: not initialized, 1: ok, -1: not available
+
+  if(!ring_state) {
+    ring_state = io_uring_queue_init(DISK_IO_BATCH, &ring, 0) ? -1 : 1;
+  }
+
+  if(ring_state != 1) return;
+
+  for(unsigned u = 0; u < count; ) {
+    unsigned first = u, queued = 0;
+
+    for(; u < count; u++) {
+      if(io[u].disk->fd == -1) continue;
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+      if(!sqe) break;
+      io_uring_prep_read(sqe, io[u].disk->fd, io[u].buffer, io[u].count * DISK_CHUNK_SIZE, io[u].chunk_nr * DISK_CHUNK_SIZE);
+      io_uring_sqe_set_data(sqe, io + u);
+      queued++;
+    }
+
+    if(!queued) break;
+
+    int submitted = io_uring_submit_and_wait(&ring, queued);
+
+    // requests may be for several disks: each of them gets the syscall counted
+    for(unsigned i = first; i < u; i++) {
+      unsigned j = first;
+      while(j < i && io[j].disk != io[i].disk) j++;
+      if(j == i && io[i].disk->fd != -1) io[i].disk->stats.syscalls++;
+    }
+
+    if(submitted < 0) submitted = 0;
+
+    // wait for everything in flight: the kernel writes into the request buffers
+    for(int left = submitted; left; ) {
+      struct io_uring_cqe *cqe;
+      int err = io_uring_wait_cqe(&ring, &cqe);
+      if(err == -EINTR) continue;
+      if(err) {
+        // shutting down the ring cancels the requests still in flight
+        fprintf(stderr, "io_uring: %s, using pread() instead\n", strerror(-err));
+        io_uring_queue_exit(&ring);
+        ring_state = -1;
+        return;
+      }
+      disk_io_t *io_done = io_uring_cqe_get_data(cqe);
+      io_done->disk->stats.reads++;
+      if(cqe->res > 0) io_done->len = cqe->res;
+      io_uring_cqe_seen(&ring, cqe);
+      left--;
+    }
+
+    if((unsigned) submitted < queued) {
+      io_uring_queue_exit(&ring);
+      ring_state = -1;
+      return;
+    }
+  }
+}
+#endif
+
+
+int disk_cache_read(disk_t *disk, disk_chunk_t *chunk)
+{
+  if(!chunk || !chunk->data || chunk->nr == UINT64_MAX) return 1;
+
+  int match;
+  unsigned u = disk_find_chunk(disk, chunk->nr, &match);
+
+  if(!match) return 2;
+
+  if((disk->chunks.list[u].flags & DISK_CHUNK_POISONED)) {
+    memset(chunk->data, 0, DISK_CHUNK_SIZE);
+
+    return 3;
+  }
+
+  if((disk->chunks.list[u].flags & DISK_CHUNK_ZERO)) {
+    memset(chunk->data, 0, DISK_CHUNK_SIZE);
+  }
+  else if((disk->chunks.list[u].flags & DISK_CHUNK_MAPPED)) {
+    // the file can't be read anymore: forget the chunk, the caller reads it again
+    if(disk_map_copy(chunk->data, disk->chunks.list[u].data, DISK_CHUNK_SIZE)) {
+      disk_cache_remove(disk, u);
+
+      return 2;
+    }
+  }
+  else {
+    memcpy(chunk->data, disk->chunks.list[u].data, DISK_CHUNK_SIZE);
+  }
+
+  if((disk->chunks.list[u].flags & DISK_CHUNK_SPECULATIVE)) {
+    disk->chunks.list[u].flags &= ~DISK_CHUNK_SPECULATIVE;
+    disk->stats.speculative_used++;
+  }
+
+  disk->chunks.list[u].flags |= DISK_CHUNK_REF;
+
+  return 0;
+}
+
+
+int disk_cache_store(disk_t *disk, disk_chunk_t *chunk)
+{
+  if(!chunk || !chunk->data || chunk->nr == UINT64_MAX) return 1;
+
+  int match;
+  disk_find_chunk(disk, chunk->nr, &match);
+
+  if(match) return 0;
+
+  unsigned flags = chunk->flags & DISK_CHUNK_SPECULATIVE;
+
+  // zero chunks need no memory: no need to evict or pin them
+  if(disk_chunk_is_zero(chunk->data)) {
+    int err = disk_cache_add(disk, chunk->nr, NULL, flags | DISK_CHUNK_ZERO);
+    if(err) return err;
+    disk->stats.zero++;
+  }
+  else {
+    // keep everything needed for export; and we can't read imported data again
+    // (pinned chunks are not limited by the cache budget)
+    if(opt.export_file || disk->fd == -1) flags |= DISK_CHUNK_PINNED;
+    uint64_t max_chunks = ((uint64_t) (opt.cache_mb ?: DISK_CACHE_MB) << 20) / DISK_CHUNK_SIZE;
+    if(!(flags & DISK_CHUNK_PINNED) && disk_cache_chunks >= max_chunks && disk_cache_evict()) return 2;
+    void *buffer = disk_alloc_chunk(disk);
+    if(!buffer) return 3;
+    memcpy(buffer, chunk->data, DISK_CHUNK_SIZE);
+    int err = disk_cache_add(disk, chunk->nr, buffer, flags);
+    if(err) {
+      disk_free_chunk(disk, buffer);
+      return err;
+    }
+    if(!(flags & DISK_CHUNK_PINNED)) disk_cache_chunks++;
+  }
+
+  if((flags & DISK_CHUNK_SPECULATIVE)) disk->stats.speculative++;
+
+  return 0;
+}
+
+
+/*
+ * Find holes in a sparse file.
+ *
+ * Only chunks that are entirely within a hole are considered.
+ */
+static void disk_map_holes(disk_t *disk)
+{
+  off_t size = (off_t) disk->size_in_bytes;
+  off_t data, hole = 0;
+
+  while(hole < size) {
+    data = lseek(disk->fd, hole, SEEK_DATA);
+    // no more data: hole up to the end
+    if(data == -1 && errno == ENXIO) data = size;
+    if(data == -1) break;
+
+    uint64_t start = ((uint64_t) hole + DISK_CHUNK_SIZE - 1) / DISK_CHUNK_SIZE;
+    uint64_t end = (uint64_t) data / DISK_CHUNK_SIZE;
+
+    if(start < end) {
+      disk_hole_t *list = reallocarray(disk->holes.list, disk->holes.len + 1, sizeof *list);
+      if(!list) break;
+      disk->holes.list = list;
+      disk->holes.list[disk->holes.len++] = (disk_hole_t) { .start = start, .end = end };
+    }
+
+    if(data >= size) break;
+
+    hole = lseek(disk->fd, data, SEEK_HOLE);
+    if(hole == -1) break;
+  }
+}
+
+
+/*
+ * Look up chunk in the list of holes.
+ *
+ * Return 1 if the chunk is within a hole; 'next' is then the chunk after
+ * the hole. Else return 0; 'next' is then the start of the next hole (or
+ * UINT64_MAX).
+ */
+static int disk_hole_lookup(disk_t *disk, uint64_t chunk_nr, uint64_t *next)
+{
+  unsigned lo = 0, hi = disk->holes.len;
+
+  // find first hole that ends after chunk_nr
+  while(lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    if(disk->holes.list[mid].end <= chunk_nr) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  if(lo == disk->holes.len) {
+    *next = UINT64_MAX;
+
+    return 0;
+  }
+
+  if(disk->holes.list[lo].start <= chunk_nr) {
+    *next = disk->holes.list[lo].end;
+
+    return 1;
+  }
+
+  *next = disk->holes.list[lo].start;
+
+  return 0;
+}
+
+
+/*
+ * Mark chunks as unreadable.
+ *
+ * They are added to the cache without data, so they are not read again.
+ */
+static void disk_cache_poison(disk_t *disk, uint64_t chunk_nr, unsigned count)
+{
+  for(uint64_t nr = chunk_nr; nr < chunk_nr + count; nr++) {
+    int match;
+    disk_find_chunk(disk, nr, &match);
+    if(match || disk_cache_add(disk, nr, NULL, DISK_CHUNK_POISONED)) continue;
+    disk->stats.poisoned++;
+  }
+}
+
+
+/*
+ * Check if chunk data are all zeros.
+ *
+ * Written as a simple loop without early exit so the compiler can
+ * vectorize it (gcc does at -O2 since version 12, else with -O3).
+ */
+static int disk_chunk_is_zero(uint8_t *data)
+{
+  uint8_t acc = 0;
+
+  for(unsigned u = 0; u < DISK_CHUNK_SIZE; u++) acc |= data[u];
+
+  return !acc;
+}
+
+
+/*
+ * Read chunks from the file mapping.
+ *
+ * At most *count chunks starting at chunk_nr are copied to buffer; *count
+ * is set to the number of chunks actually copied.
+ *
+ * The mapping is all the cache needs; the chunks are added to the chunk
+ * list only for --export-disk.
+ *
+ * Return 0 if ok, 1 if the first chunk is not in the mapping or can't be
+ * read, 4 if out of memory.
+ */
+static int disk_map_read(disk_t *disk, void *buffer, uint64_t chunk_nr, unsigned *count)
+{
+  uint64_t map_chunks = disk->map_size / DISK_CHUNK_SIZE;
+  unsigned len = *count;
+
+  if(chunk_nr >= map_chunks) return 1;
+
+  if(len > map_chunks - chunk_nr) len = map_chunks - chunk_nr;
+
+  if(disk->read_around) {
+    disk_map_read_around(disk, chunk_nr);
+    disk_map_read_around(disk, chunk_nr + len - 1);
+  }
+
+  // on error, try the first chunk alone: the others are dealt with in the next round
+  if(disk_map_copy(buffer, disk->map + chunk_nr * DISK_CHUNK_SIZE, (size_t) len * DISK_CHUNK_SIZE)) {
+    len = 1;
+    if(disk_map_copy(buffer, disk->map + chunk_nr * DISK_CHUNK_SIZE, DISK_CHUNK_SIZE)) return 1;
+  }
+
+  disk->stats.mapped += len;
+
+  *count = len;
+
+  if(!opt.export_file) return 0;
+
+  for(uint64_t nr = chunk_nr; nr < chunk_nr + len; nr++) {
+    int match;
+    disk_find_chunk(disk, nr, &match);
+    if(!match && disk_cache_add(disk, nr, disk->map + nr * DISK_CHUNK_SIZE, DISK_CHUNK_MAPPED)) return 4;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Copy 'len' bytes from file mapping.
+ *
+ * If the file can't be read (i/o error, file was truncated), accessing the
+ * mapping raises SIGBUS. This is caught and reported as error.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int disk_map_copy(void *dst, void *src, size_t len)
+{
+  // the handler does not block the signal: no need to save the signal mask
+  if(sigsetjmp(disk_map_jmp, 0)) {
+    disk_map_active = 0;
+
+    return 1;
+  }
+
+  disk_map_active = 1;
+  memcpy(dst, src, len);
+  disk_map_active = 0;
+
+  return 0;
+}
+
+
+// SIGBUS handler: if not caused by disk_map_copy(), die as usual.
+static void disk_map_sigbus(int sig)
+{
+  if(disk_map_active) siglongjmp(disk_map_jmp, 1);
+
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+
+/*
+ * Add chunk to cache, using 'data' as chunk data.
+ *
+ * The chunk must not be in the cache already.
+ */
+static int disk_cache_add(disk_t *disk, uint64_t chunk_nr, uint8_t *data, unsigned flags)
+{
+  unsigned u = disk->chunks.len;
+
+  if(u + 1 > disk->chunks.max) {
+    disk_chunk_t *list = reallocarray(disk->chunks.list, disk->chunks.max + DISK_CHUNKS_EXTRA, sizeof *list);
+    if(!list) return 4;
+    disk->chunks.list = list;
+    disk->chunks.max += DISK_CHUNKS_EXTRA;
+  }
+
+  // keep hash table at most half full
+  if(2 * (u + 1) > (1u << disk->chunks.hash_bits)) {
+    if(disk_hash_resize(disk, disk->chunks.hash_bits ? disk->chunks.hash_bits + 1 : DISK_HASH_BITS)) return 4;
+  }
+
+  // new chunks are appended; the list gets sorted on demand
+  if(u && disk->chunks.list[u - 1].nr > chunk_nr) disk->chunks.unsorted = 1;
+  disk->chunks.list[u] = (disk_chunk_t) { .nr = chunk_nr, .data = data, .flags = flags };
+  disk->chunks.len++;
+  disk_hash_add(disk, u);
+
+  return 0;
+}
+
+
+// Hash table lookup.
+// If matched, return value is index into chunk list that matched.
+// If no match, return value is position at which to add new value (the
+// end of the list).
+unsigned disk_find_chunk(disk_t *disk, uint64_t chunk_nr, int *match)
+{
+  *match = 0;
+
+  if(!disk->chunks.hash) return disk->chunks.len;
+
+  unsigned mask = (1u << disk->chunks.hash_bits) - 1;
+
+  for(unsigned h = disk_hash(chunk_nr, disk->chunks.hash_bits); disk->chunks.hash[h]; h = (h + 1) & mask) {
+    unsigned u = disk->chunks.hash[h] - 1;
+    if(disk->chunks.list[u].nr == chunk_nr) {
+      *match = 1;
+      return u;
+    }
+  }
+
+  return disk->chunks.len;
+}
+
+
+/*
+ * Drop a chunk from the cache to make room for a new one.
+ *
+ * The chunk is chosen using the CLOCK algorithm over the chunks of all
+ * disks: recently used chunks get a second chance; pinned, mapped, zero, and
+ * unreadable chunks are never dropped.
+ *
+ * Return 0 if a chunk was dropped, else 1.
+ */
+static int disk_cache_evict()
+{
+  uint64_t total = 0;
+
+  for(unsigned u = 0; u < disk_list_size; u++) total += disk_list[u].chunks.len;
+
+  // two rounds at most: the first may just clear DISK_CHUNK_REF flags
+  for(uint64_t steps = 2 * total; steps; steps--) {
+    if(disk_clock.disk >= disk_list_size) disk_clock.disk = 0;
+    disk_t *disk = disk_list + disk_clock.disk;
+
+    if(disk_clock.idx >= disk->chunks.len) {
+      disk_clock.idx = 0;
+      disk_clock.disk++;
+      continue;
+    }
+
+    disk_chunk_t *chunk = disk->chunks.list + disk_clock.idx;
+
+    if((chunk->flags & (DISK_CHUNK_PINNED | DISK_CHUNK_MAPPED | DISK_CHUNK_ZERO | DISK_CHUNK_POISONED))) {
+      disk_clock.idx++;
+    }
+    else if((chunk->flags & DISK_CHUNK_REF)) {
+      chunk->flags &= ~DISK_CHUNK_REF;
+      disk_clock.idx++;
+    }
+    else {
+      // fprintf(stderr, "evict: disk %u, addr %08"PRIx64"\n", disk->index, chunk->nr * DISK_CHUNK_SIZE);
+      // the last list entry moves to the current position
+      disk_cache_remove(disk, disk_clock.idx);
+      disk->stats.evicted++;
+
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/*
+ * Remove chunk at list index 'idx' from cache.
+ *
+ * The last chunk in the list takes its place.
+ */
+static void disk_cache_remove(disk_t *disk, unsigned idx)
+{
+  unsigned mask = (1u << disk->chunks.hash_bits) - 1;
+  unsigned last = disk->chunks.len - 1;
+
+  if(!(disk->chunks.list[idx].flags & (DISK_CHUNK_MAPPED | DISK_CHUNK_ZERO | DISK_CHUNK_POISONED))) {
+    disk_free_chunk(disk, disk->chunks.list[idx].data);
+    if(!(disk->chunks.list[idx].flags & DISK_CHUNK_PINNED)) disk_cache_chunks--;
+  }
+
+  // remove hash entry; move following entries up to keep the probe sequences intact
+  unsigned h = disk_hash_slot(disk, idx);
+  disk->chunks.hash[h] = 0;
+
+  for(unsigned j = (h + 1) & mask; disk->chunks.hash[j]; j = (j + 1) & mask) {
+    unsigned k = disk_hash(disk->chunks.list[disk->chunks.hash[j] - 1].nr, disk->chunks.hash_bits);
+    if(((j - k) & mask) >= ((j - h) & mask)) {
+      disk->chunks.hash[h] = disk->chunks.hash[j];
+      disk->chunks.hash[j] = 0;
+      h = j;
+    }
+  }
+
+  if(idx != last) {
+    disk->chunks.hash[disk_hash_slot(disk, last)] = idx + 1;
+    disk->chunks.list[idx] = disk->chunks.list[last];
+    disk->chunks.unsorted = 1;
+  }
+
+  disk->chunks.len--;
+}
+
+
+// Sort chunk list by chunk number, if needed.
+void disk_sort_chunks(disk_t *disk)
+{
+  if(!disk->chunks.unsorted) return;
+
+  qsort(disk->chunks.list, disk->chunks.len, sizeof *disk->chunks.list, disk_chunk_cmp);
+
+  disk->chunks.unsorted = 0;
+
+  // list indices have changed
+  disk_hash_resize(disk, disk->chunks.hash_bits);
+}
+
+
+static unsigned disk_hash(uint64_t chunk_nr, unsigned bits)
+{
+  return (chunk_nr * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+}
+
+
+static void disk_hash_add(disk_t *disk, unsigned idx)
+{
+  unsigned mask = (1u << disk->chunks.hash_bits) - 1;
+  unsigned h = disk_hash(disk->chunks.list[idx].nr, disk->chunks.hash_bits);
+
+  while(disk->chunks.hash[h]) h = (h + 1) & mask;
+
+  disk->chunks.hash[h] = idx + 1;
+}
+
+
+// Hash slot referring to chunk list index 'idx'.
+static unsigned disk_hash_slot(disk_t *disk, unsigned idx)
+{
+  unsigned mask = (1u << disk->chunks.hash_bits) - 1;
+  unsigned h = disk_hash(disk->chunks.list[idx].nr, disk->chunks.hash_bits);
+
+  while(disk->chunks.hash[h] != idx + 1) h = (h + 1) & mask;
+
+  return h;
+}
+
+
+static int disk_hash_resize(disk_t *disk, unsigned bits)
+{
+  unsigned *hash = calloc(1u << bits, sizeof *hash);
+
+  if(!hash) return 1;
+
+  free(disk->chunks.hash);
+  disk->chunks.hash = hash;
+  disk->chunks.hash_bits = bits;
+
+  for(unsigned u = 0; u < disk->chunks.len; u++) {
+    disk_hash_add(disk, u);
+  }
+
+  return 0;
+}
+
+
+// Get memory for a chunk from the disk's slab allocator.
+// Slabs are only released all together in disk_free().
+static void *disk_alloc_chunk(disk_t *disk)
+{
+  if(disk->slabs.free) {
+    void *buffer = disk->slabs.free;
+    disk->slabs.free = *(uint8_t **) buffer;
+
+    return buffer;
+  }
+
+  if(!disk->slabs.len || disk->slabs.used + DISK_CHUNK_SIZE > disk->slabs.size) {
+    unsigned size = disk->slabs.size ? disk->slabs.size << 1 : DISK_SLAB_MIN_SIZE;
+    if(size > DISK_SLAB_MAX_SIZE) size = DISK_SLAB_MAX_SIZE;
+
+    uint8_t *slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(slab == MAP_FAILED) return NULL;
+
+    // if possible, let full-sized slabs use huge pages
+    if(size == DISK_SLAB_MAX_SIZE) madvise(slab, size, MADV_HUGEPAGE);
+
+    uint8_t **list = reallocarray(disk->slabs.list, disk->slabs.len + 1, sizeof *list);
+    if(!list) {
+      munmap(slab, size);
+      return NULL;
+    }
+
+    disk->slabs.list = list;
+    disk->slabs.list[disk->slabs.len++] = slab;
+    disk->slabs.size = size;
+    disk->slabs.used = 0;
+  }
+
+  void *buffer = disk->slabs.list[disk->slabs.len - 1] + disk->slabs.used;
+
+  disk->slabs.used += DISK_CHUNK_SIZE;
+
+  return buffer;
+}
+
+
+// Return chunk memory to the disk's slab allocator.
+static void disk_free_chunk(disk_t *disk, uint8_t *data)
+{
+  *(uint8_t **) data = disk->slabs.free;
+  disk->slabs.free = data;
+}
+
+
+static int disk_range_cmp(const void *a, const void *b)
+{
+  int64_t start_a = ((disk_range_t *) a)->start;
+  int64_t start_b = ((disk_range_t *) b)->start;
+
+  return start_a < start_b ? -1 : start_a > start_b;
+}
+
+
+static int disk_chunk_cmp(const void *a, const void *b)
+{
+  uint64_t nr_a = ((disk_chunk_t *) a)->nr;
+  uint64_t nr_b = ((disk_chunk_t *) b)->nr;
+
+  return nr_a < nr_b ? -1 : nr_a > nr_b;
+}
+
+
+int disk_export(disk_t *disk, char *file_name)
+{
+  FILE *f = stdout;
 
-  // fprintf(stderr, "read: %llu - %u (factor = %u)\n", (unsigned long long) block_nr, count, factor);
+  if(strcmp(file_name, "-")) {
+    f = fopen(file_name, "a");
+    if(!f) {
+      perror(file_name);
+      return 1;
+    }
+  }
 
-  uint64_t chunk_nr = block_nr * factor;
+  fprintf(f, "# disk %u, size = %"PRIu64"", disk->index, disk->size_in_bytes);
+  // keep the device's block size: partition table parsers depend on it
+  if(disk->logical_block_size) fprintf(f, ", block size = %u", disk->logical_block_size);
+  fprintf(f, "\n");
 
-  count *= factor;
+  disk_sort_chunks(disk);
 
-  for(unsigned u = 0; u < count; u++, chunk_nr++, buffer += DISK_CHUNK_SIZE) {
-    // fprintf(stderr, "read request: disk %u, addr %08"PRIx64"\n", disk->index, chunk_nr * DISK_CHUNK_SIZE);
-    if(disk_cache_read(disk, &(disk_chunk_t) { .nr = chunk_nr, .data = buffer })) {
-      int err = disk_read_single(disk, buffer, chunk_nr);
-      if(err) return err;
-      err = disk_cache_store(disk, &(disk_chunk_t) { .nr = chunk_nr, .data = buffer });
-      if(err) return err;
-    }
+  for(unsigned u = 0; u < disk->chunks.len; u++) {
+    disk_cache_dump(disk, disk->chunks.list + u, f);
   }
 
+  if(f != stdout) fclose(f);
+
   return 0;
 }
 
 
-int disk_read_single(disk_t *disk, void *buffer, uint64_t block_nr)
+/*
+ * Get file descriptor with the cached disk data in [start, start + size[.
+ *
+ * There is one memfd per disk, the size of the disk. It is created on
+ * first use and holds only the areas requested this way, so external
+ * tools see them at their disk offsets. Everything else reads as zeros.
+ * Each chunk is copied only once: cached chunks get DISK_CHUNK_MEMFD,
+ * areas copied from a file mapping are kept in disk->memfd_areas.
+ *
+ * The descriptor is owned by the disk; don't close it.
+ *
+ * Return -1 if the memfd can't be created or written.
+ */
+int disk_memfd(disk_t *disk, uint64_t start, uint64_t size)
 {
-  if(disk->fd == -1) {
-    // fprintf(stderr, "cache miss: disk %u, addr %08"PRIx64"\n", disk->index, block_nr * DISK_CHUNK_SIZE);
-    memset(buffer, 0, DISK_CHUNK_SIZE);
+  if(disk->memfd == -1) {
+    int fd = syscall(SYS_memfd_create, "", 0);
 
-    return 0;
+    if(fd == -1) return -1;
+
+    if(ftruncate(fd, (off_t) disk->size_in_bytes)) {
+      close(fd);
+
+      return -1;
+    }
+
+    disk->memfd = fd;
   }
 
-  // fprintf(stderr, "read: %llu[%llu]\n", (unsigned long long) block_nr, (unsigned long long) disk->size);
+  uint64_t first = start / DISK_CHUNK_SIZE;
+  uint64_t last = (start + size + DISK_CHUNK_SIZE - 1) / DISK_CHUNK_SIZE;
 
-  off_t offset = block_nr * DISK_CHUNK_SIZE;
+  if(last > disk->size_in_bytes / DISK_CHUNK_SIZE) last = disk->size_in_bytes / DISK_CHUNK_SIZE;
 
-  if(lseek(disk->fd, offset, SEEK_SET) != offset) {
-    fprintf(stderr, "sector %"PRIu64" not found\n", block_nr);
+  if(first >= last) return disk->memfd;
 
-    return 2;
-  }
+  if(disk->map) {
+    // mapped file: the mapping holds all data, the cache only part of it
+    uint8_t buf[DISK_CHUNK_SIZE];
 
-  if(read(disk->fd, buffer, DISK_CHUNK_SIZE) != DISK_CHUNK_SIZE) {
-    fprintf(stderr, "error reading sector %"PRIu64"\n", block_nr);
+    for(uint64_t nr = first; nr < last; nr++) {
+      if(disk_memfd_area(disk, nr) || (nr + 1) * DISK_CHUNK_SIZE > disk->map_size) continue;
+      if(
+        disk_map_copy(buf, disk->map + nr * DISK_CHUNK_SIZE, DISK_CHUNK_SIZE) ||
+        pwrite(disk->memfd, buf, DISK_CHUNK_SIZE, (off_t) (nr * DISK_CHUNK_SIZE)) != DISK_CHUNK_SIZE
+      ) return -1;
+    }
 
-    return 3;
+    disk_hole_t *list = reallocarray(disk->memfd_areas.list, disk->memfd_areas.len + 1, sizeof *list);
+    if(!list) return -1;
+    disk->memfd_areas.list = list;
+    disk->memfd_areas.list[disk->memfd_areas.len++] = (disk_hole_t) { .start = first, .end = last };
+  }
+  else if(last - first < disk->chunks.len) {
+    // small area: look up each chunk
+    for(uint64_t nr = first; nr < last; nr++) {
+      int match;
+      unsigned u = disk_find_chunk(disk, nr, &match);
+      if(match && disk_memfd_write(disk, disk->chunks.list + u)) return -1;
+    }
+  }
+  else {
+    // large area: go through the cache
+    for(unsigned u = 0; u < disk->chunks.len; u++) {
+      disk_chunk_t *chunk = disk->chunks.list + u;
+      if(chunk->nr >= first && chunk->nr < last && disk_memfd_write(disk, chunk)) return -1;
+    }
   }
 
-  return 0;
+  return disk->memfd;
 }
 
 
-int disk_cache_read(disk_t *disk, disk_chunk_t *chunk)
+/*
+ * Copy chunk to the memfd, unless it's already there.
+ *
+ * Zero and unreadable chunks have no data; they stay holes.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int disk_memfd_write(disk_t *disk, disk_chunk_t *chunk)
 {
-  if(!chunk || !chunk->data || chunk->nr == UINT64_MAX) return 1;
+  if((chunk->flags & DISK_CHUNK_MEMFD) || !chunk->data) return 0;
 
-  int match;
-  unsigned u = disk_find_chunk(disk, chunk->nr, &match);
-
-  if(!match) return 2;
+  if(pwrite(disk->memfd, chunk->data, DISK_CHUNK_SIZE, (off_t) (chunk->nr * DISK_CHUNK_SIZE)) != DISK_CHUNK_SIZE) return 1;
 
-  memcpy(chunk->data, disk->chunks.list[u].data, DISK_CHUNK_SIZE);
+  chunk->flags |= DISK_CHUNK_MEMFD;
 
   return 0;
 }
 
 
-int disk_cache_store(disk_t *disk, disk_chunk_t *chunk)
+/*
+ * Check if chunk of a mapped file has already been copied to the memfd.
+ *
+ * Return 1 if yes, else 0.
+ */
+static int disk_memfd_area(disk_t *disk, uint64_t chunk_nr)
 {
-  if(!chunk || !chunk->data || chunk->nr == UINT64_MAX) return 1;
-
-  int match;
-  unsigned u = disk_find_chunk(disk, chunk->nr, &match);
-
-  if(!match) {
-    if(disk->chunks.len >= DISK_MAX_CHUNKS) return 2;
-    void *buffer = malloc(DISK_CHUNK_SIZE);
-    if(!buffer) return 3;
-    memcpy(buffer, chunk->data, DISK_CHUNK_SIZE);
-    disk->chunks.len++;
-    if(disk->chunks.len > disk->chunks.max) {
-      disk->chunks.max += DISK_CHUNKS_EXTRA;
-      disk->chunks.list = realloc(disk->chunks.list, disk->chunks.max * sizeof (disk_chunk_t));
-      if(disk->chunks.list == NULL) {
-        free(buffer);
-        disk->chunks.len = disk->chunks.max = 0;
-        return 4;
-      }
-    }
-    if(u + 1 < disk->chunks.len) {
-      memmove(disk->chunks.list + u + 1, disk->chunks.list + u, sizeof (disk_chunk_t) * (disk->chunks.len - u - 1));
-    }
-    disk->chunks.list[u].nr = chunk->nr;
-    disk->chunks.list[u].data = buffer;
+  for(unsigned u = 0; u < disk->memfd_areas.len; u++) {
+    if(chunk_nr >= disk->memfd_areas.list[u].start && chunk_nr < disk->memfd_areas.list[u].end) return 1;
   }
 
   return 0;
 }
 
 
-// Binary search.
-// If matched, return value is index that matched.
-// If no match, return value is position at which to insert new value (may
-// point at position right after end of the list).
-unsigned disk_find_chunk(disk_t *disk, uint64_t chunk_nr, int *match)
+/*
+ * Run func(fd, data) with fd showing the disk data in [start, start + size[
+ * at their disk offsets, read only when func actually reads them.
+ *
+ * func runs in a separate thread with a seccomp filter that turns its
+ * read() and pread() calls on fd into notifications. They are answered
+ * here, through the cache; everything outside the area reads as zeros.
+ * The bytes handed out count as fs_probe_bytes.
+ *
+ * Return 0 and func's return value in 'result' if func was run, or -1 if
+ * the kernel does not support it.
+ */
+int disk_lazy_run(disk_t *disk, uint64_t start, uint64_t size, int (*func)(int fd, void *data), void *data, int *result)
 {
-  *match = 0;
+#ifdef SECCOMP_FILTER_FLAG_NEW_LISTENER
+  static int unsupported;
+  struct seccomp_notif_sizes sizes;
+  pthread_t thread;
 
-  disk_chunk_t *chunk_list = disk->chunks.list;
+  if(unsupported) return -1;
 
-  unsigned u_start = 0;
-  unsigned u_end = disk->chunks.len;
-  unsigned u = 0;
+  int fd = disk_memfd(disk, start, 0);
 
-  while(u_end > u_start) {
-    u = (u_end + u_start) / 2;
+  if(fd == -1 || syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes)) return -1;
 
-    int64_t i = chunk_nr - chunk_list[u].nr;
+  disk_lazy_t lazy = { .fd = fd, .listener = -1, .func = func, .data = data };
 
-    if(i == 0) {
-      *match = 1;
+  sem_init(&lazy.ready, 0, 0);
+
+  if(pthread_create(&thread, NULL, disk_lazy_thread, &lazy)) {
+    sem_destroy(&lazy.ready);
+
+    return -1;
+  }
+
+  while(sem_wait(&lazy.ready) && errno == EINTR);
+
+  sem_destroy(&lazy.ready);
+
+  if(lazy.listener == -1) {
+    pthread_join(thread, NULL);
+    unsupported = 1;
+
+    return -1;
+  }
+
+  struct seccomp_notif *req = calloc(1, sizes.seccomp_notif);
+  struct seccomp_notif_resp *resp = calloc(1, sizes.seccomp_notif_resp);
+
+  // the thread ends when func returns; the listener then reports POLLHUP
+  while(req && resp) {
+    struct pollfd pfd = { .fd = lazy.listener, .events = POLLIN };
+
+    if(poll(&pfd, 1, -1) == -1) {
+      if(errno == EINTR) continue;
       break;
     }
 
-    if(u_end == u_start + 1) {
-      if(i > 0) u++;
+    if(!(pfd.revents & POLLIN)) break;
+
+    memset(req, 0, sizes.seccomp_notif);
+
+    if(ioctl(lazy.listener, SECCOMP_IOCTL_NOTIF_RECV, req)) {
+      if(errno == EINTR || errno == ENOENT) continue;
       break;
     }
 
-    if(i > 0) {
-      if(u_end == u + 1) {
-        if(i > 0) u++;
-        break;
-      }
-      u_start = u;
+    memset(resp, 0, sizes.seccomp_notif_resp);
+    resp->id = req->id;
+
+    // read() uses (and moves) the file position
+    int is_read = req->data.nr == __NR_read;
+    off_t pos = is_read ? lseek(fd, 0, SEEK_CUR) : (off_t) req->data.args[3];
+    uint8_t *buf = (uint8_t *) req->data.args[1];
+    uint64_t len = req->data.args[2];
+
+    if(pos < 0) {
+      resp->error = -EINVAL;
     }
     else {
-      u_end = u;
-    }
-  }
+      uint64_t area_start = (uint64_t) pos, area_end;
 
-  return u;
-}
+      // nothing beyond the disk end
+      if(area_start >= disk->size_in_bytes) len = 0;
+      else if(len > disk->size_in_bytes - area_start) len = disk->size_in_bytes - area_start;
 
+      // the part inside the area comes from the cache
+      area_end = area_start + len;
+      if(area_start < start) area_start = start;
+      if(area_end > start + size) area_end = start + size;
 
-int disk_export(disk_t *disk, char *file_name)
-{
-  FILE *f = stdout;
+      memset(buf, 0, len);
 
-  if(strcmp(file_name, "-")) {
-    f = fopen(file_name, "a");
-    if(!f) {
-      perror(file_name);
-      return 1;
+      if(area_start < area_end) {
+        if(disk_read_bytes(disk, buf + (area_start - (uint64_t) pos), area_start, (unsigned) (area_end - area_start)) == 4) {
+          resp->error = -ENOMEM;
+        }
+        disk->stats.fs_probe_bytes += area_end - area_start;
+      }
+
+      if(!resp->error) {
+        resp->val = (int64_t) len;
+        if(is_read) lseek(fd, pos + (off_t) len, SEEK_SET);
+      }
     }
+
+    // the thread may be gone already; nothing to do then
+    ioctl(lazy.listener, SECCOMP_IOCTL_NOTIF_SEND, resp);
   }
 
-  fprintf(f, "# disk %u, size = %"PRIu64"\n", disk->index, disk->size_in_bytes);
+  // pending and future notifications fail now, so the thread won't block
+  close(lazy.listener);
 
-  for(unsigned u = 0; u < disk->chunks.len; u++) {
-    disk_cache_dump(disk, disk->chunks.list + u, f);
-  }
+  pthread_join(thread, NULL);
 
-  if(f != stdout) fclose(f);
+  free(req);
+  free(resp);
+
+  *result = lazy.result;
 
   return 0;
+#else
+  return -1;
+#endif
 }
 
 
-int disk_to_fd(disk_t *disk, uint64_t offset)
+#ifdef SECCOMP_FILTER_FLAG_NEW_LISTENER
+static void *disk_lazy_thread(void *arg)
 {
-  int fd = syscall(SYS_memfd_create, "", 0);
+  disk_lazy_t *lazy = arg;
+
+  // read() and pread() on the fd go to the listener, all else is allowed
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_read, 2, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_pread64, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args[0]) + DISK_LAZY_ARG_LOW),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned) lazy->fd, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+  };
+  struct sock_fprog prog = { .len = sizeof filter / sizeof *filter, .filter = filter };
+
+  // both apply to this thread only, which ends with func
+  if(!prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)) {
+    lazy->listener = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+  }
 
-  if(fd == -1) return 0;
+  int ok = lazy->listener != -1;
 
-  for(unsigned u = 0; u < disk->chunks.len; u++) {
-    if(disk->chunks.list[u].nr * DISK_CHUNK_SIZE >= offset) {
-      lseek(fd, disk->chunks.list[u].nr * DISK_CHUNK_SIZE - offset, SEEK_SET);
-      write(fd, disk->chunks.list[u].data, DISK_CHUNK_SIZE);
-    }
-  }
+  // lazy is not to be touched after this, unless ok
+  sem_post(&lazy->ready);
 
-  lseek(fd, 0, SEEK_SET);
+  if(ok) lazy->result = lazy->func(lazy->fd, lazy->data);
 
-  return fd;
+  return NULL;
 }
+#endif
 
 
 int disk_cache_dump(disk_t *disk, disk_chunk_t *chunk, FILE *file)
 {
   if(!file) return 1;
 
+  // all-zero lines are not shown anyway; unreadable chunks have no data
+  if((chunk->flags & (DISK_CHUNK_ZERO | DISK_CHUNK_POISONED))) return 0;
+
   uint8_t all_zeros[16] = {};
+  uint8_t buf[DISK_CHUNK_SIZE];
   uint8_t *data = chunk->data;
 
+  if((chunk->flags & DISK_CHUNK_MAPPED)) {
+    if(disk_map_copy(buf, chunk->data, DISK_CHUNK_SIZE)) return 1;
+    data = buf;
+  }
+
   uint64_t max_addr = disk->size_in_bytes - 1;
   unsigned address_digits = 0;
   while(max_addr >>= 4) address_digits++;
@@ -240,6 +1696,453 @@ int disk_cache_dump(disk_t *disk, disk_chunk_t *chunk, FILE *file)
 }
 
 
+/*
+ * Read the areas listed in the read plans of all parsers in advance.
+ *
+ * 'plans' is a NULL-terminated list of read plans. The areas of all plans
+ * are merged and read for all disks (or just 'disk', if not NULL) with a
+ * single batch of requests.
+ *
+ * For mapped files, the kernel is just told to read the data in advance.
+ */
+void disk_prefetch(disk_t *disk_only, disk_range_t **plans)
+{
+  unsigned ranges_len = 0;
+
+  for(disk_range_t **plan = plans; *plan; plan++) {
+    for(disk_range_t *r = *plan; r->size; r++) ranges_len++;
+  }
+
+  disk_range_t ranges[ranges_len ?: 1];
+  disk_io_t *io = NULL;
+  unsigned io_len = 0, io_max = 0;
+  void **buffers = NULL;
+  unsigned buffers_len = 0;
+
+  for(unsigned u = 0; u < disk_list_size; u++) {
+    disk_t *disk = disk_list + u;
+    uint64_t disk_size = disk->size_in_bytes - disk->size_in_bytes % DISK_CHUNK_SIZE;
+
+    if(disk->fd == -1 || !disk_size || (disk_only && disk != disk_only)) continue;
+
+    // get areas in chunk units
+    unsigned len = 0;
+    for(disk_range_t **plan = plans; *plan; plan++) {
+      for(disk_range_t *r = *plan; r->size; r++) {
+        int64_t start = r->start < 0 ? (int64_t) disk_size + r->start : r->start;
+        int64_t end = start + r->size;
+        if(start < 0) start = 0;
+        if(end > (int64_t) disk_size) end = disk_size;
+        if(start >= end) continue;
+        ranges[len].start = start / DISK_CHUNK_SIZE;
+        ranges[len++].size = (end + DISK_CHUNK_SIZE - 1) / DISK_CHUNK_SIZE - start / DISK_CHUNK_SIZE;
+      }
+    }
+
+    qsort(ranges, len, sizeof *ranges, disk_range_cmp);
+
+    for(unsigned r = 0; r < len; ) {
+      uint64_t start = ranges[r].start;
+      uint64_t end = start + ranges[r].size;
+
+      for(r++; r < len && (uint64_t) ranges[r].start <= end + DISK_PREFETCH_GAP / DISK_CHUNK_SIZE; r++) {
+        if(ranges[r].start + ranges[r].size > end) end = ranges[r].start + ranges[r].size;
+      }
+
+      // fprintf(stderr, "prefetch: disk %u, %"PRIu64" - %"PRIu64"\n", disk->index, start, end - 1);
+
+      if(disk->map) {
+        uint64_t page_mask = (uint64_t) sysconf(_SC_PAGESIZE) - 1;
+        uint64_t map_start = (start * DISK_CHUNK_SIZE) & ~page_mask;
+        madvise(disk->map + map_start, end * DISK_CHUNK_SIZE - map_start, MADV_WILLNEED);
+        continue;
+      }
+
+      void *buffer = malloc((end - start) * DISK_CHUNK_SIZE);
+      void **buffers_new = buffer ? reallocarray(buffers, buffers_len + 1, sizeof *buffers) : NULL;
+      if(!buffers_new) {
+        free(buffer);
+        continue;
+      }
+      buffers = buffers_new;
+      buffers[buffers_len++] = buffer;
+
+      // queue runs of chunks not in cache
+      for(uint64_t nr = start; nr < end; ) {
+        int match;
+        unsigned cnt = 0;
+        while(nr + cnt < end && (disk_find_chunk(disk, nr + cnt, &match), !match)) cnt++;
+        if(cnt) {
+          if(io_len == io_max) {
+            disk_io_t *io_new = reallocarray(io, io_max + DISK_IO_BATCH, sizeof *io);
+            if(!io_new) break;
+            io = io_new;
+            io_max += DISK_IO_BATCH;
+          }
+          io[io_len++] = (disk_io_t) { .disk = disk, .buffer = buffer + (nr - start) * DISK_CHUNK_SIZE, .chunk_nr = nr, .count = cnt };
+        }
+        nr += cnt ?: 1;
+      }
+    }
+  }
+
+  // errors are reported again when the data are actually needed
+  if(io_len) disk_read_batch(io, io_len);
+
+  for(unsigned u = 0; u < buffers_len; u++) free(buffers[u]);
+
+  free(buffers);
+  free(io);
+}
+
+
+void disk_show_stats(disk_t *disk)
+{
+  // the old code used a lseek() + read() pair for each chunk; retries may need more
+  uint64_t old_syscalls = 2 * disk->stats.chunks;
+  uint64_t saved = old_syscalls > disk->stats.syscalls ? old_syscalls - disk->stats.syscalls : 0;
+
+  log_info(SEP "\ndisk cache:\n");
+  log_info("  chunks: %u (%"PRIu64" kiB)\n", disk->chunks.len, ((uint64_t) disk->chunks.len * DISK_CHUNK_SIZE) >> 10);
+  if(disk->map) log_info("  chunks copied from file mapping: %"PRIu64"\n", disk->stats.mapped);
+  if(disk->stats.zero) log_info("  zero chunks: %"PRIu64" (no data stored)\n", disk->stats.zero);
+  if(disk->read_around && disk->map) {
+    log_info("  read-around: %u kiB (%"PRIu64" windows read ahead in mapped file)\n",
+      disk->read_around * DISK_CHUNK_SIZE >> 10,
+      disk->stats.map_windows
+    );
+  }
+  else if(disk->read_around) {
+    log_info("  read-around: %u kiB (%"PRIu64" chunks read ahead, %"PRIu64" used)\n",
+      disk->read_around * DISK_CHUNK_SIZE >> 10,
+      disk->stats.speculative,
+      disk->stats.speculative_used
+    );
+  }
+  if(disk->stats.persistent) log_info("  persistent cache: %"PRIu64" chunks loaded\n", disk->stats.persistent);
+  if(disk->holes.len) {
+    log_info("  holes: %u (%"PRIu64" chunks not read)\n", disk->holes.len, disk->stats.holes);
+  }
+  if(disk->stats.fs_probes || disk->stats.fs_probe_hits) {
+    log_info("  fs probes: %"PRIu64" (%"PRIu64" more answered from earlier results)\n", disk->stats.fs_probes, disk->stats.fs_probe_hits);
+    log_info("  fs probes without blkid: %"PRIu64"\n", disk->stats.fs_native);
+    log_info("  fs probe data: %"PRIu64" bytes\n", disk->stats.fs_probe_bytes);
+  }
+  if(disk->stats.retries) log_info("  retried reads: %"PRIu64"\n", disk->stats.retries);
+  if(disk->stats.evicted) log_info("  evicted chunks: %"PRIu64"\n", disk->stats.evicted);
+  log_info("  device reads: %"PRIu64" (%"PRIu64" chunks, %"PRIu64" syscalls, %"PRIu64" saved)\n",
+    disk->stats.reads,
+    disk->stats.chunks,
+    disk->stats.syscalls,
+    saved
+  );
+
+  json_object *json_cache = json_object_new_object();
+  json_object_object_add(disk->json_disk, "cache", json_cache);
+
+  json_object_object_add(json_cache, "chunks", json_object_new_int64(disk->chunks.len));
+  json_object_object_add(json_cache, "chunk_size", json_object_new_int(DISK_CHUNK_SIZE));
+  json_object_object_add(json_cache, "reads", json_object_new_int64(disk->stats.reads));
+  json_object_object_add(json_cache, "chunks_read", json_object_new_int64(disk->stats.chunks));
+  json_object_object_add(json_cache, "syscalls", json_object_new_int64(disk->stats.syscalls));
+  if(disk->map) json_object_object_add(json_cache, "mapped_chunks", json_object_new_int64(disk->stats.mapped));
+  json_object_object_add(json_cache, "zero_chunks", json_object_new_int64(disk->stats.zero));
+  json_object_object_add(json_cache, "read_around", json_object_new_int(disk->read_around * DISK_CHUNK_SIZE));
+  json_object_object_add(json_cache, "speculative_chunks", json_object_new_int64(disk->stats.speculative));
+  json_object_object_add(json_cache, "speculative_chunks_used", json_object_new_int64(disk->stats.speculative_used));
+  if(disk->map) json_object_object_add(json_cache, "mapped_read_around_windows", json_object_new_int64(disk->stats.map_windows));
+  json_object_object_add(json_cache, "persistent_chunks", json_object_new_int64(disk->stats.persistent));
+  json_object_object_add(json_cache, "hole_chunks", json_object_new_int64(disk->stats.holes));
+  json_object_object_add(json_cache, "fs_probes", json_object_new_int64(disk->stats.fs_probes));
+  json_object_object_add(json_cache, "fs_probe_hits", json_object_new_int64(disk->stats.fs_probe_hits));
+  json_object_object_add(json_cache, "fs_native", json_object_new_int64(disk->stats.fs_native));
+  json_object_object_add(json_cache, "fs_probe_bytes", json_object_new_int64(disk->stats.fs_probe_bytes));
+  json_object_object_add(json_cache, "retries", json_object_new_int64(disk->stats.retries));
+  json_object_object_add(json_cache, "evicted_chunks", json_object_new_int64(disk->stats.evicted));
+  json_object_object_add(json_cache, "syscalls_saved", json_object_new_int64(saved));
+}
+
+
+/*
+ * Show disk areas that could not be read.
+ *
+ * Shows nothing if there were no read errors.
+ */
+void disk_show_unreadable(disk_t *disk)
+{
+  if(!disk->stats.poisoned) return;
+
+  disk_sort_chunks(disk);
+
+  log_info(SEP "\nunreadable areas:\n");
+
+  json_object *json_unreadable = json_object_new_array();
+  json_object_object_add(disk->json_disk, "unreadable", json_unreadable);
+
+  for(unsigned u = 0; u < disk->chunks.len; u++) {
+    if(!(disk->chunks.list[u].flags & DISK_CHUNK_POISONED)) continue;
+
+    uint64_t start = disk->chunks.list[u].nr;
+    uint64_t end = start + 1;
+
+    while(
+      u + 1 < disk->chunks.len &&
+      disk->chunks.list[u + 1].nr == end &&
+      (disk->chunks.list[u + 1].flags & DISK_CHUNK_POISONED)
+    ) {
+      u++;
+      end++;
+    }
+
+    log_info("  0x%"PRIx64" - 0x%"PRIx64" (%"PRIu64" bytes)\n",
+      start * DISK_CHUNK_SIZE,
+      end * DISK_CHUNK_SIZE - 1,
+      (end - start) * DISK_CHUNK_SIZE
+    );
+
+    json_object *json_range = json_object_new_object();
+    json_object_array_add(json_unreadable, json_range);
+    json_object_object_add(json_range, "start", json_object_new_int64(start * DISK_CHUNK_SIZE));
+    json_object_object_add(json_range, "size", json_object_new_int64((end - start) * DISK_CHUNK_SIZE));
+  }
+
+  if(disk->hung) log_info("  device stopped responding\n");
+
+  json_object_object_add(disk->json_disk, "timed_out", json_object_new_boolean(disk->hung));
+}
+
+
+/*
+ * Get device identity for the persistent cache.
+ *
+ * For regular files, this is (device, inode | size, mtime). For block
+ * devices, it's the disk's WWN or serial number from sysfs, plus the
+ * partition start and size.
+ *
+ * Return NULL if the device can't be identified; return value must be freed.
+ */
+static char *disk_cache_key(struct stat *sbuf)
+{
+  char *key = NULL;
+
+  if(S_ISREG(sbuf->st_mode)) {
+    if(asprintf(&key, "file:%"PRIu64":%"PRIu64"|%"PRIu64":%"PRIu64".%09ld",
+      (uint64_t) sbuf->st_dev, (uint64_t) sbuf->st_ino, (uint64_t) sbuf->st_size,
+      (uint64_t) sbuf->st_mtim.tv_sec, sbuf->st_mtim.tv_nsec
+    ) == -1) key = NULL;
+  }
+  else if(S_ISBLK(sbuf->st_mode)) {
+    char id[256], start[32] = "0";
+    if(
+      disk_sysfs_read(sbuf, "device/wwid", id, sizeof id) &&
+      disk_sysfs_read(sbuf, "wwid", id, sizeof id) &&
+      disk_sysfs_read(sbuf, "device/serial", id, sizeof id)
+    ) return NULL;
+    disk_sysfs_read(sbuf, "start", start, sizeof start);
+    if(asprintf(&key, "block:%s:%s", id, start) == -1) key = NULL;
+  }
+
+  return key;
+}
+
+
+/*
+ * Name of persistent cache file; must be freed.
+ *
+ * The name is based on the part of the cache key before '|', so the file
+ * gets replaced when a disk image file is modified.
+ */
+static char *disk_cache_file(disk_t *disk)
+{
+  char *name = NULL;
+
+  uint64_t hash = fnv1a_hash(disk->cache_key, strcspn(disk->cache_key, "|"), FNV1A_INIT);
+
+  if(asprintf(&name, "%s/%016"PRIx64".cache", opt.cache_dir, hash) == -1) name = NULL;
+
+  return name;
+}
+
+
+/*
+ * Calculate digest over disk head and tail.
+ *
+ * This is where partition tables live; if they are unchanged, the disk
+ * most likely is.
+ *
+ * Return 0 if ok.
+ */
+static int disk_cache_digest(disk_t *disk, uint64_t *digest)
+{
+  uint64_t chunks = disk->size_in_bytes / DISK_CHUNK_SIZE;
+  unsigned window = DISK_CACHE_CHECK_SIZE / DISK_CHUNK_SIZE;
+  uint8_t buf[DISK_CACHE_CHECK_SIZE];
+  unsigned block_size = disk->block_size;
+  int err;
+
+  if(window > chunks) window = chunks;
+
+  disk->block_size = DISK_CHUNK_SIZE;
+
+  err = disk_read(disk, buf, 0, window);
+  *digest = fnv1a_hash(buf, window * DISK_CHUNK_SIZE, FNV1A_INIT);
+
+  if(!err) err = disk_read(disk, buf, chunks - window, window);
+  *digest = fnv1a_hash(buf, window * DISK_CHUNK_SIZE, *digest);
+
+  disk->block_size = block_size;
+
+  return err;
+}
+
+
+/*
+ * Load chunks from persistent cache.
+ *
+ * The cache is used if disk size and the digest over disk head and tail
+ * match.
+ *
+ * Mapped files don't use it: they are read from the mapping.
+ */
+static void disk_cache_load(disk_t *disk)
+{
+  char *name = disk_cache_file(disk);
+  FILE *f = name ? fopen(name, "r") : NULL;
+  disk_cache_header_t header;
+  uint64_t digest;
+
+  free(name);
+
+  if(!f) return;
+
+  char key[strlen(disk->cache_key) + 1];
+
+  if(
+    fread(&header, sizeof header, 1, f) == 1 &&
+    !memcmp(header.magic, DISK_CACHE_MAGIC, sizeof header.magic) &&
+    header.chunk_size == DISK_CHUNK_SIZE &&
+    header.size == disk->size_in_bytes &&
+    header.key_len == sizeof key - 1 &&
+    fread(key, header.key_len, 1, f) == 1 &&
+    !memcmp(key, disk->cache_key, header.key_len) &&
+    !disk_cache_digest(disk, &digest) &&
+    digest == header.digest
+  ) {
+    uint8_t buf[DISK_CHUNK_SIZE];
+    uint64_t nr;
+
+    for(uint64_t u = 0; u < header.chunks && fread(&nr, sizeof nr, 1, f) == 1; u++) {
+      int is_zero = (nr & DISK_CACHE_ZERO) != 0;
+      nr &= ~DISK_CACHE_ZERO;
+      if(is_zero) {
+        memset(buf, 0, sizeof buf);
+      }
+      else if(fread(buf, sizeof buf, 1, f) != 1) {
+        break;
+      }
+      int match;
+      disk_find_chunk(disk, nr, &match);
+      if(match || nr >= disk->size_in_bytes / DISK_CHUNK_SIZE) continue;
+      if(disk_cache_store(disk, &(disk_chunk_t) { .nr = nr, .data = buf })) break;
+      disk->stats.persistent++;
+    }
+  }
+
+  fclose(f);
+}
+
+
+/*
+ * Write cached chunks to persistent cache.
+ *
+ * The file is replaced atomically. Nothing is written for mapped files.
+ */
+void disk_cache_save(disk_t *disk)
+{
+  uint64_t digest;
+
+  if(!disk->cache_key || disk->fd == -1 || disk->hung || disk->map) return;
+
+  if(disk_cache_digest(disk, &digest)) return;
+
+  char *name = disk_cache_file(disk);
+  char *tmp_name = NULL;
+
+  if(!name || asprintf(&tmp_name, "%s.%d", name, (int) getpid()) == -1) {
+    free(name);
+    return;
+  }
+
+  mkdir(opt.cache_dir, 0700);
+
+  FILE *f = fopen(tmp_name, "w");
+
+  if(f) {
+    disk_cache_header_t header = {
+      .magic = DISK_CACHE_MAGIC,
+      .size = disk->size_in_bytes,
+      .digest = digest,
+      .key_len = strlen(disk->cache_key),
+      .chunk_size = DISK_CHUNK_SIZE
+    };
+
+    for(unsigned u = 0; u < disk->chunks.len; u++) {
+      if(!(disk->chunks.list[u].flags & DISK_CHUNK_POISONED)) header.chunks++;
+    }
+
+    int ok = fwrite(&header, sizeof header, 1, f) == 1 && fwrite(disk->cache_key, header.key_len, 1, f) == 1;
+
+    for(unsigned u = 0; ok && u < disk->chunks.len; u++) {
+      disk_chunk_t *chunk = disk->chunks.list + u;
+      if((chunk->flags & DISK_CHUNK_POISONED)) continue;
+      uint64_t nr = chunk->nr | ((chunk->flags & DISK_CHUNK_ZERO) ? DISK_CACHE_ZERO : 0);
+      ok = fwrite(&nr, sizeof nr, 1, f) == 1;
+      if(ok && !(chunk->flags & DISK_CHUNK_ZERO)) ok = fwrite(chunk->data, DISK_CHUNK_SIZE, 1, f) == 1;
+    }
+
+    if(fclose(f)) ok = 0;
+
+    if(!ok || rename(tmp_name, name)) unlink(tmp_name);
+  }
+
+  free(tmp_name);
+  free(name);
+}
+
+
+/*
+ * Get block sizes partition table parsers should try, in that order.
+ *
+ * If the device reports its logical block size, that one is tried,
+ * followed by 2048 (CD images copied to a disk keep their 2k partition
+ * tables); with opt.all_block_sizes, all others follow.
+ *
+ * Return number of entries in 'sizes' (at most DISK_BLOCK_SIZES).
+ */
+unsigned disk_block_sizes(disk_t *disk, unsigned *sizes)
+{
+  unsigned native = disk->logical_block_size;
+  unsigned len = 0;
+
+  // only sizes parsers can handle
+  if(native < 0x200 || native > 0x1000 || (native & (native - 1))) native = 0;
+
+  if(native) {
+    sizes[len++] = native;
+    if(!opt.all_block_sizes) {
+      if(native != 0x800) sizes[len++] = 0x800;
+      return len;
+    }
+  }
+
+  for(unsigned size = 0x200; size <= 0x1000; size <<= 1) {
+    if(size != native) sizes[len++] = size;
+  }
+
+  return len;
+}
+
+
 void disk_add_to_list(disk_t *disk)
 {
   json_object *json;
@@ -261,15 +2164,77 @@ void disk_add_to_list(disk_t *disk)
   json_object_object_add(json_device, "file_name", json_object_new_string(disk->name));
   json_object_object_add(json_device, "block_size", json_object_new_int(disk->block_size));
   json_object_object_add(json_device, "size", json_object_new_int64(disk->size_in_bytes / disk->block_size));
+
+  if(disk->logical_block_size) {
+    log_info("  logical block size: %u, physical block size: %u\n", disk->logical_block_size, disk->physical_block_size);
+    log_info("  optimal i/o size: %u, alignment offset: %d\n", disk->optimal_io_size, disk->alignment_offset);
+
+    json_object_object_add(json_device, "logical_block_size", json_object_new_int(disk->logical_block_size));
+    json_object_object_add(json_device, "physical_block_size", json_object_new_int(disk->physical_block_size));
+    json_object_object_add(json_device, "optimal_io_size", json_object_new_int(disk->optimal_io_size));
+    json_object_object_add(json_device, "alignment_offset", json_object_new_int(disk->alignment_offset));
+  }
+}
+
+
+void disk_free(disk_t *disk)
+{
+  for(unsigned u = 0; u < disk->chunks.len; u++) {
+    if(!(disk->chunks.list[u].flags & (DISK_CHUNK_PINNED | DISK_CHUNK_MAPPED | DISK_CHUNK_ZERO | DISK_CHUNK_POISONED))) disk_cache_chunks--;
+  }
+
+  for(unsigned u = 0, size = DISK_SLAB_MIN_SIZE; u < disk->slabs.len; u++) {
+    munmap(disk->slabs.list[u], size);
+    if(size < DISK_SLAB_MAX_SIZE) size <<= 1;
+  }
+
+  if(disk->map) munmap(disk->map, disk->map_size);
+
+  if(disk->reader) disk_reader_stop(disk->reader);
+
+  free(disk->slabs.list);
+  free(disk->holes.list);
+  free(disk->memfd_areas.list);
+  free(disk->chunks.list);
+  free(disk->chunks.hash);
+  free(disk->name);
+  free(disk->cache_key);
+
+  if(disk->fd != -1) close(disk->fd);
+  if(disk->memfd != -1) close(disk->memfd);
+
+  disk->slabs.list = NULL;
+  disk->slabs.free = NULL;
+  disk->slabs.len = disk->slabs.size = disk->slabs.used = 0;
+  disk->holes.list = NULL;
+  disk->holes.len = 0;
+  disk->memfd_areas.list = NULL;
+  disk->memfd_areas.len = 0;
+  disk->chunks.list = NULL;
+  disk->chunks.hash = NULL;
+  disk->chunks.len = disk->chunks.max = disk->chunks.hash_bits = 0;
+  disk->name = NULL;
+  disk->cache_key = NULL;
+  disk->fd = -1;
+  disk->memfd = -1;
+  disk->map = NULL;
+  disk->map_size = 0;
+  disk->reader = NULL;
 }
 
 
 void disk_init(char *file_name)
 {
-  struct stat sbuf;
-  disk_t disk = { .block_size = DISK_CHUNK_SIZE };
+  struct stat sbuf = {};
+  disk_t disk = { .block_size = DISK_CHUNK_SIZE, .fd = -1, .memfd = -1 };
+
+  // direct i/o only for block devices; if that fails, use regular reads
+  if(opt.direct && !stat(file_name, &sbuf) && S_ISBLK(sbuf.st_mode)) {
+    disk.fd = open(file_name, O_RDONLY | O_LARGEFILE | O_DIRECT);
+    if(disk.fd != -1) disk.direct = 1;
+  }
 
-  disk.fd = open(file_name, O_RDONLY | O_LARGEFILE);
+  if(disk.fd == -1) disk.fd = open(file_name, O_RDONLY | O_LARGEFILE);
 
   if(disk.fd == -1) {
     perror(file_name);
@@ -281,7 +2246,60 @@ void disk_init(char *file_name)
   if(!fstat(disk.fd, &sbuf)) disk.size_in_bytes = sbuf.st_size;
   if(!disk.size_in_bytes && ioctl(disk.fd, BLKGETSIZE64, &disk.size_in_bytes)) disk.size_in_bytes = 0;
 
+  // device topology
+  if(S_ISBLK(sbuf.st_mode)) {
+    int logical_block_size;
+    unsigned physical_block_size, optimal_io_size;
+    if(!ioctl(disk.fd, BLKSSZGET, &logical_block_size) && logical_block_size > 0) {
+      disk.logical_block_size = logical_block_size;
+    }
+    if(!ioctl(disk.fd, BLKPBSZGET, &physical_block_size)) disk.physical_block_size = physical_block_size;
+    if(!ioctl(disk.fd, BLKIOOPT, &optimal_io_size)) disk.optimal_io_size = optimal_io_size;
+    if(ioctl(disk.fd, BLKALIGNOFF, &disk.alignment_offset)) disk.alignment_offset = 0;
+  }
+
+  // read-around: on rotating or remote disks, reading a bit more costs next to nothing
+  unsigned read_around = 0;
+  if(S_ISBLK(sbuf.st_mode)) {
+    char buf[16];
+    unsigned rotational = 0;
+    if(!disk_sysfs_read(&sbuf, "queue/rotational", buf, sizeof buf)) rotational = strtoul(buf, NULL, 10);
+    int kib = rotational ? opt.read_around.hdd : opt.read_around.ssd;
+    if(kib >= 0) {
+      read_around = (unsigned) kib << 10;
+    }
+    else {
+      read_around = disk.optimal_io_size ?: rotational ? DISK_READ_AROUND_HDD : DISK_READ_AROUND_SSD;
+    }
+  }
+  else if(opt.read_around.file > 0) {
+    read_around = (unsigned) opt.read_around.file << 10;
+  }
+  if(read_around > DISK_READ_AROUND_MAX) read_around = DISK_READ_AROUND_MAX;
+  disk.read_around = read_around / DISK_CHUNK_SIZE;
+
+  if(opt.cache_dir) disk.cache_key = disk_cache_key(&sbuf);
+
+  // for sparse files: no need to read holes
+  if(S_ISREG(sbuf.st_mode) && disk.size_in_bytes) disk_map_holes(&disk);
+
+  // map regular files; the cache then just refers to the mapping
+  // (not with a timeout: reading from a mapping can't be abandoned)
+  if(S_ISREG(sbuf.st_mode) && disk.size_in_bytes && disk.size_in_bytes <= SIZE_MAX && !opt.timeout) {
+    disk.map = mmap(NULL, disk.size_in_bytes, PROT_READ, MAP_PRIVATE, disk.fd, 0);
+    if(disk.map == MAP_FAILED) {
+      disk.map = NULL;
+    }
+    else {
+      struct sigaction sa = { .sa_handler = disk_map_sigbus, .sa_flags = SA_NODEFER };
+      disk.map_size = disk.size_in_bytes;
+      sigaction(SIGBUS, &sa, NULL);
+    }
+  }
+
   disk_add_to_list(&disk);
+
+  if(disk.cache_key && !disk.map) disk_cache_load(disk_list + disk_list_size - 1);
 }
 
 
@@ -298,27 +2316,28 @@ void disk_import(char *file_name)
   size_t line_len = 0;
   unsigned line_nr = 0;
 
-  disk_t disk = { .fd = -1 };
+  disk_t disk = { .fd = -1, .memfd = -1 };
 
   uint8_t buffer[DISK_CHUNK_SIZE];
   uint64_t current_chunk_nr = UINT64_MAX;
 
   while(getline(&line, &line_len, file) > 0) {
     line_nr++;
-    unsigned index;
+    unsigned index, block_size = 0;
     uint64_t size;
     uint64_t addr;
     uint8_t line_data[16];
-    if(sscanf(line, "# disk %u, size = %"SCNu64"", &index, &size) == 2) {
+    if(sscanf(line, "# disk %u, size = %"SCNu64", block size = %u", &index, &size, &block_size) >= 2) {
       if(disk.name) {
-        if(current_chunk_nr != UINT64_MAX) disk_cache_store(&disk, &(disk_chunk_t) { .nr = current_chunk_nr, .data = buffer });
+        disk_import_chunk(&disk, current_chunk_nr, buffer, file_name);
         disk_add_to_list(&disk);
-        disk = (disk_t) { .index = disk_list_size };
+        disk = (disk_t) { .index = disk_list_size, .fd = -1, .memfd = -1 };
         current_chunk_nr = UINT64_MAX;
       }
       asprintf(&disk.name, "%s#%u", file_name, index);
       disk.size_in_bytes = size;
       disk.block_size = DISK_CHUNK_SIZE;
+      disk.logical_block_size = block_size;
     }
     else if(
       sscanf(line,
@@ -334,7 +2353,7 @@ void disk_import(char *file_name)
     ) {
       uint64_t chunk_nr = addr / DISK_CHUNK_SIZE;
       if(chunk_nr != current_chunk_nr) {
-        if(current_chunk_nr != UINT64_MAX) disk_cache_store(&disk, &(disk_chunk_t) { .nr = current_chunk_nr, .data = buffer });
+        disk_import_chunk(&disk, current_chunk_nr, buffer, file_name);
         current_chunk_nr = chunk_nr;
         memset(buffer, 0, sizeof buffer);
       }
@@ -349,7 +2368,23 @@ void disk_import(char *file_name)
   free(line);
 
   if(disk.name) {
-    if(current_chunk_nr != UINT64_MAX) disk_cache_store(&disk, &(disk_chunk_t) { .nr = current_chunk_nr, .data = buffer });
+    disk_import_chunk(&disk, current_chunk_nr, buffer, file_name);
     disk_add_to_list(&disk);
   }
 }
+
+
+/*
+ * Add imported chunk to cache.
+ *
+ * Imported data can't be read again: if they can't be stored, give up.
+ */
+static void disk_import_chunk(disk_t *disk, uint64_t chunk_nr, uint8_t *data, char *file_name)
+{
+  if(chunk_nr == UINT64_MAX) return;
+
+  if(disk_cache_store(disk, &(disk_chunk_t) { .nr = chunk_nr, .data = data })) {
+    fprintf(stderr, "%s: out of memory\n", file_name);
+    exit(1);
+  }
+}
@@ -4,47 +4,164 @@
 #define DISK_CHUNK_SIZE		512
 // resize internal chunk list by that amount, if needed
 #define DISK_CHUNKS_EXTRA	256
-// maximum number of chunks to store in internal cache (cache size = 512 MiB)
-#define DISK_MAX_CHUNKS		1024*1024
+// initial size of chunk hash table (in bits)
+#define DISK_HASH_BITS		10
+// default size of chunk cache for all disks (in MiB)
+#define DISK_CACHE_MB		512
+// maximum number of read requests to submit at once
+#define DISK_IO_BATCH		64
+// merge prefetch areas that are less than this apart
+#define DISK_PREFETCH_GAP	(64 << 10)
+// buffers for extended read requests (direct i/o, read-around): alignment and size of reusable buffers
+#define DISK_IO_BUF_ALIGN	4096
+#define DISK_IO_BUF_SIZE	(128 << 10)
+// retries after a read error; the delay before the first retry (in ms) doubles with each retry
+#define DISK_READ_RETRIES	3
+#define DISK_RETRY_DELAY	10
+// default read-around sizes for rotating and other disks, and upper limit
+#define DISK_READ_AROUND_HDD	(64 << 10)
+#define DISK_READ_AROUND_SSD	(4 << 10)
+#define DISK_READ_AROUND_MAX	(1 << 20)
+// persistent cache: head and tail areas of a disk that must not have changed
+#define DISK_CACHE_CHECK_SIZE	(64 << 10)
+// block sizes partition table parsers try: 0x200 - 0x1000
+#define DISK_BLOCK_SIZES	4
+// chunk data is allocated in slabs; slab size starts small and doubles up to max size
+#define DISK_SLAB_MIN_SIZE	(64 << 10)
+#define DISK_SLAB_MAX_SIZE	(2 << 20)
+
+// chunk flags
+#define DISK_CHUNK_REF		1	// chunk was used since last check (for cache eviction)
+#define DISK_CHUNK_PINNED	2	// chunk must stay in cache
+#define DISK_CHUNK_MAPPED	4	// chunk data point into file mapping
+#define DISK_CHUNK_ZERO		8	// chunk is all zeros; there is no chunk data
+#define DISK_CHUNK_SPECULATIVE	16	// chunk was read ahead and not used yet
+#define DISK_CHUNK_POISONED	32	// chunk could not be read; there is no chunk data
+#define DISK_CHUNK_MEMFD	64	// chunk was copied to the memfd
 
 typedef struct {
   uint64_t nr;
   uint8_t *data;
+  unsigned flags;
 } disk_chunk_t;
 
+// an area of a disk: a hole in a sparse file, or data copied to the memfd
+typedef struct {
+  uint64_t start;		// first chunk
+  uint64_t end;			// chunk after the hole
+} disk_hole_t;
+
 typedef struct {
   char *name;
   int fd;
+  int memfd;			// copy of some cached data, for external tools (-1 = none yet)
   unsigned index;
   unsigned heads;
   unsigned sectors;
   unsigned cylinders;
   uint64_t size_in_bytes;
   unsigned block_size;
+  uint8_t *map;			// file mapping (for regular files)
+  uint64_t map_size;
+  unsigned logical_block_size;	// as reported by device (0 if unknown)
+  unsigned physical_block_size;
+  unsigned optimal_io_size;
+  int alignment_offset;
+  unsigned read_around;		// chunks to read around a cache miss (0 = only what is needed)
+  uint64_t map_window;		// read-around window last requested from file mapping, + 1 (0 = none)
+  char *cache_key;		// device identity for persistent cache (NULL = don't cache)
+  struct disk_reader_s *reader;	// reader thread, for reads with timeout (NULL = none)
+  unsigned direct:1;		// O_DIRECT is used
+  unsigned hung:1;		// a read timed out; don't try again
   unsigned grub_used:1;
   unsigned isolinux_used:1;
   struct {
-    disk_chunk_t *list;
+    disk_chunk_t *list;		// sorted by chunk number only if 'unsorted' is not set
     unsigned len, max;
+    unsigned *hash;		// list index + 1 for each hash slot (0 = free slot)
+    unsigned hash_bits;
+    unsigned unsorted:1;
   } chunks;
+  struct {
+    uint8_t **list;
+    unsigned len;
+    unsigned size;		// size of last slab
+    unsigned used;		// bytes used in last slab
+    uint8_t *free;		// list of free chunks
+  } slabs;
+  struct {
+    disk_hole_t *list;		// sorted
+    unsigned len;
+  } holes;			// holes in sparse files
+  struct {
+    disk_hole_t *list;
+    unsigned len;
+  } memfd_areas;		// areas of the file mapping copied to the memfd
+  struct {
+    uint64_t reads;		// read requests
+    uint64_t chunks;		// chunks read from device
+    uint64_t syscalls;		// syscalls needed for reading
+    uint64_t mapped;		// chunks copied from file mapping
+    uint64_t evicted;		// chunks dropped from cache
+    uint64_t zero;		// chunks stored without data as they are all zeros
+    uint64_t speculative;	// chunks read ahead
+    uint64_t speculative_used;	// chunks read ahead that were actually used
+    uint64_t map_windows;	// read-around windows requested from file mapping
+    uint64_t retries;		// reads repeated after an error
+    uint64_t poisoned;		// chunks that could not be read
+    uint64_t holes;		// chunks in holes of sparse files, not read
+    uint64_t persistent;	// chunks loaded from persistent cache
+    uint64_t fs_probes;		// file system probes run
+    uint64_t fs_probe_hits;	// file system probes answered from earlier results
+    uint64_t fs_native;		// file system probes done without blkid
+    uint64_t fs_probe_bytes;	// bytes looked at by file system probes
+  } stats;
   json_object *json_disk;
   json_object *json_current;
 } disk_t;
 
+typedef struct {
+  disk_t *disk;
+  void *buffer;
+  uint64_t chunk_nr;
+  unsigned count;		// chunks to read
+  size_t len;			// bytes read
+  struct {
+    void *buffer;
+    uint64_t chunk_nr;
+    unsigned count;
+  } orig;			// original request, if it was extended (direct i/o, read-around)
+} disk_io_t;
+
+// a disk area, used to describe the data a parser is going to read
+typedef struct {
+  int64_t start;		// byte offset; if negative, relative to disk end
+  unsigned size;		// size in bytes; 0 = end of list
+} disk_range_t;
+
 extern unsigned disk_list_size;
 extern disk_t *disk_list;
 
 int disk_read(disk_t *disk, void *buf, uint64_t sector, unsigned cnt);
-int disk_read_single(disk_t *disk, void *buffer, uint64_t block_nr);
+int disk_read_bytes(disk_t *disk, void *buf, uint64_t pos, unsigned len);
+int disk_read_batch(disk_io_t *io, unsigned count);
 
 int disk_cache_read(disk_t *disk, disk_chunk_t *chunk);
 int disk_cache_store(disk_t *disk, disk_chunk_t *chunk);
 int disk_cache_dump(disk_t *disk, disk_chunk_t *chunk, FILE *file);
 
 unsigned disk_find_chunk(disk_t *disk, uint64_t chunk_nr, int *match);
+void disk_sort_chunks(disk_t *disk);
 
 int disk_export(disk_t *disk, char *file_name);
-int disk_to_fd(disk_t *disk, uint64_t offset);
+int disk_memfd(disk_t *disk, uint64_t start, uint64_t size);
+int disk_lazy_run(disk_t *disk, uint64_t start, uint64_t size, int (*func)(int fd, void *data), void *data, int *result);
+void disk_prefetch(disk_t *disk, disk_range_t **plans);
+void disk_show_stats(disk_t *disk);
+void disk_show_unreadable(disk_t *disk);
+void disk_cache_save(disk_t *disk);
+unsigned disk_block_sizes(disk_t *disk, unsigned *sizes);
 void disk_add_to_list(disk_t *disk);
+void disk_free(disk_t *disk);
 void disk_init(char *file_name);
 void disk_import(char *file_name);
@@ -18,6 +18,12 @@
 // set to 0 or 2
 #define BLK_FIX		2
 
+// iso9660 primary volume + el torito boot record descriptors
+disk_range_t eltorito_read_plan[] = {
+  { 0x10 * 0x800, 2 * 0x800 },
+  { }
+};
+
 static void dump_bootinfo(disk_t *disk, uint64_t sector);
 static char *s390x_parmfile(disk_t *disk, uint64_t start_block);
 
@@ -29,6 +35,7 @@ void dump_eltorito(disk_t *disk)
   unsigned catalog;
   eltorito_t *el;
   char *s;
+  char file_name[ISO_NAME_SIZE];
   static char *bt[] = {
     "no emulation", "1.2MB floppy", "1.44MB floppy", "2.88MB floppy", "hard disk", ""
   };
@@ -135,7 +142,7 @@ void dump_eltorito(disk_t *disk)
           le16toh(el->entry.size),
           BLK_FIX ? "" : "/4"
         );
-        if((s = iso_block_to_name(disk, le32toh(el->entry.start) << 2, NULL))) {
+        if((s = iso_block_to_name(disk, le32toh(el->entry.start) << 2, NULL, file_name, sizeof file_name))) {
           json_object_object_add(json_entry, "file_name", json_object_new_string(s));
           log_info(", \"%s\"", s);
           char *parmfile;
@@ -204,8 +211,9 @@ static void dump_bootinfo(disk_t *disk, uint64_t sector)
   if(disk_read(disk, pvd, bi_pvd, 1)) return;
   if(memcmp(pvd, ISO_MAGIC, sizeof ISO_MAGIC - 1)) return;
 
-  unsigned file_size = -1u;
-  iso_block_to_name(disk, sector, &file_size);
+  uint64_t file_size = UINT64_MAX;
+  char file_name[ISO_NAME_SIZE];
+  iso_block_to_name(disk, sector, &file_size, file_name, sizeof file_name);
 
   unsigned crc = 0;
 
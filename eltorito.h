@@ -40,4 +40,6 @@ typedef union {
 } eltorito_t;
 
 
+extern disk_range_t eltorito_read_plan[];
+
 void dump_eltorito(disk_t *disk);
@@ -0,0 +1,800 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <json-c/json.h>
+
+#include "disk.h"
+#include "filesystem.h"
+#include "ext4.h"
+#include "util.h"
+
+#define EXT4_MAX_DESCRIPTORS	(64 << 20)	// group descriptor size to load, at most
+#define EXT4_MAX_INODE_TABLES	(256 << 20)	// inode table size to scan, at most
+#define EXT4_PREFETCH_GROUPS	64		// inode tables to read in one batch
+#define EXT4_MAX_DIR_SIZE	(16 << 20)	// directory size, at most
+#define EXT4_MAX_DEPTH		5		// extent tree depth, at most
+#define EXT4_MAX_RUN		32768		// run length, in blocks, at most
+
+#define EXT4_ROOT_INO		2
+#define EXT4_JOURNAL_INO	8
+
+// superblock feature bits
+#define EXT4_INCOMPAT_META_BG		0x0010
+#define EXT4_INCOMPAT_64BIT		0x0080
+#define EXT4_RO_COMPAT_SPARSE_SUPER	0x0001
+#define EXT4_RO_COMPAT_GDT_CSUM		0x0010
+#define EXT4_RO_COMPAT_METADATA_CSUM	0x0400
+
+// group descriptor flags
+#define EXT4_BG_INODE_UNINIT	0x0001
+
+// inode flags
+#define EXT4_EXTENTS_FL		0x00080000
+#define EXT4_INLINE_DATA_FL	0x10000000
+
+#define EXT4_S_IFMT		0xf000
+#define EXT4_S_IFDIR		0x4000
+
+// ext2/3/4 fs layout, from the superblock
+typedef struct {
+  unsigned block_size;
+  uint64_t blocks;		// fs size, in blocks
+  uint32_t first_data_block;
+  uint32_t blocks_per_group;
+  uint32_t inodes_per_group;
+  uint32_t groups;
+  uint32_t first_ino;		// first non-reserved inode
+  unsigned inode_size;
+  unsigned desc_size;
+  uint32_t incompat;
+  uint32_t ro_compat;
+  uint32_t first_meta_bg;
+} ext4_geo_t;
+
+// an ext2/3/4 fs found on some disk
+typedef struct {
+  unsigned disk;		// disk index
+  uint64_t start;		// fs start, in bytes
+  ext4_geo_t geo;
+  unsigned read:1;		// inode tables have been read
+  unsigned inodes;		// files and directories in the index
+  uint32_t groups_scanned;	// groups whose inode tables have been read
+  file_index_t files;		// blocks relative to fs start
+} ext4_fs_t;
+
+// consecutive blocks of a file
+typedef struct {
+  uint64_t block;		// block within the file
+  uint64_t start;		// fs block
+  uint32_t len;
+} ext4_run_t;
+
+// file or directory, as found in the inode tables
+typedef struct {
+  uint32_t ino;
+  unsigned mode;
+  uint64_t size;
+  unsigned runs;		// first run in ext4_scan_t.runs
+  unsigned runs_len;
+  char *name;			// full path, set by ext4_walk_dir()
+} ext4_inode_t;
+
+// inode table scan results; list is sorted by inode number
+typedef struct {
+  ext4_inode_t *list;
+  unsigned len, max;
+  ext4_run_t *runs;
+  unsigned runs_len, runs_max;
+  uint64_t blocks;		// data and tree blocks seen; more than the fs has means corrupted inodes
+  uint64_t only;		// fs block + 1: keep only directories and files using it (0 = keep all)
+} ext4_scan_t;
+
+// inode table of a block group
+typedef struct {
+  uint64_t start;		// in blocks
+  uint32_t inodes;		// inodes in use, at most
+} ext4_group_t;
+
+static int ext4_parse_sb(ext4_geo_t *geo, uint8_t *sb);
+static int ext4_has_super(ext4_geo_t *geo, uint32_t group);
+static ext4_group_t *ext4_read_groups(disk_t *disk, ext4_fs_t *fs);
+static void ext4_read(disk_t *disk, ext4_fs_t *fs, file_index_t *files, uint64_t only);
+static char *ext4_lookup_one(disk_t *disk, ext4_fs_t *fs, uint64_t block, uint64_t *len, char *buf, unsigned buf_size);
+static void ext4_scan_table(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, uint32_t group, uint8_t *table, uint32_t inodes);
+static void ext4_add_inode(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, uint32_t ino, uint8_t *inode);
+static void ext4_add_run(ext4_fs_t *fs, ext4_scan_t *scan, uint64_t block, uint64_t start, uint64_t len);
+static void ext4_extents(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, uint8_t *node, unsigned size, unsigned depth);
+static void ext4_indirect(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, uint32_t block, unsigned level, uint64_t *pos, uint64_t end);
+static ext4_inode_t *ext4_find_inode(ext4_scan_t *scan, uint32_t ino);
+static void ext4_walk_dir(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, ext4_inode_t *dir, unsigned *queue, unsigned *queue_len);
+static int ext4_has_block(ext4_scan_t *scan, ext4_inode_t *inode, uint64_t block);
+static void ext4_register(ext4_fs_t *fs, file_index_t *files, ext4_scan_t *scan, ext4_inode_t *inode);
+
+static struct {
+  ext4_fs_t *list;
+  unsigned len;
+} ext4_list;
+
+
+/*
+ * Check for ext2/3/4 fs at byte offset 'start' and remember it for
+ * ext4_block_to_name().
+ *
+ * The inode tables are read only when a block inside the fs is looked up
+ * or the file map is requested via ext4_file_map().
+ */
+void ext4_probe(disk_t *disk, uint64_t start)
+{
+  uint8_t sb[0x400];
+  ext4_geo_t geo;
+
+  if(start & 511) return;
+
+  for(unsigned u = 0; u < ext4_list.len; u++) {
+    if(ext4_list.list[u].disk == disk->index && ext4_list.list[u].start == start) return;
+  }
+
+  if(start + 0x400 + sizeof sb > disk->size_in_bytes || disk_read_bytes(disk, sb, start + 0x400, sizeof sb)) return;
+
+  if(ext4_parse_sb(&geo, sb)) return;
+
+  ext4_list.list = reallocarray(ext4_list.list, ext4_list.len + 1, sizeof *ext4_list.list);
+  ext4_list.list[ext4_list.len++] = (ext4_fs_t) { .disk = disk->index, .start = start, .geo = geo };
+}
+
+
+/*
+ * Build block to file map for ext2/3/4 fs at byte offset 'start', if not
+ * done already.
+ *
+ * The fs must have been registered via ext4_probe(). info is set to the
+ * size of the map. If not all inode tables could be scanned (see
+ * EXT4_MAX_INODE_TABLES), info->groups_scanned is less than info->groups.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ext4_file_map(disk_t *disk, uint64_t start, ext4_map_info_t *info)
+{
+  for(unsigned u = 0; u < ext4_list.len; u++) {
+    ext4_fs_t *fs = ext4_list.list + u;
+
+    if(fs->disk != disk->index || fs->start != start) continue;
+
+    if(!fs->read) ext4_read(disk, fs, &fs->files, 0);
+
+    *info = (ext4_map_info_t) {
+      .files = fs->inodes,
+      .extents = fs->files.len,
+      .groups = fs->geo.groups,
+      .groups_scanned = fs->groups_scanned
+    };
+
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * Find file containing block in any ext2/3/4 fs registered via
+ * ext4_probe().
+ *
+ * block is in 512 byte units, relative to disk start.
+ *
+ * See iso_block_to_name() for the other arguments.
+ */
+char *ext4_block_to_name(disk_t *disk, uint64_t block, uint64_t *len, char *buf, unsigned buf_size)
+{
+  for(unsigned u = 0; u < ext4_list.len; u++) {
+    ext4_fs_t *fs = ext4_list.list + u;
+
+    // the first block is never part of a file; dump_fs() looks it up
+    if(
+      fs->disk != disk->index ||
+      block <= fs->start / 512 ||
+      block >= fs->start / 512 + fs->geo.blocks * (fs->geo.block_size / 512)
+    ) continue;
+
+    char *name;
+
+    // a single block (like the MBR boot info) doesn't need the whole map
+    if(!fs->read && !opt.lookup.len) {
+      name = ext4_lookup_one(disk, fs, block - fs->start / 512, len, buf, buf_size);
+    }
+    else {
+      if(!fs->read) ext4_read(disk, fs, &fs->files, 0);
+      name = file_index_lookup(&fs->files, block - fs->start / 512, len, buf, buf_size);
+    }
+
+    if(name) return name;
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Get fs layout from superblock.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int ext4_parse_sb(ext4_geo_t *geo, uint8_t *sb)
+{
+  unsigned log_block_size, rev;
+
+  *geo = (ext4_geo_t) {};
+
+  if(read_word_le(sb + 0x38) != 0xef53) return 1;
+
+  log_block_size = read_dword_le(sb + 0x18);
+  rev = read_dword_le(sb + 0x4c);
+
+  geo->first_data_block = read_dword_le(sb + 0x14);
+  geo->blocks_per_group = read_dword_le(sb + 0x20);
+  geo->inodes_per_group = read_dword_le(sb + 0x28);
+  geo->incompat = read_dword_le(sb + 0x60);
+  geo->ro_compat = read_dword_le(sb + 0x64);
+  geo->first_meta_bg = read_dword_le(sb + 0x104);
+  geo->first_ino = rev ? read_dword_le(sb + 0x54) : 11;
+  geo->inode_size = rev ? read_word_le(sb + 0x58) : 128;
+  geo->desc_size = geo->incompat & EXT4_INCOMPAT_64BIT ? read_word_le(sb + 0xfe) : 32;
+
+  if(log_block_size > 6) return 1;
+
+  geo->block_size = 0x400 << log_block_size;
+  geo->blocks = read_dword_le(sb + 0x04);
+  if(geo->incompat & EXT4_INCOMPAT_64BIT) geo->blocks += (uint64_t) read_dword_le(sb + 0x150) << 32;
+
+  if(
+    !geo->blocks_per_group || geo->blocks_per_group > geo->block_size * 8 ||
+    !geo->inodes_per_group || geo->inodes_per_group > geo->block_size * 8 ||
+    geo->inode_size < 128 || geo->inode_size > geo->block_size ||
+    (uint64_t) geo->inodes_per_group * geo->inode_size > EXT4_MAX_INODE_TABLES ||
+    (geo->inode_size & (geo->inode_size - 1)) ||
+    geo->desc_size < 32 || geo->desc_size > geo->block_size ||
+    (geo->desc_size & (geo->desc_size - 1)) ||
+    geo->blocks <= geo->first_data_block ||
+    geo->first_ino <= EXT4_ROOT_INO
+  ) return 1;
+
+  uint64_t groups = (geo->blocks - geo->first_data_block + geo->blocks_per_group - 1) / geo->blocks_per_group;
+
+  if(groups > UINT32_MAX / geo->inodes_per_group) return 1;
+
+  geo->groups = groups;
+
+  return 0;
+}
+
+
+/*
+ * Check if block group has a superblock backup.
+ */
+static int ext4_has_super(ext4_geo_t *geo, uint32_t group)
+{
+  if(group <= 1 || !(geo->ro_compat & EXT4_RO_COMPAT_SPARSE_SUPER)) return 1;
+
+  // powers of 3, 5, and 7
+  if(!(group & 1)) return 0;
+
+  for(unsigned base = 3; base <= 7; base += 2) {
+    uint64_t u;
+    for(u = base; u < group; u *= base);
+    if(u == group) return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Read group descriptors and get inode table location of all groups.
+ *
+ * With the meta_bg feature, group descriptors are spread over the fs;
+ * else they follow the superblock.
+ *
+ * Return malloc'ed array with geo.groups entries or NULL.
+ */
+static ext4_group_t *ext4_read_groups(disk_t *disk, ext4_fs_t *fs)
+{
+  ext4_geo_t *geo = &fs->geo;
+  unsigned per_block = geo->block_size / geo->desc_size;
+  uint32_t desc_blocks = (geo->groups + per_block - 1) / per_block;
+  uint32_t contiguous = desc_blocks;
+  int err = 0;
+
+  if((uint64_t) desc_blocks * geo->block_size > EXT4_MAX_DESCRIPTORS) return NULL;
+
+  if((geo->incompat & EXT4_INCOMPAT_META_BG) && geo->first_meta_bg < desc_blocks) contiguous = geo->first_meta_bg;
+
+  uint8_t *buf = malloc((size_t) desc_blocks * geo->block_size);
+
+  if(contiguous) {
+    err = disk_read_bytes(disk, buf, fs->start + (geo->first_data_block + 1ull) * geo->block_size, contiguous * geo->block_size);
+  }
+
+  // meta_bg: the descriptors for each meta group are in its first group
+  for(uint32_t u = contiguous; u < desc_blocks && !err; u++) {
+    uint32_t group = u * per_block;
+    uint64_t block = geo->first_data_block + (uint64_t) group * geo->blocks_per_group + ext4_has_super(geo, group);
+
+    err = disk_read_bytes(disk, buf + (size_t) u * geo->block_size, fs->start + block * geo->block_size, geo->block_size);
+  }
+
+  if(err) {
+    free(buf);
+
+    return NULL;
+  }
+
+  ext4_group_t *groups = calloc(geo->groups, sizeof *groups);
+  int csum = geo->ro_compat & (EXT4_RO_COMPAT_GDT_CSUM | EXT4_RO_COMPAT_METADATA_CSUM);
+
+  for(uint32_t u = 0; u < geo->groups; u++) {
+    uint8_t *desc = buf + (size_t) (u / per_block) * geo->block_size + (u % per_block) * geo->desc_size;
+    uint64_t start = read_dword_le(desc + 0x08);
+    uint32_t unused = read_word_le(desc + 0x1c);
+    uint32_t inodes = geo->inodes_per_group;
+
+    if(geo->desc_size >= 64) {
+      start += (uint64_t) read_dword_le(desc + 0x28) << 32;
+      unused += read_word_le(desc + 0x32) << 16;
+    }
+
+    // with group checksums, unused inodes at the table end are not initialized
+    if(csum) {
+      inodes = (read_word_le(desc + 0x12) & EXT4_BG_INODE_UNINIT) || unused > inodes ? 0 : inodes - unused;
+    }
+
+    uint64_t table_blocks = ((uint64_t) inodes * geo->inode_size + geo->block_size - 1) / geo->block_size;
+
+    if(!start || start >= geo->blocks || table_blocks > geo->blocks - start) inodes = 0;
+
+    groups[u] = (ext4_group_t) { .start = start, .inodes = inodes };
+  }
+
+  free(buf);
+
+  return groups;
+}
+
+
+/*
+ * Read inode tables and directory tree and add all files to 'files'.
+ *
+ * The inode tables of EXT4_PREFETCH_GROUPS groups are requested at once,
+ * then parsed from the cache. At most EXT4_MAX_INODE_TABLES are scanned.
+ *
+ * If only is 0, files is fs->files and fs->groups_scanned tells how far
+ * the map goes. Else only the files using fs block 'only - 1' are added.
+ */
+static void ext4_read(disk_t *disk, ext4_fs_t *fs, file_index_t *files, uint64_t only)
+{
+  ext4_geo_t *geo = &fs->geo;
+  ext4_group_t *groups;
+  ext4_scan_t scan = { .only = only };
+  uint64_t scanned = 0;
+  uint32_t groups_scanned = 0;
+
+  if(!only) fs->read = 1;
+
+  if(!(groups = ext4_read_groups(disk, fs))) return;
+
+  for(uint32_t first = 0; first < geo->groups && scanned <= EXT4_MAX_INODE_TABLES; first += EXT4_PREFETCH_GROUPS) {
+    uint32_t last = first + EXT4_PREFETCH_GROUPS < geo->groups ? first + EXT4_PREFETCH_GROUPS : geo->groups;
+    disk_range_t ranges[EXT4_PREFETCH_GROUPS + 1] = {};
+    unsigned ranges_len = 0;
+    uint64_t planned = scanned;
+
+    for(uint32_t u = first; u < last; u++) {
+      uint64_t size = groups[u].inodes * geo->inode_size;
+      if(!size) continue;
+      if((planned += size) > EXT4_MAX_INODE_TABLES) break;
+      ranges[ranges_len++] = (disk_range_t) {
+        .start = fs->start + groups[u].start * geo->block_size,
+        .size = size
+      };
+    }
+
+    if(ranges_len) disk_prefetch(disk, (disk_range_t *[]) { ranges, NULL });
+
+    for(uint32_t u = first; u < last; u++) {
+      unsigned size = groups[u].inodes * geo->inode_size;
+
+      if(!size) {
+        groups_scanned++;
+        continue;
+      }
+
+      // the map covers only the groups scanned so far
+      if((scanned += size) > EXT4_MAX_INODE_TABLES) break;
+
+      uint8_t *table = malloc(size);
+
+      if(!disk_read_bytes(disk, table, fs->start + groups[u].start * geo->block_size, size)) {
+        ext4_scan_table(disk, fs, &scan, u, table, groups[u].inodes);
+        groups_scanned++;
+      }
+
+      free(table);
+    }
+  }
+
+  free(groups);
+
+  // breadth first, so hard links get the shortest name
+  ext4_inode_t *root = ext4_find_inode(&scan, EXT4_ROOT_INO);
+
+  if(root && (root->mode & EXT4_S_IFMT) == EXT4_S_IFDIR) {
+    unsigned *queue = malloc(scan.len * sizeof *queue);
+    unsigned queue_len = 0;
+
+    root->name = strdup("/");
+    queue[queue_len++] = root - scan.list;
+
+    for(unsigned u = 0; u < queue_len; u++) {
+      ext4_walk_dir(disk, fs, &scan, scan.list + queue[u], queue, &queue_len);
+    }
+
+    free(queue);
+  }
+
+  for(unsigned u = 0; u < scan.len; u++) {
+    if(!only || ext4_has_block(&scan, scan.list + u, only - 1)) ext4_register(fs, files, &scan, scan.list + u);
+    free(scan.list[u].name);
+  }
+
+  if(!only) {
+    fs->inodes = scan.len;
+    fs->groups_scanned = groups_scanned;
+  }
+
+  free(scan.list);
+  free(scan.runs);
+
+  file_index_sort(files);
+}
+
+
+/*
+ * Find file containing block (in 512 byte units, relative to fs start)
+ * without building the map for the whole fs.
+ *
+ * All inode tables are still scanned, but only directories and the files
+ * using the block are kept.
+ *
+ * See iso_block_to_name() for the other arguments.
+ */
+static char *ext4_lookup_one(disk_t *disk, ext4_fs_t *fs, uint64_t block, uint64_t *len, char *buf, unsigned buf_size)
+{
+  file_index_t files = {};
+
+  ext4_read(disk, fs, &files, block / (fs->geo.block_size / 512) + 1);
+
+  char *name = file_index_lookup(&files, block, len, buf, buf_size);
+
+  free(files.list);
+  free(files.max_end);
+  free(files.names);
+
+  return name;
+}
+
+
+/*
+ * Add all files in the inode table of 'group' to scan.
+ *
+ * table holds the first 'inodes' inodes of the group.
+ */
+static void ext4_scan_table(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, uint32_t group, uint8_t *table, uint32_t inodes)
+{
+  ext4_geo_t *geo = &fs->geo;
+
+  for(uint32_t u = 0; u < inodes; u++) {
+    uint32_t ino = group * geo->inodes_per_group + u + 1;
+
+    // reserved inodes other than root and journal have no regular data
+    if(ino < geo->first_ino && ino != EXT4_ROOT_INO && ino != EXT4_JOURNAL_INO) continue;
+
+    ext4_add_inode(disk, fs, scan, ino, table + (size_t) u * geo->inode_size);
+  }
+}
+
+
+/*
+ * Add inode and its data blocks to scan.
+ *
+ * Inodes without data blocks (deleted, empty, inline data, fast symlinks)
+ * are skipped.
+ */
+static void ext4_add_inode(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, uint32_t ino, uint8_t *inode)
+{
+  unsigned mode = read_word_le(inode);
+  uint32_t flags = read_dword_le(inode + 0x20);
+  uint64_t size = read_dword_le(inode + 0x04) + ((uint64_t) read_dword_le(inode + 0x6c) << 32);
+
+  if(!mode || !read_word_le(inode + 0x1a) || !read_dword_le(inode + 0x1c) || (flags & EXT4_INLINE_DATA_FL)) return;
+
+  if(scan->len == scan->max) {
+    scan->max = scan->max ? 2 * scan->max : 1024;
+    scan->list = reallocarray(scan->list, scan->max, sizeof *scan->list);
+  }
+
+  scan->list[scan->len++] = (ext4_inode_t) { .ino = ino, .mode = mode, .size = size, .runs = scan->runs_len };
+
+  if(flags & EXT4_EXTENTS_FL) {
+    ext4_extents(disk, fs, scan, inode + 0x28, 60, 0);
+  }
+  else {
+    // 12 direct blocks, then single, double, and triple indirect blocks
+    uint64_t pos = 0, end = (size + fs->geo.block_size - 1) / fs->geo.block_size;
+
+    for(unsigned u = 0; u < 15 && pos < end; u++) {
+      ext4_indirect(disk, fs, scan, read_dword_le(inode + 0x28 + 4 * u), u < 12 ? 0 : u - 11, &pos, end);
+    }
+  }
+
+  ext4_inode_t *last = scan->list + scan->len - 1;
+
+  last->runs_len = scan->runs_len - last->runs;
+
+  // directories are needed for the file names
+  if(scan->only && (mode & EXT4_S_IFMT) != EXT4_S_IFDIR && !ext4_has_block(scan, last, scan->only - 1)) {
+    scan->runs_len = last->runs;
+    last->runs_len = 0;
+  }
+
+  if(!last->runs_len) scan->len--;
+}
+
+
+/*
+ * Add 'len' blocks at fs block 'start' as file block 'block' to the last
+ * inode in scan.
+ *
+ * Runs beyond the fs end are ignored.
+ */
+static void ext4_add_run(ext4_fs_t *fs, ext4_scan_t *scan, uint64_t block, uint64_t start, uint64_t len)
+{
+  ext4_inode_t *inode = scan->list + scan->len - 1;
+
+  if(!len || start >= fs->geo.blocks || len > fs->geo.blocks - start) return;
+
+  scan->blocks += len;
+
+  if(scan->runs_len > inode->runs) {
+    ext4_run_t *run = scan->runs + scan->runs_len - 1;
+
+    if(run->block + run->len == block && run->start + run->len == start && run->len + len <= EXT4_MAX_RUN) {
+      run->len += len;
+      return;
+    }
+  }
+
+  if(scan->runs_len == scan->runs_max) {
+    scan->runs_max = scan->runs_max ? 2 * scan->runs_max : 1024;
+    scan->runs = reallocarray(scan->runs, scan->runs_max, sizeof *scan->runs);
+  }
+
+  scan->runs[scan->runs_len++] = (ext4_run_t) { .block = block, .start = start, .len = len };
+}
+
+
+/*
+ * Add all extents in extent tree node to scan.
+ *
+ * node is 'size' bytes long; depth is the number of parent nodes.
+ */
+static void ext4_extents(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, uint8_t *node, unsigned size, unsigned depth)
+{
+  unsigned entries = read_word_le(node + 2);
+  unsigned levels = read_word_le(node + 6);
+
+  if(read_word_le(node) != 0xf30a || entries > (size - 12) / 12 || depth + levels > EXT4_MAX_DEPTH) return;
+
+  for(unsigned u = 0; u < entries && scan->blocks <= fs->geo.blocks; u++) {
+    uint8_t *entry = node + 12 + 12 * u;
+
+    if(!levels) {
+      unsigned len = read_word_le(entry + 4);
+
+      // uninitialized extent, but allocated
+      if(len > 32768) len -= 32768;
+
+      ext4_add_run(
+        fs, scan, read_dword_le(entry),
+        read_dword_le(entry + 8) + ((uint64_t) read_word_le(entry + 6) << 32),
+        len
+      );
+    }
+    else {
+      uint64_t block = read_dword_le(entry + 4) + ((uint64_t) read_word_le(entry + 8) << 32);
+      uint8_t *child;
+
+      if(block >= fs->geo.blocks) continue;
+
+      scan->blocks++;
+
+      child = malloc(fs->geo.block_size);
+
+      if(
+        !disk_read_bytes(disk, child, fs->start + block * fs->geo.block_size, fs->geo.block_size) &&
+        read_word_le(child + 6) == levels - 1
+      ) {
+        ext4_extents(disk, fs, scan, child, fs->geo.block_size, depth + 1);
+      }
+
+      free(child);
+    }
+  }
+}
+
+
+/*
+ * Add blocks referenced via (indirect) block pointer to scan.
+ *
+ * level is the number of indirections (0: data block). pos is the current
+ * file block and is advanced past the covered area; nothing beyond file
+ * block 'end' is looked at.
+ */
+static void ext4_indirect(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, uint32_t block, unsigned level, uint64_t *pos, uint64_t end)
+{
+  unsigned per_block = fs->geo.block_size / 4;
+  uint64_t span = 1;
+
+  for(unsigned u = 0; u < level; u++) span *= per_block;
+
+  // a hole
+  if(!block || block >= fs->geo.blocks || scan->blocks > fs->geo.blocks) {
+    *pos += span;
+    return;
+  }
+
+  if(!level) {
+    ext4_add_run(fs, scan, (*pos)++, block, 1);
+    return;
+  }
+
+  scan->blocks++;
+
+  uint8_t *buf = malloc(fs->geo.block_size);
+
+  if(disk_read_bytes(disk, buf, fs->start + (uint64_t) block * fs->geo.block_size, fs->geo.block_size)) {
+    *pos += span;
+  }
+  else {
+    for(unsigned u = 0; u < per_block && *pos < end; u++) {
+      ext4_indirect(disk, fs, scan, read_dword_le(buf + 4 * u), level - 1, pos, end);
+    }
+  }
+
+  free(buf);
+}
+
+
+/*
+ * Find inode in scan results.
+ */
+static ext4_inode_t *ext4_find_inode(ext4_scan_t *scan, uint32_t ino)
+{
+  unsigned lo = 0, hi = scan->len;
+
+  while(lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+
+    if(scan->list[mid].ino == ino) return scan->list + mid;
+
+    if(scan->list[mid].ino < ino) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Name all entries in directory 'dir' that have no name yet.
+ *
+ * New subdirectories are appended to queue (as index into scan->list).
+ *
+ * htree index blocks look like empty entries to this and are skipped that
+ * way, as are checksum tails.
+ */
+static void ext4_walk_dir(disk_t *disk, ext4_fs_t *fs, ext4_scan_t *scan, ext4_inode_t *dir, unsigned *queue, unsigned *queue_len)
+{
+  unsigned block_size = fs->geo.block_size;
+  uint64_t dir_size = 0;
+  uint8_t *buf = malloc(block_size);
+
+  for(unsigned r = 0; r < dir->runs_len && dir_size < EXT4_MAX_DIR_SIZE; r++) {
+    ext4_run_t *run = scan->runs + dir->runs + r;
+
+    for(uint32_t b = 0; b < run->len && dir_size < EXT4_MAX_DIR_SIZE; b++, dir_size += block_size) {
+      if(disk_read_bytes(disk, buf, fs->start + (run->start + b) * block_size, block_size)) continue;
+
+      unsigned rec_len;
+
+      for(unsigned pos = 0; pos + 8 <= block_size; pos += rec_len) {
+        uint8_t *entry = buf + pos;
+        uint32_t ino = read_dword_le(entry);
+        unsigned name_len = read_byte(entry + 6);
+
+        rec_len = read_word_le(entry + 4);
+
+        if(rec_len < 8 || (rec_len & 3) || pos + rec_len > block_size) break;
+
+        if(!ino || !name_len || name_len + 8 > rec_len) continue;
+
+        char *name = (char *) entry + 8;
+
+        if((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.')) continue;
+
+        ext4_inode_t *inode = ext4_find_inode(scan, ino);
+
+        if(!inode || inode->name) continue;
+
+        if(asprintf(&inode->name, "%s/%.*s", strcmp(dir->name, "/") ? dir->name : "", name_len, name) == -1) {
+          inode->name = NULL;
+          continue;
+        }
+
+        if((inode->mode & EXT4_S_IFMT) == EXT4_S_IFDIR) queue[(*queue_len)++] = inode - scan->list;
+      }
+    }
+  }
+
+  free(buf);
+}
+
+
+/*
+ * Check whether inode uses fs block 'block'.
+ */
+static int ext4_has_block(ext4_scan_t *scan, ext4_inode_t *inode, uint64_t block)
+{
+  for(unsigned u = 0; u < inode->runs_len; u++) {
+    ext4_run_t *run = scan->runs + inode->runs + u;
+
+    if(block >= run->start && block < run->start + run->len) return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Add all runs of inode to files.
+ *
+ * Files not found in the directory tree are named '<inode N>'.
+ */
+static void ext4_register(ext4_fs_t *fs, file_index_t *files, ext4_scan_t *scan, ext4_inode_t *inode)
+{
+  char tmp_name[32];
+  char *name = inode->name;
+  unsigned blocks = fs->geo.block_size / 512;
+
+  if(!name) {
+    if(inode->ino == EXT4_JOURNAL_INO) {
+      name = "<journal>";
+    }
+    else {
+      snprintf(tmp_name, sizeof tmp_name, "<inode %u>", inode->ino);
+      name = tmp_name;
+    }
+  }
+
+  for(unsigned u = 0; u < inode->runs_len; u++) {
+    ext4_run_t *run = scan->runs + inode->runs + u;
+
+    file_index_add(files, run->start * blocks, run->len * fs->geo.block_size, run->block * blocks, inode->size, name);
+  }
+}
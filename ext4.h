@@ -0,0 +1,11 @@
+// block to file map size, see ext4_file_map()
+typedef struct {
+  unsigned files;		// files and directories
+  unsigned extents;		// map entries
+  uint32_t groups;		// block groups
+  uint32_t groups_scanned;	// block groups whose inodes are in the map
+} ext4_map_info_t;
+
+void ext4_probe(disk_t *disk, uint64_t start);
+int ext4_file_map(disk_t *disk, uint64_t start, ext4_map_info_t *info);
+char *ext4_block_to_name(disk_t *disk, uint64_t block, uint64_t *len, char *buf, unsigned buf_size);
@@ -0,0 +1,711 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <json-c/json.h>
+
+#include "disk.h"
+#include "filesystem.h"
+#include "fat.h"
+#include "util.h"
+
+#define FAT_MAX_TABLE		(64 << 20)	// FAT size to load, at most
+#define FAT_MAX_DIRS		(1 << 16)	// directories to walk, at most
+#define FAT_MAX_DIR_SIZE	(65536 * 32)	// directory size, at most
+#define FAT_SCAN_CHUNK		(3 << 18)	// FAT bytes per read when counting clusters
+#define FAT_COUNT_STEP		16		// FAT entries per inner counting loop
+
+// FAT entries, as converted by fat_decode()
+#define FAT_BAD			0x0ffffff7
+
+// FAT file system layout, from the BPB; sector values are relative to fs start
+typedef struct {
+  unsigned bits;		// 12, 16, or 32
+  unsigned sector_size;
+  unsigned cluster_size;	// in bytes
+  uint32_t fat_start;		// first FAT, in sectors
+  uint32_t fat_sectors;		// FAT size, in sectors
+  uint32_t root_start;		// FAT12/16 root directory, in sectors
+  uint32_t root_entries;	// FAT12/16 root directory entries
+  uint32_t root_cluster;	// FAT32 root directory
+  uint32_t data_start;		// cluster 2, in sectors
+  uint32_t clusters;		// number of data clusters
+  uint64_t size;		// fs size, in bytes
+} fat_geo_t;
+
+// a FAT fs found on some disk
+typedef struct {
+  unsigned disk;		// disk index
+  uint64_t start;		// fs start, in bytes
+  fat_geo_t geo;
+  unsigned read:1;		// directory tree has been read
+  file_index_t files;		// blocks relative to fs start
+} fat_fs_t;
+
+// consecutive clusters
+typedef struct {
+  uint32_t start;
+  uint32_t len;
+} fat_run_t;
+
+typedef struct {
+  uint32_t cluster;		// 0 = FAT12/16 root directory
+  unsigned parent;		// index of parent directory
+  char *name;			// full path, with trailing '/'
+} fat_dir_t;
+
+typedef struct {
+  fat_dir_t *list;
+  unsigned len, max;
+} fat_dirs_t;
+
+static int fat_parse_bpb(fat_geo_t *geo, uint8_t *bpb);
+static uint32_t *fat_load_table(disk_t *disk, fat_fs_t *fs);
+static void fat_decode(unsigned bits, uint8_t *buf, uint32_t *table, uint32_t count);
+static void fat_count(fat_usage_t *usage, uint32_t *table, uint32_t first, uint32_t count, uint32_t entries);
+static void fat_fsinfo(disk_t *disk, uint64_t start, uint8_t *bpb, fat_geo_t *geo, fat_usage_t *usage);
+static void fat_read(disk_t *disk, fat_fs_t *fs);
+static unsigned fat_runs(fat_fs_t *fs, uint32_t *table, uint32_t cluster, fat_run_t **runs);
+static uint8_t *fat_read_dir(disk_t *disk, fat_fs_t *fs, fat_run_t *runs, unsigned runs_len, unsigned *len);
+static void fat_register(fat_fs_t *fs, fat_run_t *runs, unsigned runs_len, uint64_t size, char *name);
+static void fat_add_dir(fat_dirs_t *dirs, uint32_t cluster, unsigned parent, char *name);
+static void fat_walk_dir(disk_t *disk, fat_fs_t *fs, uint32_t *table, fat_dirs_t *dirs, unsigned idx);
+static int fat_is_ancestor(fat_dirs_t *dirs, unsigned idx, uint32_t cluster);
+static char *fat_short_name(uint8_t *entry);
+
+static struct {
+  fat_fs_t *list;
+  unsigned len;
+} fat_list;
+
+
+/*
+ * Remember FAT fs at byte offset 'start' for fat_block_to_name().
+ *
+ * bpb is the fs's first sector.
+ *
+ * The directory tree is read only when a block inside the fs is looked up.
+ */
+void fat_add_fs(disk_t *disk, uint64_t start, uint8_t *bpb)
+{
+  fat_geo_t geo;
+
+  if((start & 511) || fat_parse_bpb(&geo, bpb)) return;
+
+  for(unsigned u = 0; u < fat_list.len; u++) {
+    if(fat_list.list[u].disk == disk->index && fat_list.list[u].start == start) return;
+  }
+
+  fat_list.list = reallocarray(fat_list.list, fat_list.len + 1, sizeof *fat_list.list);
+  fat_list.list[fat_list.len++] = (fat_fs_t) { .disk = disk->index, .start = start, .geo = geo };
+}
+
+
+/*
+ * Check for FAT fs at byte offset 'start' and remember it for
+ * fat_block_to_name().
+ *
+ * This is for parsers that look up blocks before the file systems have
+ * been dumped.
+ */
+void fat_probe(disk_t *disk, uint64_t start)
+{
+  uint8_t bpb[0x200];
+
+  if(start + sizeof bpb > disk->size_in_bytes || disk_read_bytes(disk, bpb, start, sizeof bpb)) return;
+
+  fat_add_fs(disk, start, bpb);
+}
+
+
+/*
+ * Get cluster usage of FAT fs at byte offset 'start'.
+ *
+ * bpb is the fs's first sector.
+ *
+ * The FAT is read in FAT_SCAN_CHUNK pieces; the directory tree is not
+ * looked at. Fragments are counted per contiguous piece of a cluster
+ * chain, so a chain without gaps is a single fragment.
+ *
+ * Return 0 if ok, else 1.
+ */
+int fat_usage(disk_t *disk, uint64_t start, uint8_t *bpb, fat_usage_t *usage)
+{
+  fat_geo_t geo;
+  int err = 0;
+
+  *usage = (fat_usage_t) {};
+
+  if(fat_parse_bpb(&geo, bpb)) return 1;
+
+  uint32_t entries = geo.clusters + 2;
+  uint64_t pos = start + (uint64_t) geo.fat_start * geo.sector_size;
+
+  // everything read ends up in the chunk cache
+  if(((uint64_t) entries * geo.bits + 7) / 8 > FAT_MAX_TABLE) return 1;
+
+  // a multiple of 2 entries, so FAT12 pieces start at a byte boundary
+  uint32_t chunk_entries = FAT_SCAN_CHUNK * 8 / geo.bits;
+  uint8_t *buf = malloc(FAT_SCAN_CHUNK + 1);
+  uint32_t *table = malloc((chunk_entries + FAT_COUNT_STEP) * sizeof *table);
+
+  if(!buf || !table) err = 1;
+
+  for(uint32_t first = 0; first < entries && !err; first += chunk_entries) {
+    uint32_t count = entries - first < chunk_entries ? entries - first : chunk_entries;
+
+    if(disk_read_bytes(disk, buf, pos + (uint64_t) first * geo.bits / 8, ((uint64_t) count * geo.bits + 7) / 8)) {
+      err = 1;
+      break;
+    }
+
+    fat_decode(geo.bits, buf, table, count);
+
+    // entries 0 and 1 are not clusters; 1 is not counted, see fat_count()
+    if(!first) table[0] = table[1] = 1;
+
+    fat_count(usage, table, first, count, entries);
+  }
+
+  free(table);
+  free(buf);
+
+  if(err) return 1;
+
+  usage->clusters = geo.clusters;
+  usage->cluster_size = geo.cluster_size;
+  usage->used = geo.clusters - usage->free - usage->bad;
+
+  if(geo.bits == 32) fat_fsinfo(disk, start, bpb, &geo, usage);
+
+  return 0;
+}
+
+
+/*
+ * Find file containing block in any FAT fs registered via fat_add_fs().
+ *
+ * block is in 512 byte units, relative to disk start.
+ *
+ * See iso_block_to_name() for the other arguments.
+ */
+char *fat_block_to_name(disk_t *disk, uint64_t block, uint64_t *len, char *buf, unsigned buf_size)
+{
+  for(unsigned u = 0; u < fat_list.len; u++) {
+    fat_fs_t *fs = fat_list.list + u;
+
+    // the first block is never part of a file; dump_fs() looks it up
+    if(fs->disk != disk->index || block <= fs->start / 512 || block >= (fs->start + fs->geo.size) / 512) continue;
+
+    if(!fs->read) fat_read(disk, fs);
+
+    char *name = file_index_lookup(&fs->files, block - fs->start / 512, len, buf, buf_size);
+
+    if(name) return name;
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Get fs layout from BPB.
+ *
+ * As Linux does, a BPB with FAT32 fields means FAT32, regardless of the
+ * number of clusters.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int fat_parse_bpb(fat_geo_t *geo, uint8_t *bpb)
+{
+  unsigned sectors_per_cluster, fats, bpb32 = 0;
+  uint32_t sectors;
+
+  *geo = (fat_geo_t) {};
+
+  if(read_word_le(bpb + 0x1fe) != 0xaa55) return 1;
+
+  geo->sector_size = read_word_le(bpb + 11);
+  sectors_per_cluster = read_byte(bpb + 13);
+  geo->fat_start = read_word_le(bpb + 14);
+  fats = read_byte(bpb + 16);
+  geo->root_entries = read_word_le(bpb + 17);
+  sectors = read_word_le(bpb + 19);
+  if(!sectors) sectors = read_dword_le(bpb + 32);
+  geo->fat_sectors = read_word_le(bpb + 22);
+  if(!geo->fat_sectors) {
+    bpb32 = 1;
+    geo->fat_sectors = read_dword_le(bpb + 36);
+    geo->root_cluster = read_dword_le(bpb + 44);
+  }
+
+  if(
+    geo->sector_size < 0x200 || geo->sector_size > 0x1000 ||
+    (geo->sector_size & (geo->sector_size - 1)) ||
+    !sectors_per_cluster || (sectors_per_cluster & (sectors_per_cluster - 1)) ||
+    !fats || !geo->fat_start || !geo->fat_sectors
+  ) return 1;
+
+  geo->cluster_size = geo->sector_size * sectors_per_cluster;
+  geo->root_start = geo->fat_start + fats * geo->fat_sectors;
+  geo->data_start = geo->root_start + (geo->root_entries * 32 + geo->sector_size - 1) / geo->sector_size;
+
+  if(geo->data_start >= sectors) return 1;
+
+  geo->clusters = (sectors - geo->data_start) / sectors_per_cluster;
+  geo->size = (uint64_t) sectors * geo->sector_size;
+
+  geo->bits = bpb32 ? 32 : geo->clusters >= 4085 ? 16 : 12;
+
+  // FAT32 has no fixed root directory; FAT12/16 have no root cluster
+  if(bpb32 != (geo->root_entries == 0)) return 1;
+  if(geo->bits == 32 && (geo->root_cluster < 2 || geo->root_cluster >= geo->clusters + 2)) return 1;
+
+  // the FAT must cover all clusters
+  if((uint64_t) geo->fat_sectors * geo->sector_size * 8 < ((uint64_t) geo->clusters + 2) * geo->bits) return 1;
+
+  return 0;
+}
+
+
+/*
+ * Load first FAT in one go and convert it to FAT32 entries.
+ *
+ * Return malloc'ed array with geo.clusters + 2 entries or NULL.
+ */
+static uint32_t *fat_load_table(disk_t *disk, fat_fs_t *fs)
+{
+  fat_geo_t *geo = &fs->geo;
+  uint32_t entries = geo->clusters + 2;
+  uint64_t size = ((uint64_t) entries * geo->bits + 7) / 8;
+
+  if(size > FAT_MAX_TABLE) return NULL;
+
+  uint8_t *buf = malloc(size + 1);
+
+  if(!buf || disk_read_bytes(disk, buf, fs->start + (uint64_t) geo->fat_start * geo->sector_size, size)) {
+    free(buf);
+
+    return NULL;
+  }
+
+  uint32_t *table = malloc(entries * sizeof *table);
+
+  if(!table) {
+    free(buf);
+
+    return NULL;
+  }
+
+  fat_decode(geo->bits, buf, table, entries);
+
+  free(buf);
+
+  return table;
+}
+
+
+/*
+ * Convert 'count' FAT entries in buf to FAT32 entries.
+ *
+ * For FAT12, buf must have one extra byte.
+ */
+static void fat_decode(unsigned bits, uint8_t *buf, uint32_t *table, uint32_t count)
+{
+  // this runs over the whole FAT, so no read_*_le() calls for FAT16 and FAT32
+  if(bits == 12) {
+    for(uint32_t u = 0; u < count; u++) {
+      uint32_t val = read_word_le(buf + u + u / 2);
+      val = (u & 1) ? val >> 4 : val & 0xfff;
+      if(val >= 0xff7) val |= 0x0ffff000;
+      table[u] = val;
+    }
+  }
+  else if(bits == 16) {
+    for(uint32_t u = 0; u < count; u++) {
+      uint32_t val = buf[2 * u] + (buf[2 * u + 1] << 8);
+      table[u] = val >= 0xfff7 ? val | 0x0fff0000 : val;
+    }
+  }
+  else {
+    for(uint32_t u = 0; u < count; u++) {
+      uint8_t *b = buf + 4 * u;
+      table[u] = (b[0] + (b[1] << 8) + (b[2] << 16) + ((uint32_t) b[3] << 24)) & 0x0fffffff;
+    }
+  }
+}
+
+
+/*
+ * Add 'count' converted FAT entries, starting at cluster 'first', to usage.
+ *
+ * entries is the FAT size; links to clusters beyond it end a chain.
+ *
+ * Every chain ends in one end-of-chain mark and starts a new fragment at
+ * every link that is not to the next cluster.
+ *
+ * table must have room for FAT_COUNT_STEP - 1 more entries. They are set
+ * to 1, which counts as nothing.
+ */
+static void fat_count(fat_usage_t *usage, uint32_t *table, uint32_t first, uint32_t count, uint32_t entries)
+{
+  uint32_t unused = 0, bad = 0, chains = 0, gaps = 0;
+  uint32_t padded = (count + FAT_COUNT_STEP - 1) / FAT_COUNT_STEP * FAT_COUNT_STEP;
+
+  for(uint32_t u = count; u < padded; u++) table[u] = 1;
+
+  // a fixed size inner loop without branches: gcc 12 and later vectorize
+  // it at -O2, and without that it's still free of mispredicted branches
+  for(uint32_t u = 0; u < padded; u += FAT_COUNT_STEP) {
+    for(unsigned i = 0; i < FAT_COUNT_STEP; i++) {
+      uint32_t val = table[u + i];
+
+      unused += val == 0;
+      bad += val == FAT_BAD;
+      chains += val > FAT_BAD;
+      gaps += (val >= 2) & (val < entries) & (val != first + u + i + 1);
+    }
+  }
+
+  usage->free += unused;
+  usage->bad += bad;
+  usage->chains += chains;
+  usage->fragments += chains + gaps;
+}
+
+
+/*
+ * Get free cluster count from FAT32 fs info sector.
+ */
+static void fat_fsinfo(disk_t *disk, uint64_t start, uint8_t *bpb, fat_geo_t *geo, fat_usage_t *usage)
+{
+  uint8_t buf[0x200];
+  unsigned sector = read_word_le(bpb + 48);
+
+  if(!sector || sector >= geo->fat_start) return;
+
+  if(disk_read_bytes(disk, buf, start + (uint64_t) sector * geo->sector_size, sizeof buf)) return;
+
+  if(
+    read_dword_le(buf) != 0x41615252 ||
+    read_dword_le(buf + 484) != 0x61417272 ||
+    read_dword_le(buf + 508) != 0xaa550000
+  ) return;
+
+  uint32_t unused = read_dword_le(buf + 488);
+
+  // 0xffffffff = not known
+  if(unused == 0xffffffff) return;
+
+  usage->fsinfo = 1;
+  usage->fsinfo_free = unused;
+}
+
+
+/*
+ * Read directory tree and add all files to fs->files.
+ */
+static void fat_read(disk_t *disk, fat_fs_t *fs)
+{
+  uint32_t *table;
+
+  fs->read = 1;
+
+  if(!(table = fat_load_table(disk, fs))) return;
+
+  fat_dirs_t dirs = {};
+
+  fat_add_dir(&dirs, fs->geo.bits == 32 ? fs->geo.root_cluster : 0, 0, strdup("/"));
+
+  for(unsigned u = 0; u < dirs.len && u < FAT_MAX_DIRS; u++) {
+    fat_walk_dir(disk, fs, table, &dirs, u);
+  }
+
+  for(unsigned u = 0; u < dirs.len; u++) free(dirs.list[u].name);
+  free(dirs.list);
+
+  free(table);
+
+  file_index_sort(&fs->files);
+}
+
+
+/*
+ * Get cluster chain starting at 'cluster' as list of runs.
+ *
+ * The chain ends at the first entry that is not a valid cluster number.
+ * Loops are cut off after fs->geo.clusters entries.
+ *
+ * Return number of runs; *runs must be freed.
+ */
+static unsigned fat_runs(fat_fs_t *fs, uint32_t *table, uint32_t cluster, fat_run_t **runs)
+{
+  unsigned len = 0, max = 0;
+
+  *runs = NULL;
+
+  for(uint32_t count = 0; cluster >= 2 && cluster < fs->geo.clusters + 2 && count < fs->geo.clusters; count++) {
+    if(len && (*runs)[len - 1].start + (*runs)[len - 1].len == cluster) {
+      (*runs)[len - 1].len++;
+    }
+    else {
+      if(len == max) {
+        max = max ? 2 * max : 16;
+        *runs = reallocarray(*runs, max, sizeof **runs);
+      }
+      (*runs)[len++] = (fat_run_t) { .start = cluster, .len = 1 };
+    }
+
+    cluster = table[cluster];
+  }
+
+  return len;
+}
+
+
+/*
+ * Read directory data.
+ *
+ * With runs_len == 0, read the FAT12/16 root directory.
+ *
+ * Return malloc'ed buffer with 'len' bytes, or NULL.
+ */
+static uint8_t *fat_read_dir(disk_t *disk, fat_fs_t *fs, fat_run_t *runs, unsigned runs_len, unsigned *len)
+{
+  fat_geo_t *geo = &fs->geo;
+  uint64_t size = 0;
+  uint8_t *buf;
+
+  if(!runs_len) {
+    size = geo->root_entries * 32;
+    buf = malloc(size + 1);
+    if(!size || disk_read_bytes(disk, buf, fs->start + (uint64_t) geo->root_start * geo->sector_size, size)) {
+      free(buf);
+
+      return NULL;
+    }
+    *len = size;
+
+    return buf;
+  }
+
+  for(unsigned u = 0; u < runs_len; u++) size += (uint64_t) runs[u].len * geo->cluster_size;
+
+  if(size > FAT_MAX_DIR_SIZE) size = FAT_MAX_DIR_SIZE;
+
+  buf = malloc(size + 1);
+
+  uint64_t pos = 0;
+
+  for(unsigned u = 0; u < runs_len && pos < size; u++) {
+    uint64_t chunk = (uint64_t) runs[u].len * geo->cluster_size;
+    uint64_t sector = geo->data_start + (uint64_t) (runs[u].start - 2) * (geo->cluster_size / geo->sector_size);
+
+    if(chunk > size - pos) chunk = size - pos;
+
+    if(disk_read_bytes(disk, buf + pos, fs->start + sector * geo->sector_size, chunk)) {
+      free(buf);
+
+      return NULL;
+    }
+
+    pos += chunk;
+  }
+
+  *len = size;
+
+  return buf;
+}
+
+
+/*
+ * Add runs of a file to fs->files, up to 'size' bytes.
+ */
+static void fat_register(fat_fs_t *fs, fat_run_t *runs, unsigned runs_len, uint64_t size, char *name)
+{
+  fat_geo_t *geo = &fs->geo;
+  uint64_t offset = 0;
+
+  for(unsigned u = 0; u < runs_len && offset < size; u++) {
+    uint64_t chunk = (uint64_t) runs[u].len * geo->cluster_size;
+    uint64_t sector = geo->data_start + (uint64_t) (runs[u].start - 2) * (geo->cluster_size / geo->sector_size);
+
+    if(chunk > size - offset) chunk = size - offset;
+
+    file_index_add(&fs->files, sector * (geo->sector_size / 512), chunk, offset / 512, size, name);
+
+    offset += chunk;
+  }
+}
+
+
+static void fat_add_dir(fat_dirs_t *dirs, uint32_t cluster, unsigned parent, char *name)
+{
+  if(dirs->len == dirs->max) {
+    dirs->max = dirs->max ? 2 * dirs->max : 64;
+    dirs->list = reallocarray(dirs->list, dirs->max, sizeof *dirs->list);
+  }
+
+  dirs->list[dirs->len++] = (fat_dir_t) { .cluster = cluster, .parent = parent, .name = name };
+}
+
+
+/*
+ * Register all entries of a directory and queue its subdirectories.
+ *
+ * Long file names are used if their checksum matches the short name.
+ */
+static void fat_walk_dir(disk_t *disk, fat_fs_t *fs, uint32_t *table, fat_dirs_t *dirs, unsigned idx)
+{
+  fat_run_t *runs = NULL;
+  unsigned runs_len = 0, len = 0;
+  uint8_t *buf;
+  uint8_t lfn[20 * 26];		// UTF-16BE, up to 20 entries of 13 characters
+  unsigned lfn_sum = 0, lfn_next = 0;
+
+  if(dirs->list[idx].cluster) {
+    runs_len = fat_runs(fs, table, dirs->list[idx].cluster, &runs);
+    if(!runs_len) return;
+  }
+
+  if(!(buf = fat_read_dir(disk, fs, runs, runs_len, &len))) {
+    free(runs);
+
+    return;
+  }
+
+  free(runs);
+
+  for(unsigned pos = 0; pos + 32 <= len; pos += 32) {
+    uint8_t *entry = buf + pos;
+    unsigned attr = entry[11];
+
+    if(entry[0] == 0) break;
+
+    if(entry[0] == 0xe5) {
+      lfn_next = 0;
+      continue;
+    }
+
+    // long name entries come in reverse order, last part first
+    if((attr & 0x3f) == 0x0f) {
+      unsigned seq = entry[0] & 0x1f;
+      if((entry[0] & 0x40) && seq && seq <= 20) {
+        memset(lfn, 0, sizeof lfn);
+        lfn_sum = entry[13];
+        lfn_next = seq;
+      }
+      if(lfn_next && seq == lfn_next && entry[13] == lfn_sum) {
+        static unsigned ofs[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+        for(unsigned u = 0; u < 13; u++) {
+          lfn[((seq - 1) * 13 + u) * 2] = entry[ofs[u] + 1];
+          lfn[((seq - 1) * 13 + u) * 2 + 1] = entry[ofs[u]];
+        }
+        lfn_next = seq - 1 ? seq - 1 : 0x100;
+      }
+      else {
+        lfn_next = 0;
+      }
+      continue;
+    }
+
+    int has_lfn = lfn_next == 0x100;
+    lfn_next = 0;
+
+    // volume label, '.', '..'
+    if((attr & 0x08) || entry[0] == '.') continue;
+
+    unsigned sum = 0;
+    for(unsigned u = 0; u < 11; u++) sum = (((sum & 1) << 7) + (sum >> 1) + entry[u]) & 0xff;
+
+    char *name = has_lfn && sum == lfn_sum ? utf16be_to_utf8(lfn, sizeof lfn) : NULL;
+    if(!name || !*name) {
+      free(name);
+      name = fat_short_name(entry);
+    }
+
+    uint32_t cluster = read_word_le(entry + 26);
+    if(fs->geo.bits == 32) cluster += read_word_le(entry + 20) << 16;
+    uint32_t size = read_dword_le(entry + 28);
+
+    char *path;
+    asprintf(&path, "%s%s", dirs->list[idx].name, name);
+    free(name);
+
+    if((attr & 0x10)) {
+      if(cluster >= 2 && dirs->len < FAT_MAX_DIRS && !fat_is_ancestor(dirs, idx, cluster)) {
+        runs_len = fat_runs(fs, table, cluster, &runs);
+        uint64_t dir_size = 0;
+        for(unsigned u = 0; u < runs_len; u++) dir_size += (uint64_t) runs[u].len * fs->geo.cluster_size;
+        if(dir_size > FAT_MAX_DIR_SIZE) dir_size = FAT_MAX_DIR_SIZE;
+        fat_register(fs, runs, runs_len, dir_size, path);
+        free(runs);
+
+        // note: dirs->list may move
+        char *dir_name;
+        asprintf(&dir_name, "%s/", path);
+        fat_add_dir(dirs, cluster, idx, dir_name);
+      }
+    }
+    else if(size) {
+      runs_len = fat_runs(fs, table, cluster, &runs);
+      fat_register(fs, runs, runs_len, size, path);
+      free(runs);
+    }
+
+    free(path);
+  }
+
+  free(buf);
+}
+
+
+/*
+ * Check if directory 'idx' or one of its parents starts at 'cluster'.
+ *
+ * This catches directory loops in broken file systems.
+ */
+static int fat_is_ancestor(fat_dirs_t *dirs, unsigned idx, uint32_t cluster)
+{
+  for(unsigned depth = 0; depth < dirs->len; depth++) {
+    if(dirs->list[idx].cluster == cluster) return 1;
+    if(idx == 0) break;
+    idx = dirs->list[idx].parent;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Get 8.3 name from directory entry.
+ *
+ * The lower case flags (as set by Windows NT) are taken into account.
+ *
+ * Return malloc'ed string.
+ */
+static char *fat_short_name(uint8_t *entry)
+{
+  char *name = malloc(12 * 2 + 1), *s = name;
+  unsigned len, ext_len;
+
+  for(len = 8; len && entry[len - 1] == ' '; len--);
+  for(ext_len = 3; ext_len && entry[8 + ext_len - 1] == ' '; ext_len--);
+
+  *s = 0;
+
+  for(unsigned u = 0; u < len + ext_len; u++) {
+    unsigned c = u < len ? entry[u] : entry[8 + u - len];
+
+    if(u == 0 && c == 0x05) c = 0xe5;
+    if(u == len) strcat(s, ".");
+    if(c >= 'A' && c <= 'Z' && (entry[12] & (u < len ? 0x08 : 0x10))) c += 'a' - 'A';
+
+    strcat(s, utf8_encode(c));
+  }
+
+  return name;
+}
@@ -0,0 +1,17 @@
+// cluster usage, see fat_usage()
+typedef struct {
+  uint32_t clusters;		// data clusters
+  unsigned cluster_size;	// in bytes
+  uint32_t free;
+  uint32_t used;
+  uint32_t bad;
+  uint32_t chains;		// cluster chains (files and directories)
+  uint32_t fragments;		// contiguous pieces of all chains
+  uint32_t fsinfo_free;		// free clusters according to FAT32 fs info
+  unsigned fsinfo:1;		// fsinfo_free is valid
+} fat_usage_t;
+
+void fat_add_fs(disk_t *disk, uint64_t start, uint8_t *bpb);
+void fat_probe(disk_t *disk, uint64_t start);
+int fat_usage(disk_t *disk, uint64_t start, uint8_t *bpb, fat_usage_t *usage);
+char *fat_block_to_name(disk_t *disk, uint64_t block, uint64_t *len, char *buf, unsigned buf_size);
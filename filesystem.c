@@ -9,6 +9,7 @@
 #include <getopt.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <uuid/uuid.h>
@@ -21,74 +22,309 @@
 
 #include "disk.h"
 #include "filesystem.h"
+#include "fs_native.h"
+#include "ext4.h"
+#include "fat.h"
+#include "iso9660.h"
+#include "udf.h"
 #include "util.h"
 
+// results of fs_probe() and data for fs_detail_fat(), per disk and offset
 typedef struct {
-  char *type;
-  char *label;
-  char *uuid;
-} fs_detail_t;
-
-typedef struct file_start_s {
-  struct file_start_s *next;
-  unsigned block;
-  unsigned len;
-  char *name;
-} file_start_t;
+  unsigned disk;
+  uint64_t offset;
+  fs_detail_t detail;
+  uint64_t bytes;		// bytes the probe looked at
+  uint64_t fetched;		// bytes read from the device for it
+  unsigned probed:1;
+  unsigned native:1;		// blkid was not needed
+  unsigned fat_read:1;
+  unsigned fat_counted:1;	// fat_usage() has been run
+  unsigned fat_usage_ok:1;	// and fat_usage is valid
+  uint8_t fat_bpb[0x200];	// first sector, if fat_read is set
+  fat_usage_t fat_usage;
+} fs_probe_t;
+
+// data for fs_blkid_run()
+typedef struct {
+  fs_detail_t *fs;
+  uint64_t offset;		// file system start
+} fs_blkid_t;
+
+// persistent ISO file index header; followed by the files, max_end, and names
+typedef struct {
+  char magic[8];
+  uint64_t size;		// disk size
+  uint64_t digest;		// digest of volume descriptors and reader
+  uint64_t names_len;
+  uint32_t files;
+  uint32_t file_size;		// sizeof (file_extent_t)
+} iso_index_header_t;
+
+#define ISO_INDEX_MAGIC		"parti.i4"
+
+// ISO9660 and UDF files of a disk
+typedef struct {
+  unsigned disk;		// disk index
+  unsigned read:1;		// read_iso_detail() has been run
+  file_index_t files;		// file extents registered via iso_add_extent()
+} iso_files_t;
 
 int fs_probe(fs_detail_t *fs, disk_t *disk, uint64_t offset);
-int fs_detail_fat(disk_t *disk, int indent, uint64_t sector);
+static fs_probe_t *fs_probe_lookup(disk_t *disk, uint64_t offset);
+static int fs_probe_blkid(fs_detail_t *fs, disk_t *disk, uint64_t offset);
+static int fs_blkid_run(int fd, void *data);
+int fs_detail_fat(json_object *json_fs, disk_t *disk, int indent, uint64_t sector);
+int fs_detail_ext(json_object *json_fs, disk_t *disk, int indent, uint64_t sector);
 int fs_detail_iso9660(json_object *json_fs, disk_t *disk, int indent, uint64_t sector);
 void read_iso_detail(disk_t *disk);
+void iso_add_file(disk_t *disk, uint64_t block, uint64_t len, const char *name);
+void iso_add_extent(disk_t *disk, uint64_t block, uint64_t size, uint64_t offset, uint64_t len, const char *name);
+static iso_files_t *iso_files_lookup(disk_t *disk);
+static int file_index_cmp(const void *a, const void *b);
+static file_extent_t *file_index_find(file_index_t *index, uint64_t block);
+static int iso_index_digest(disk_t *disk, uint64_t *digest);
+static char *iso_index_file(uint64_t digest);
+static int iso_index_load(disk_t *disk, uint64_t digest);
+static void iso_index_save(disk_t *disk, uint64_t digest);
 void read_isoinfo(disk_t *disk);
 void read_xorriso(disk_t *disk);
 
-file_start_t *iso_offsets = NULL;
-int iso_read = 0;
+static struct {
+  iso_files_t *list;
+  unsigned len;
+} iso_list;
+
+static struct {
+  fs_probe_t *list;
+  unsigned len;
+} fs_probes;
+
+// data read by fs_probe() for the file system at disk start
+disk_range_t fs_read_plan[] = {
+  { 0, 0x1000 },
+  { 0x8000, 0x1000 },
+  { 0x10000, 0x200 },
+  { }
+};
+
+/*
+ * Find probe results for disk and byte offset.
+ *
+ * Adds an empty entry if there is none yet.
+ *
+ * The returned pointer is valid until the next call.
+ */
+static fs_probe_t *fs_probe_lookup(disk_t *disk, uint64_t offset)
+{
+  for(unsigned u = 0; u < fs_probes.len; u++) {
+    if(fs_probes.list[u].disk == disk->index && fs_probes.list[u].offset == offset) return fs_probes.list + u;
+  }
+
+  fs_probes.list = reallocarray(fs_probes.list, fs_probes.len + 1, sizeof *fs_probes.list);
+  fs_probes.list[fs_probes.len] = (fs_probe_t) { .disk = disk->index, .offset = offset };
+
+  return fs_probes.list + fs_probes.len++;
+}
 
+
+/*
+ * Probe for file system at byte offset.
+ *
+ * Each offset is probed only once; later calls get the same result. The
+ * strings in 'fs' must not be freed.
+ */
 int fs_probe(fs_detail_t *fs, disk_t *disk, uint64_t offset)
 {
-  const char *data;
+  fs_probe_t *probe = fs_probe_lookup(disk, offset);
+
+  if(probe->probed) {
+    disk->stats.fs_probe_hits++;
+    *fs = probe->detail;
+
+    return fs->type ? 1 : 0;
+  }
+
+  uint64_t bytes = disk->stats.fs_probe_bytes;
+  uint64_t fetched = disk->stats.chunks + disk->stats.mapped;
+
+  // the common cases are handled without blkid
+  if(fs_native_probe(fs, disk, offset)) {
+    disk->stats.fs_native++;
+    probe->native = 1;
+  }
+  else if(fs_probe_blkid(fs, disk, offset) == -1) {
+    return 0;
+  }
+
+  disk->stats.fs_probes++;
+
+  // fs_probe_lookup() may have moved the list
+  probe = fs_probe_lookup(disk, offset);
+
+  probe->probed = 1;
+  probe->detail = *fs;
+  probe->bytes = disk->stats.fs_probe_bytes - bytes;
+  probe->fetched = (disk->stats.chunks + disk->stats.mapped - fetched) * DISK_CHUNK_SIZE;
+
+  // if(fs->type) printf("ofs = %llu, type = '%s', label = '%s', uuid = '%s'\n", (unsigned long long) offset, fs->type, fs->label ?: "", fs->uuid ?: "");
+
+  return fs->type ? 1 : 0;
+}
 
-  *fs = (fs_detail_t) {};
 
+/*
+ * Let blkid probe for file system at byte offset.
+ *
+ * blkid sees the first 68 KiB at that offset (or up to the disk end);
+ * everything else reads as zeros. If possible, only what blkid actually
+ * reads is fetched (see disk_lazy_run()). Else the whole window is read
+ * in advance and blkid gets the disk memfd (where areas other callers
+ * asked for show up, too).
+ *
+ * Return -1 if the disk data can't be passed to blkid, else 0.
+ */
+static int fs_probe_blkid(fs_detail_t *fs, disk_t *disk, uint64_t offset)
+{
   uint8_t buf[disk->block_size];
+  uint64_t size = 68 * 1024;
+  fs_blkid_t blkid = { .fs = fs, .offset = offset };
+  int result;
 
-  for(uint64_t u = 0; u < 68 * 1024; u += disk->block_size) {
+  *fs = (fs_detail_t) {};
+
+  if(offset >= disk->size_in_bytes) return 0;
+
+  if(size > disk->size_in_bytes - offset) size = disk->size_in_bytes - offset;
+
+  if(!disk_lazy_run(disk, offset, size, fs_blkid_run, &blkid, &result)) return 0;
+
+  for(uint64_t u = 0; u < size; u += disk->block_size) {
     disk_read(disk, buf, (offset + u) / disk->block_size, 1);
   }
 
-  int disk_fd = disk_to_fd(disk, offset);
+  disk->stats.fs_probe_bytes += size;
+
+  int disk_fd = disk_memfd(disk, offset, size);
 
-  if(disk_fd == -1) return 0;
+  if(disk_fd == -1) return -1;
+
+  fs_blkid_run(disk_fd, &blkid);
+
+  return 0;
+}
+
+
+/*
+ * Run blkid on fd, for a file system at blkid->offset.
+ *
+ * Return 0.
+ */
+static int fs_blkid_run(int fd, void *data)
+{
+  fs_blkid_t *blkid = data;
+  fs_detail_t *fs = blkid->fs;
+  const char *value;
 
   blkid_probe pr = blkid_new_probe();
 
-  blkid_probe_set_device(pr, disk_fd, 0, 0);
+  if(!pr) return 0;
 
-  // blkid_probe_get_value(pr, n, &name, &data, &size)
+  blkid_probe_set_device(pr, fd, (blkid_loff_t) blkid->offset, 0);
 
   if(blkid_do_safeprobe(pr) == 0) {
-    if(!blkid_probe_lookup_value(pr, "TYPE", &data, NULL)) {
-      fs->type = strdup(data);
+    if(!blkid_probe_lookup_value(pr, "TYPE", &value, NULL)) {
+      fs->type = strdup(value);
 
-      if(!blkid_probe_lookup_value(pr, "LABEL", &data, NULL)) {
-        fs->label = strdup(data);
+      if(!blkid_probe_lookup_value(pr, "LABEL", &value, NULL)) {
+        fs->label = strdup(value);
       }
 
-      if(!blkid_probe_lookup_value(pr, "UUID", &data, NULL)) {
-        fs->uuid = strdup(data);
+      if(!blkid_probe_lookup_value(pr, "UUID", &value, NULL)) {
+        fs->uuid = strdup(value);
       }
     }
   }
 
   blkid_free_probe(pr);
 
-  close(disk_fd);
+  return 0;
+}
 
-  // if(fs->type) printf("ofs = %llu, type = '%s', label = '%s', uuid = '%s'\n", (unsigned long long) offset, fs->type, fs->label ?: "", fs->uuid ?: "");
 
-  return fs->type ? 1 : 0;
+/*
+ * Show file system probes and how much data each of them needed.
+ */
+void fs_show_probes(disk_t *disk)
+{
+  json_object *json_probes = NULL;
+
+  for(unsigned u = 0; u < fs_probes.len; u++) {
+    fs_probe_t *probe = fs_probes.list + u;
+
+    if(probe->disk != disk->index || !probe->probed) continue;
+
+    if(!json_probes) {
+      log_info(SEP "\nfs probes:\n");
+      json_probes = json_object_new_array();
+      json_object_object_add(disk->json_disk, "fs_probes", json_probes);
+    }
+
+    log_info("  offset %"PRIu64": %s%s, %"PRIu64" bytes read (%"PRIu64" from disk)\n",
+      probe->offset,
+      probe->detail.type ?: "no fs",
+      probe->native ? "" : " (blkid)",
+      probe->bytes,
+      probe->fetched
+    );
+
+    json_object *json_probe = json_object_new_object();
+    json_object_array_add(json_probes, json_probe);
+
+    json_object_object_add(json_probe, "offset", json_object_new_int64(probe->offset));
+    if(probe->detail.type) json_object_object_add(json_probe, "type", json_object_new_string(probe->detail.type));
+    json_object_object_add(json_probe, "blkid", json_object_new_boolean(!probe->native));
+    json_object_object_add(json_probe, "bytes", json_object_new_int64(probe->bytes));
+    json_object_object_add(json_probe, "fetched", json_object_new_int64(probe->fetched));
+  }
+}
+
+
+/*
+ * Show files containing the blocks given via --lookup.
+ */
+void fs_show_lookups(disk_t *disk)
+{
+  char file_name[ISO_NAME_SIZE];
+
+  if(!opt.lookup.len) return;
+
+  log_info(SEP "\nlookup:\n");
+
+  json_object *json_lookups = json_object_new_array();
+  json_object_object_add(disk->json_disk, "lookup", json_lookups);
+
+  for(unsigned u = 0; u < opt.lookup.len; u++) {
+    uint64_t lba = opt.lookup.list[u];
+    uint64_t len = UINT64_MAX;
+    char *s = iso_block_to_name(disk, lba * disk->block_size / 512, &len, file_name, sizeof file_name);
+
+    log_info("  lba %"PRIu64": ", lba);
+
+    if(s) {
+      log_info("\"%s\", size %"PRIu64"\n", s, len);
+    }
+    else {
+      log_info("no file\n");
+    }
+
+    json_object *json_lookup = json_object_new_object();
+    json_object_array_add(json_lookups, json_lookup);
+
+    json_object_object_add(json_lookup, "lba", json_object_new_int64(lba));
+    if(s) json_object_object_add(json_lookup, "file_name", json_object_new_string(s));
+    if(s && len != UINT64_MAX) json_object_object_add(json_lookup, "file_size", json_object_new_int64((int64_t) len));
+  }
 }
 
 
@@ -99,9 +335,8 @@ int fs_probe(fs_detail_t *fs, disk_t *disk, uint64_t offset)
  * The output is indented by 'indent' spaces.
  * If indent is 0, prints also a separator line.
  */
-int fs_detail_fat(disk_t *disk, int indent, uint64_t sector)
+int fs_detail_fat(json_object *json_fs, disk_t *disk, int indent, uint64_t sector)
 {
-  unsigned char buf[disk->block_size];
   int i;
   unsigned bpb_len, fat_bits, bpb32;
   unsigned bytes_p_sec, sec_p_cluster, resvd_sec, fats, root_ents, sectors;
@@ -110,9 +345,26 @@ int fs_detail_fat(disk_t *disk, int indent, uint64_t sector)
 
   if(disk->block_size < 0x200) return 0;
 
-  i = disk_read(disk, buf, sector, 1);
+  // the first sector and the cluster usage are kept with the probe results
+  uint64_t offset = sector * disk->block_size;
+  fs_probe_t *probe = fs_probe_lookup(disk, offset);
+  unsigned char buf[sizeof probe->fat_bpb];
+
+  if(!probe->fat_read) {
+    unsigned char sector_buf[disk->block_size];
+    if(disk_read(disk, sector_buf, sector, 1)) {
+      memset(probe->fat_bpb, 0, sizeof probe->fat_bpb);
+    }
+    else {
+      memcpy(probe->fat_bpb, sector_buf, sizeof probe->fat_bpb);
+    }
+    probe->fat_read = 1;
+  }
+
+  // a copy: fs_probe_lookup() may move the list
+  memcpy(buf, probe->fat_bpb, sizeof buf);
 
-  if(i || read_word_le(buf + 0x1fe) != 0xaa55) return 0;
+  if(read_word_le(buf + 0x1fe) != 0xaa55) return 0;
 
   if(read_byte(buf) == 0xeb) {
     i = 2 + (int8_t) read_byte(buf + 1);
@@ -159,6 +411,9 @@ int fs_detail_fat(disk_t *disk, int indent, uint64_t sector)
 
   drv_num = read_byte(buf + (bpb32 ? 64 : 36));
 
+  // for block to file name lookups
+  fat_add_fs(disk, sector * disk->block_size, buf);
+
   if(indent == 0) log_info(SEP "\n");
 
   log_info("%*sfat%u:\n", indent, "", fat_bits);
@@ -224,6 +479,95 @@ int fs_detail_fat(disk_t *disk, int indent, uint64_t sector)
     );
   }
 
+  fat_usage_t usage;
+  int usage_ok;
+
+  probe = fs_probe_lookup(disk, offset);
+
+  if(probe->fat_counted) {
+    usage = probe->fat_usage;
+    usage_ok = probe->fat_usage_ok;
+  }
+  else {
+    usage_ok = !fat_usage(disk, offset, buf, &usage);
+    probe = fs_probe_lookup(disk, offset);
+    probe->fat_counted = 1;
+    probe->fat_usage_ok = usage_ok;
+    probe->fat_usage = usage;
+  }
+
+  if(usage_ok) {
+    log_info("%*sfree %u, used %u, bad %u clusters (%u%% used)\n", indent, "",
+      usage.free,
+      usage.used,
+      usage.bad,
+      usage.clusters ? (unsigned) ((uint64_t) usage.used * 100 / usage.clusters) : 0
+    );
+
+    if(usage.fsinfo) {
+      log_info("%*sfs info free %u (%s)\n", indent, "",
+        usage.fsinfo_free,
+        usage.fsinfo_free == usage.free ? "ok" : "wrong"
+      );
+    }
+
+    log_info("%*scluster chains %u, fragments %u\n", indent, "",
+      usage.chains,
+      usage.fragments
+    );
+
+    json_object *json_usage = json_object_new_object();
+    json_object_object_add(json_fs, "usage", json_usage);
+
+    json_object_object_add(json_usage, "cluster_size", json_object_new_int(usage.cluster_size));
+    json_object_object_add(json_usage, "clusters", json_object_new_int64(usage.clusters));
+    json_object_object_add(json_usage, "free", json_object_new_int64(usage.free));
+    json_object_object_add(json_usage, "used", json_object_new_int64(usage.used));
+    json_object_object_add(json_usage, "bad", json_object_new_int64(usage.bad));
+    if(usage.fsinfo) {
+      json_object_object_add(json_usage, "fsinfo_free", json_object_new_int64(usage.fsinfo_free));
+      json_object_object_add(json_usage, "fsinfo_ok", json_object_new_boolean(usage.fsinfo_free == usage.free));
+    }
+    json_object_object_add(json_usage, "chains", json_object_new_int64(usage.chains));
+    json_object_object_add(json_usage, "fragments", json_object_new_int64(usage.fragments));
+  }
+
+  return 1;
+}
+
+
+/*
+ * Print ext2/3/4 file system details.
+ *
+ * The fs is registered for block to file name lookups. Reading the inode
+ * tables may take a while, so the file map is built here only if blocks
+ * are going to be looked up (--lookup).
+ *
+ * The fs starts at sector (sector size is disk->block_size).
+ * The output is indented by 'indent' spaces.
+ */
+int fs_detail_ext(json_object *json_fs, disk_t *disk, int indent, uint64_t sector)
+{
+  ext4_map_info_t map;
+
+  ext4_probe(disk, sector * disk->block_size);
+
+  if(!opt.lookup.len || ext4_file_map(disk, sector * disk->block_size, &map)) return 0;
+
+  log_info("%*sfile map: %u files, %u extents", indent, "", map.files, map.extents);
+  if(map.groups_scanned < map.groups) {
+    log_info(" (partial map, %u of %u groups)", map.groups_scanned, map.groups);
+  }
+  log_info("\n");
+
+  json_object *json_map = json_object_new_object();
+  json_object_object_add(json_fs, "file_map", json_map);
+
+  json_object_object_add(json_map, "files", json_object_new_int64(map.files));
+  json_object_object_add(json_map, "extents", json_object_new_int64(map.extents));
+  json_object_object_add(json_map, "groups", json_object_new_int64(map.groups));
+  json_object_object_add(json_map, "groups_scanned", json_object_new_int64(map.groups_scanned));
+
   return 1;
 }
 
@@ -245,8 +589,9 @@ int fs_detail_iso9660(json_object *json_fs, disk_t *disk, int indent, uint64_t s
     uint64_t sig_block = media->signature.start;
     int sig_state = media->signature.state.id == sig_not_checked ? 1 : 0;
 
-    unsigned sig_size = -1u;
-    char *sig_file = iso_block_to_name(disk, sig_block, &sig_size);
+    uint64_t sig_size = UINT64_MAX;
+    char sig_name[ISO_NAME_SIZE];
+    char *sig_file = iso_block_to_name(disk, sig_block, &sig_size, sig_name, sizeof sig_name);
 
     log_info("%*ssignature: %"PRIu64" (%ssigned)", indent, "",
       sig_block,
@@ -262,7 +607,7 @@ int fs_detail_iso9660(json_object *json_fs, disk_t *disk, int indent, uint64_t s
 
     json_object_object_add(json_sig, "first_lba", json_object_new_int64(sig_block));
     if(sig_file) json_object_object_add(json_sig, "file_name", json_object_new_string(sig_file));
-    if(sig_size != -1u) json_object_object_add(json_sig, "file_size", json_object_new_int(sig_size));
+    if(sig_size != UINT64_MAX) json_object_object_add(json_sig, "file_size", json_object_new_int64((int64_t) sig_size));
     json_object_object_add(json_sig, "signed", json_object_new_boolean(sig_state));
   }
 
@@ -283,6 +628,7 @@ int fs_detail_iso9660(json_object *json_fs, disk_t *disk, int indent, uint64_t s
 int dump_fs(disk_t *disk, int indent, uint64_t sector)
 {
   char *s;
+  char file_name[ISO_NAME_SIZE];
   fs_detail_t fs_detail;
   int fs_ok = fs_probe(&fs_detail, disk, sector * disk->block_size);
 
@@ -312,13 +658,14 @@ int dump_fs(disk_t *disk, int indent, uint64_t sector)
     log_info(", uuid \"%s\"", fs_detail.uuid);
   }
 
-  if((s = iso_block_to_name(disk, (sector * disk->block_size) >> 9, NULL))) {
+  if((s = iso_block_to_name(disk, (sector * disk->block_size) >> 9, NULL, file_name, sizeof file_name))) {
     json_object_object_add(json_fs, "file_name", json_object_new_string(s));
     log_info(", \"%s\"", s);
   }
   log_info("\n");
 
-  fs_detail_fat(disk, indent, sector);
+  fs_detail_fat(json_fs, disk, indent, sector);
+  if(!strncmp(fs_detail.type, "ext", 3)) fs_detail_ext(json_fs, disk, indent, sector);
   if(!strcmp(fs_detail.type, "iso9660")) fs_detail_iso9660(json_fs, disk, indent, sector);
 
   return fs_ok;
@@ -326,44 +673,467 @@ int dump_fs(disk_t *disk, int indent, uint64_t sector)
 
 
 /*
- * block is in 512 byte units
+ * Find file containing block.
+ *
+ * block is in 512 byte units.
+ *
+ * Files in FAT and ext2/3/4 file systems found so far are looked up first
+ * (see fat_block_to_name() and ext4_block_to_name()), then files on the
+ * ISO9660 or UDF fs at disk start. If a file system is stored in an ISO
+ * file (like the El Torito EFI image), both names are joined with ':',
+ * e.g. 'efi.img:/EFI/BOOT/bootx64.efi'.
+ *
+ * The file name is stored in buf (of size buf_size). If block is not the
+ * first block of the file, the offset (in 512 byte units) is appended as
+ * '<+N>'.
+ *
+ * If len is not NULL, it is set to the file size in bytes.
+ *
+ * Returns buf, or NULL if there's no such file.
  */
-char *iso_block_to_name(disk_t *disk, unsigned block, unsigned *len)
+char *iso_block_to_name(disk_t *disk, uint64_t block, uint64_t *len, char *buf, unsigned buf_size)
 {
-  static char *buf = NULL;
-  file_start_t *fs;
-  char *name = NULL;
+  if(!iso_files_lookup(disk)->read) read_iso_detail(disk);
+
+  file_index_t *iso_files = &iso_files_lookup(disk)->files;
+
+  char *name = fat_block_to_name(disk, block, len, buf, buf_size);
 
-  if(!iso_read) read_iso_detail(disk);
+  if(!name) name = ext4_block_to_name(disk, block, len, buf, buf_size);
 
-  for(fs = iso_offsets; fs; fs = fs->next) {
-    if(block >= fs->block && block < fs->block + (((fs->len + 2047) >> 11) << 2)) break;
+  if(!name) return file_index_lookup(iso_files, block, len, buf, buf_size);
+
+  file_extent_t *file = file_index_find(iso_files, block);
+
+  if(file) {
+    char inner_name[strlen(name) + 1];
+
+    strcpy(inner_name, name);
+    snprintf(buf, buf_size, "%s:%s", iso_files->names + file->name, inner_name);
   }
 
-  if(fs) {
-    if(len) *len = fs->len;
-    if(block == fs->block) {
-      name = fs->name;
+  return name;
+}
+
+
+/*
+ * Register file on ISO9660 fs.
+ *
+ * block is in 512 byte units, len in bytes. The file occupies full 2 KiB
+ * blocks.
+ */
+void iso_add_file(disk_t *disk, uint64_t block, uint64_t len, const char *name)
+{
+  iso_add_extent(disk, block, (len + 2047) & ~2047ull, 0, len, name);
+}
+
+
+/*
+ * Register a part of a file on ISO9660 or UDF fs.
+ *
+ * See file_index_add().
+ *
+ * Lookups via iso_block_to_name() work only after read_iso_detail() is done.
+ */
+void iso_add_extent(disk_t *disk, uint64_t block, uint64_t size, uint64_t offset, uint64_t len, const char *name)
+{
+  file_index_add(&iso_files_lookup(disk)->files, block, size, offset, len, name);
+}
+
+
+/*
+ * Find ISO9660 and UDF files of disk.
+ *
+ * Adds an empty entry if there is none yet.
+ *
+ * The returned pointer is valid until the next call.
+ */
+static iso_files_t *iso_files_lookup(disk_t *disk)
+{
+  for(unsigned u = 0; u < iso_list.len; u++) {
+    if(iso_list.list[u].disk == disk->index) return iso_list.list + u;
+  }
+
+  iso_files_t *list = reallocarray(iso_list.list, iso_list.len + 1, sizeof *list);
+
+  if(!list) {
+    fprintf(stderr, "%s: out of memory\n", disk->name);
+    exit(1);
+  }
+
+  iso_list.list = list;
+  iso_list.list[iso_list.len] = (iso_files_t) { .disk = disk->index };
+
+  return iso_list.list + iso_list.len++;
+}
+
+
+/*
+ * Add file extent to index.
+ *
+ * The extent starts at block and is 'size' bytes long. It is located at
+ * 'offset' within the file. block and offset are in 512 byte units; len
+ * is the file size in bytes.
+ *
+ * Lookups via file_index_lookup() work only after file_index_sort().
+ *
+ * If there's not enough memory, the extent is dropped.
+ */
+void file_index_add(file_index_t *index, uint64_t block, uint64_t size, uint64_t offset, uint64_t len, const char *name)
+{
+  size_t name_size = strlen(name) + 1;
+  unsigned name_pos;
+
+  // empty extents never match a block
+  if(!size || index->mapped) return;
+
+  if(index->len == index->max) {
+    unsigned max = index->max ? 2 * index->max : 256;
+    file_extent_t *list = reallocarray(index->list, max, sizeof *list);
+    if(!list) return;
+    index->list = list;
+    index->max = max;
+  }
+
+  // extents of the same file share the name
+  if(index->len && !strcmp(index->names + index->list[index->len - 1].name, name)) {
+    name_pos = index->list[index->len - 1].name;
+  }
+  else {
+    if(index->names_len + name_size > index->names_max) {
+      size_t names_max = index->names_max ? 2 * index->names_max : 0x4000;
+      if(names_max < index->names_len + name_size) names_max = index->names_len + name_size;
+      char *names = realloc(index->names, names_max);
+      if(!names) return;
+      index->names = names;
+      index->names_max = names_max;
+    }
+
+    name_pos = index->names_len;
+    memcpy(index->names + index->names_len, name, name_size);
+    index->names_len += name_size;
+  }
+
+  file_extent_t *file = index->list + index->len;
+
+  file->block = block;
+  file->end = block + (size + 511) / 512;
+  file->offset = offset;
+  file->len = len;
+  file->seq = index->len++;
+  file->name = name_pos;
+}
+
+
+/*
+ * Sort by start block; for equal start, later registered files go last.
+ */
+static int file_index_cmp(const void *a, const void *b)
+{
+  const file_extent_t *fa = a, *fb = b;
+
+  if(fa->block != fb->block) return fa->block < fb->block ? -1 : 1;
+
+  return fa->seq < fb->seq ? -1 : fa->seq > fb->seq;
+}
+
+
+/*
+ * Sort index and set up max_end for file_index_lookup().
+ *
+ * If extents overlap, file_index_lookup() picks the file with the nearest
+ * start; among files with the same start, the last one registered.
+ */
+void file_index_sort(file_index_t *index)
+{
+  unsigned u;
+  uint64_t max_end = 0;
+
+  if(!index->len || index->mapped) return;
+
+  qsort(index->list, index->len, sizeof *index->list, file_index_cmp);
+
+  uint64_t *list = reallocarray(index->max_end, index->len, sizeof *list);
+
+  // without max_end no lookups are possible
+  if(!list) {
+    index->len = 0;
+    return;
+  }
+
+  index->max_end = list;
+
+  for(u = 0; u < index->len; u++) {
+    if(index->list[u].end > max_end) max_end = index->list[u].end;
+    index->max_end[u] = max_end;
+  }
+}
+
+
+/*
+ * Find file containing block in index.
+ *
+ * See iso_block_to_name() for the arguments.
+ */
+char *file_index_lookup(file_index_t *index, uint64_t block, uint64_t *len, char *buf, unsigned buf_size)
+{
+  file_extent_t *file = file_index_find(index, block);
+
+  if(!file || !buf_size) return NULL;
+
+  if(len) *len = file->len;
+
+  uint64_t offset = file->offset + block - file->block;
+
+  if(!offset) {
+    snprintf(buf, buf_size, "%s", index->names + file->name);
+  }
+  else {
+    snprintf(buf, buf_size, "%s<+%"PRIu64">", index->names + file->name, offset);
+  }
+
+  return buf;
+}
+
+
+/*
+ * Find file extent containing block.
+ *
+ * Return NULL if there's none.
+ */
+static file_extent_t *file_index_find(file_index_t *index, uint64_t block)
+{
+  file_extent_t *file = NULL;
+  unsigned lo, hi, mid;
+
+  // find the first file starting after block
+  for(lo = 0, hi = index->len; lo < hi;) {
+    mid = (lo + hi) / 2;
+    if(index->list[mid].block <= block) {
+      lo = mid + 1;
     }
     else {
-      free(buf);
-      asprintf(&buf, "%s<+%u>", fs->name, block - fs->block);
-      name = buf;
+      hi = mid;
+    }
+  }
+
+  // files before it are candidates until none of them reaches block anymore
+  while(lo-- > 0 && index->max_end[lo] > block) {
+    if(index->list[lo].end > block) {
+      file = index->list + lo;
+      break;
+    }
+  }
+
+  return file;
+}
+
+
+/*
+ * Calculate digest over ISO9660 volume descriptors.
+ *
+ * Any change to the fs will show up in the primary or supplementary volume
+ * descriptors (root directory, path table, volume size, time stamps). For
+ * UDF, the anchor and the main volume descriptor sequence are used. The
+ * file names depend on which tool reads the fs, so that is included, too.
+ *
+ * Return 0 if ok.
+ */
+static int iso_index_digest(disk_t *disk, uint64_t *digest)
+{
+  uint8_t vd[2048];
+  char *reader = opt.xorriso ? "xorriso" : opt.mkisofs ? "isoinfo" : "parti";
+
+  int err = 1;
+
+  *digest = fnv1a_hash(reader, strlen(reader), FNV1A_INIT);
+
+  for(unsigned u = 16; u < 16 + 64; u++) {
+    if((u + 1) * sizeof vd > disk->size_in_bytes) break;
+    if(disk_read_bytes(disk, vd, u * sizeof vd, sizeof vd)) break;
+    if(memcmp(vd + 1, "CD001", 5)) break;
+    *digest = fnv1a_hash(vd, sizeof vd, *digest);
+    // volume descriptor set terminator
+    if(vd[0] == 0xff) {
+      err = 0;
+      break;
     }
   }
 
+  if(!udf_digest(disk, digest)) err = 0;
+
+  return err;
+}
+
+
+/*
+ * Name of persistent ISO file index; must be freed.
+ */
+static char *iso_index_file(uint64_t digest)
+{
+  char *name = NULL;
+
+  if(asprintf(&name, "%s/iso-%016"PRIx64".index", opt.cache_dir, digest) == -1) name = NULL;
+
   return name;
 }
 
 
+/*
+ * Load ISO file index from persistent cache.
+ *
+ * The file is mapped and used as is.
+ *
+ * Return 1 if ok, else 0.
+ */
+static int iso_index_load(disk_t *disk, uint64_t digest)
+{
+  char *name = iso_index_file(digest);
+  int fd = name ? open(name, O_RDONLY | O_CLOEXEC) : -1;
+  struct stat sbuf;
+  iso_index_header_t *header;
+  uint8_t *map;
+  uint64_t files_size;
+  file_index_t *iso_files = &iso_files_lookup(disk)->files;
+
+  free(name);
+
+  if(fd == -1) return 0;
+
+  if(fstat(fd, &sbuf) || (uint64_t) sbuf.st_size < sizeof *header || (uint64_t) sbuf.st_size > SIZE_MAX) {
+    close(fd);
+    return 0;
+  }
+
+  map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if(map == MAP_FAILED) return 0;
+
+  header = (iso_index_header_t *) map;
+  files_size = (uint64_t) header->files * (sizeof (file_extent_t) + sizeof *iso_files->max_end);
+
+  int ok =
+    !memcmp(header->magic, ISO_INDEX_MAGIC, sizeof header->magic) &&
+    header->file_size == sizeof (file_extent_t) &&
+    header->size == disk->size_in_bytes &&
+    header->digest == digest &&
+    sizeof *header + files_size + header->names_len == (uint64_t) sbuf.st_size &&
+    (!header->names_len || !map[sbuf.st_size - 1]);
+
+  file_extent_t *list = (file_extent_t *) (map + sizeof *header);
+
+  for(unsigned u = 0; ok && u < header->files; u++) {
+    if(list[u].name >= header->names_len) ok = 0;
+  }
+
+  if(!ok) {
+    munmap(map, sbuf.st_size);
+    return 0;
+  }
+
+  iso_files->list = list;
+  iso_files->len = iso_files->max = header->files;
+  iso_files->max_end = (uint64_t *) (list + header->files);
+  iso_files->names = (char *) (iso_files->max_end + header->files);
+  iso_files->names_len = iso_files->names_max = header->names_len;
+  iso_files->mapped = 1;
+
+  return 1;
+}
+
+
+/*
+ * Write ISO file index to persistent cache.
+ *
+ * The file is replaced atomically.
+ */
+static void iso_index_save(disk_t *disk, uint64_t digest)
+{
+  char *name = iso_index_file(digest);
+  char *tmp_name = NULL;
+  file_index_t *iso_files = &iso_files_lookup(disk)->files;
+
+  if(!name || asprintf(&tmp_name, "%s.%d", name, (int) getpid()) == -1) {
+    free(name);
+    return;
+  }
+
+  mkdir(opt.cache_dir, 0700);
+
+  FILE *f = fopen(tmp_name, "w");
+
+  if(f) {
+    iso_index_header_t header = {
+      .magic = ISO_INDEX_MAGIC,
+      .size = disk->size_in_bytes,
+      .digest = digest,
+      .names_len = iso_files->names_len,
+      .files = iso_files->len,
+      .file_size = sizeof (file_extent_t)
+    };
+
+    int ok = fwrite(&header, sizeof header, 1, f) == 1;
+
+    if(ok && iso_files->len) {
+      ok =
+        fwrite(iso_files->list, sizeof *iso_files->list, iso_files->len, f) == iso_files->len &&
+        fwrite(iso_files->max_end, sizeof *iso_files->max_end, iso_files->len, f) == iso_files->len;
+    }
+
+    if(ok && iso_files->names_len) ok = fwrite(iso_files->names, iso_files->names_len, 1, f) == 1;
+
+    if(fclose(f)) ok = 0;
+
+    if(!ok || rename(tmp_name, name)) unlink(tmp_name);
+  }
+
+  free(tmp_name);
+  free(name);
+}
+
+
+/*
+ * Read ISO9660 and UDF file lists and set up lookups via iso_block_to_name().
+ *
+ * With opt.cache_dir, the result is kept there and used again in later
+ * runs as long as the volume descriptors have not changed.
+ */
 void read_iso_detail(disk_t *disk)
 {
+  uint64_t digest;
+  uint8_t vsd[6];
+
+  iso_files_lookup(disk)->read = 1;
+
+  // both start with a volume descriptor at 32 kiB: CD001 (ISO9660, UDF bridge) or BEA01 (UDF)
+  if(
+    disk->size_in_bytes < 0x8000 + sizeof vsd ||
+    disk_read_bytes(disk, vsd, 0x8000, sizeof vsd) ||
+    (memcmp(vsd + 1, "CD001", 5) && memcmp(vsd + 1, "BEA01", 5))
+  ) return;
+
+  int persistent = opt.cache_dir && !iso_index_digest(disk, &digest);
+
+  if(persistent && iso_index_load(disk, digest)) return;
+
+  // UDF first: for extents both trees describe, the ISO9660 names win
+  udf_read(disk);
+
   if(opt.xorriso) {
     read_xorriso(disk);
   }
-  else {
+  else if(opt.mkisofs) {
     read_isoinfo(disk);
   }
+  else {
+    iso9660_read(disk);
+  }
+
+  file_index_sort(&iso_files_lookup(disk)->files);
+
+  if(persistent) iso_index_save(disk, digest);
 }
 
 
@@ -373,10 +1143,9 @@ void read_isoinfo(disk_t *disk)
   char *cmd, *s, *t, *line = NULL, *dir = NULL;
   size_t line_len = 0;
   unsigned u1, u2;
-  file_start_t *fs;
   fs_detail_t fs_detail;
 
-  iso_read = 1;
+  iso_files_lookup(disk)->read = 1;
 
   if(!fs_probe(&fs_detail, disk, 0)) return;
 
@@ -386,7 +1155,7 @@ void read_isoinfo(disk_t *disk)
 
   int disk_fd = disk->fd;
 
-  if(disk_fd == -1) disk_fd = disk_to_fd(disk, 0);
+  if(disk_fd == -1) disk_fd = disk_memfd(disk, 0, disk->size_in_bytes);
 
   if(disk_fd == -1) return;
 
@@ -410,14 +1179,12 @@ void read_isoinfo(disk_t *disk)
           while(t >= s && isspace(*t)) *t-- = 0;
 
           if(strcmp(s, ".") && strcmp(s, "..")) {
-            fs = calloc(1, sizeof *fs);
-            fs->next = iso_offsets;
-            iso_offsets = fs;
-            fs->block = u1 << 2;
-            fs->len = u2;
-            asprintf(&fs->name, "%s%s", dir, s);
-            free(s);
+            asprintf(&t, "%s%s", dir, s);
+            iso_add_file(disk, u1 << 2, u2, t);
+            free(t);
           }
+
+          free(s);
         }
       }
     }
@@ -428,8 +1195,6 @@ void read_isoinfo(disk_t *disk)
   free(cmd);
   free(dir);
 
-  if(disk->fd == -1) close(disk_fd);
-
   FILE *f = fdopen(tmp_fd, "r+");
 
   // isoinfo reads 2 kiB blocks after each lseek
@@ -458,10 +1223,9 @@ void read_xorriso(disk_t *disk)
   char *cmd, *line = NULL, *dir = NULL;
   size_t line_len = 0;
   unsigned u1, u2;
-  file_start_t *fs;
   fs_detail_t fs_detail;
 
-  iso_read = 1;
+  iso_files_lookup(disk)->read = 1;
 
   if(!fs_probe(&fs_detail, disk, 0)) return;
 
@@ -471,7 +1235,7 @@ void read_xorriso(disk_t *disk)
 
   int disk_fd = disk->fd;
 
-  if(disk_fd == -1) disk_fd = disk_to_fd(disk, 0);
+  if(disk_fd == -1) disk_fd = disk_memfd(disk, 0, disk->size_in_bytes);
 
   if(disk_fd == -1) return;
 
@@ -482,14 +1246,10 @@ void read_xorriso(disk_t *disk)
       char *s, *line_start = line;
 
       if(sscanf(line_start, "File data lba: %*u , %u , %*u , %u , '%m[^\n]", &u1, &u2, &s) == 3) {
-        fs = calloc(1, sizeof *fs);
-        fs->next = iso_offsets;
-        iso_offsets = fs;
-        fs->block = u1 << 2;
-        fs->len = u2;
         size_t s_len = strlen(s);
         if(s_len > 0) s[s_len - 1] = 0;
-        fs->name = s;
+        iso_add_file(disk, u1 << 2, u2, s);
+        free(s);
       }
     }
 
@@ -499,8 +1259,6 @@ void read_xorriso(disk_t *disk)
   free(cmd);
   free(dir);
 
-  if(disk->fd == -1) close(disk_fd);
-
   FILE *f = fdopen(tmp_fd, "r+");
 
   // xorriso reads 64 kiB blocks after each lseek
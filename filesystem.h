@@ -1,2 +1,40 @@
+typedef struct {
+  char *type;
+  char *label;
+  char *uuid;
+} fs_detail_t;
+
+// a file extent; block, end, offset are in 512 byte units
+typedef struct {
+  uint64_t block;
+  uint64_t end;			// first block after the extent
+  uint64_t offset;		// extent offset within the file
+  uint64_t len;			// file size in bytes
+  unsigned seq;			// file_index_add() call order
+  unsigned name;		// offset into file_index_t.names
+} file_extent_t;
+
+// file extents, sorted by file_index_sort(); for block to file name lookups
+typedef struct {
+  file_extent_t *list;
+  unsigned len, max;
+  uint64_t *max_end;		// max_end[i]: largest end of list[0..i]
+  char *names;			// all file names, 0-terminated
+  size_t names_len, names_max;
+  unsigned mapped:1;		// loaded from persistent index, read-only
+} file_index_t;
+
+// buffer size for iso_block_to_name()
+#define ISO_NAME_SIZE	1024
+
+extern disk_range_t fs_read_plan[];
+
 int dump_fs(disk_t *disk, int indent, uint64_t sector);
-char *iso_block_to_name(disk_t *disk, unsigned block, unsigned *len);
+void fs_show_probes(disk_t *disk);
+void fs_show_lookups(disk_t *disk);
+char *iso_block_to_name(disk_t *disk, uint64_t block, uint64_t *len, char *buf, unsigned buf_size);
+void iso_add_file(disk_t *disk, uint64_t block, uint64_t len, const char *name);
+void iso_add_extent(disk_t *disk, uint64_t block, uint64_t size, uint64_t offset, uint64_t len, const char *name);
+void file_index_add(file_index_t *index, uint64_t block, uint64_t size, uint64_t offset, uint64_t len, const char *name);
+void file_index_sort(file_index_t *index);
+char *file_index_lookup(file_index_t *index, uint64_t block, uint64_t *len, char *buf, unsigned buf_size);
@@ -0,0 +1,703 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <json-c/json.h>
+
+#include "disk.h"
+#include "filesystem.h"
+#include "fs_native.h"
+#include "util.h"
+
+// detection result of a single file system type
+#define FS_NATIVE_NO		0	// not this file system
+#define FS_NATIVE_YES		1	// file system found, details set
+#define FS_NATIVE_UNSURE	-1	// leave it to blkid
+
+// ext2/3/4 feature bits, as used by blkid to tell the variants apart
+#define EXT3_COMPAT_HAS_JOURNAL		0x0004
+#define EXT2_RO_COMPAT_SUPP		0x0007	// sparse_super | large_file | btree_dir
+#define EXT4_RO_COMPAT_METADATA_CSUM	0x0400
+#define EXT2_INCOMPAT_SUPP		0x0012	// filetype | meta_bg
+#define EXT3_INCOMPAT_SUPP		0x0016	// filetype | recover | meta_bg
+#define EXT3_INCOMPAT_JOURNAL_DEV	0x0008
+#define EXT2_FLAGS_TEST_FILESYS		0x0004
+
+#define FAT12_MAX	0xff4
+#define FAT16_MAX	0xfff4
+#define FAT32_MAX	0x0ffffff6
+
+typedef struct fs_magic_s fs_magic_t;
+
+struct fs_magic_s {
+  char *type;			// file system (group) name
+  unsigned offset;		// magic position in bytes, relative to file system start
+  unsigned len;			// magic length
+  char *magic;
+  unsigned page_end:1;		// offset is relative to the end of a memory page (swap)
+  int (*probe)(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag);	// NULL: leave it to blkid
+};
+
+static int fs_native_read(disk_t *disk, uint64_t pos, void *buf, unsigned len);
+static char *fs_native_label(void *buf, unsigned len);
+static char *fs_native_uuid(void *buf);
+static int fs_native_is_zero(void *buf, unsigned len);
+static uint32_t fs_native_crc32c(uint32_t crc, void *buf, unsigned len);
+static int fs_probe_ext(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag);
+static int fs_probe_xfs(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag);
+static int fs_probe_btrfs(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag);
+static int fs_probe_swap(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag);
+static int fs_probe_lvm2(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag);
+static int fs_probe_vfat(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag);
+static unsigned char *fs_vfat_label(disk_t *disk, uint64_t pos, unsigned entries, unsigned char *label);
+static int fs_probe_iso9660(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag);
+static int fs_iso9660_uuid(fs_detail_t *fs, uint8_t *date);
+
+/*
+ * Signatures we check, grouped by file system.
+ *
+ * As with blkid, only the first matching magic of a group is passed on to
+ * its probe function. Groups without probe function are file systems blkid
+ * knows better than us - finding one of them means blkid has to decide.
+ */
+static fs_magic_t fs_magics[] = {
+  { "ext",         0x438,   2, "\x53\xef",  .probe = fs_probe_ext },
+  { "xfs",         0,       4, "XFSB",      .probe = fs_probe_xfs },
+  { "btrfs",       0x10040, 8, "_BHRfS_M",  .probe = fs_probe_btrfs },
+  { "swap",        10,     10, "SWAP-SPACE", .page_end = 1, .probe = fs_probe_swap },
+  { "swap",        10,     10, "SWAPSPACE2", .page_end = 1, .probe = fs_probe_swap },
+  { "LVM2_member", 0x218,   8, "LVM2 001",  .probe = fs_probe_lvm2 },
+  { "LVM2_member", 0x018,   8, "LVM2 001",  .probe = fs_probe_lvm2 },
+  { "LVM2_member", 0x418,   8, "LVM2 001",  .probe = fs_probe_lvm2 },
+  { "LVM2_member", 0x618,   8, "LVM2 001",  .probe = fs_probe_lvm2 },
+  { "vfat",        0x52,    5, "MSWIN",     .probe = fs_probe_vfat },
+  { "vfat",        0x52,    8, "FAT32   ",  .probe = fs_probe_vfat },
+  { "vfat",        0x36,    5, "MSDOS",     .probe = fs_probe_vfat },
+  { "vfat",        0x36,    8, "FAT16   ",  .probe = fs_probe_vfat },
+  { "vfat",        0x36,    8, "FAT12   ",  .probe = fs_probe_vfat },
+  { "vfat",        0x36,    8, "FAT     ",  .probe = fs_probe_vfat },
+  { "vfat",        0,       1, "\xeb",      .probe = fs_probe_vfat },
+  { "vfat",        0,       1, "\xe9",      .probe = fs_probe_vfat },
+  { "vfat",        0x1fe,   2, "\x55\xaa",  .probe = fs_probe_vfat },
+  { "iso9660",     0x8001,  5, "CD001",     .probe = fs_probe_iso9660 },
+  // blkid's business
+  { "swsuspend",   10,     10, "S1SUSPEND", .page_end = 1 },
+  { "swsuspend",   10,     10, "S2SUSPEND", .page_end = 1 },
+  { "swsuspend",   10,     10, "ULSUSPEND", .page_end = 1 },
+  { "swsuspend",   10,     10, "LINHIB0001", .page_end = 1 },
+  { "swsuspend",   10,      8, "\xed\xc3\x02\xe9\x98\x56\xe5\x0c", .page_end = 1 },
+  { "crypto_LUKS", 0,       6, "LUKS\xba\xbe" },
+  { "crypto_LUKS", 0,       6, "SKUL\xba\xbe" },
+  { "linux_raid",  0,       4, "\xfc\x4e\x2b\xa9" },
+  { "linux_raid",  0x1000,  4, "\xfc\x4e\x2b\xa9" },
+  { "bcache",      0x1018, 16, "\xc6\x85\x73\xf6\x4e\x1a\x45\xca\x82\x65\xf5\x7f\x48\xba\x6d\x81" },
+  { "BitLocker",   3,       8, "-FVE-FS-" },
+  { "ntfs",        3,       8, "NTFS    " },
+  { "exfat",       3,       8, "EXFAT   " },
+  { "hfs",         0x400,   2, "BD" },
+  { "hfsplus",     0x400,   2, "H+" },
+  { "hfsplus",     0x400,   2, "HX" },
+  { "squashfs",    0,       4, "hsqs" },
+  { "f2fs",        0x400,   4, "\x10\x20\xf5\xf2" },
+  { "jfs",         0x8000,  4, "JFS1" },
+  { "reiserfs",    0x10034, 6, "ReIsEr" },
+  { "udf",         0x8001,  5, "BEA01" },
+  { }
+};
+
+// memory page sizes swap signatures may be based on
+static unsigned fs_page_sizes[] = { 4 << 10, 8 << 10, 16 << 10, 32 << 10, 64 << 10 };
+
+
+/*
+ * Identify file system at byte offset 'start' without the help of blkid.
+ *
+ * Only the few sectors each signature needs are read, via the disk cache.
+ *
+ * Return 1 if exactly one of the file systems we know was found; 'fs' is
+ * set then and its strings are malloc'ed. Return 0 if nothing or more than
+ * one file system was found, or if one we don't handle turned up: blkid
+ * has to sort it out.
+ */
+int fs_native_probe(fs_detail_t *fs, disk_t *disk, uint64_t start)
+{
+  fs_detail_t fs_found = {}, fs_tmp;
+  char *group = NULL;
+  int result = 0, found = 0;
+
+  *fs = (fs_detail_t) {};
+
+  for(fs_magic_t *mag = fs_magics; mag->type && result >= 0; mag++) {
+    // first matching magic of a group decides
+    if(group && !strcmp(group, mag->type)) continue;
+
+    unsigned pages = mag->page_end ? sizeof fs_page_sizes / sizeof *fs_page_sizes : 1;
+
+    for(unsigned u = 0; u < pages; u++) {
+      unsigned offset = mag->page_end ? fs_page_sizes[u] - mag->offset : mag->offset;
+      uint8_t buf[mag->len];
+
+      if(!fs_native_read(disk, start + offset, buf, mag->len)) continue;
+      if(memcmp(buf, mag->magic, mag->len)) continue;
+
+      group = mag->type;
+
+      if(!mag->probe) {
+        result = FS_NATIVE_UNSURE;
+        break;
+      }
+
+      fs_magic_t page_mag = *mag;
+      page_mag.offset = offset;
+
+      fs_tmp = (fs_detail_t) {};
+      result = mag->probe(&fs_tmp, disk, start, &page_mag);
+
+      if(result == FS_NATIVE_YES) {
+        if(found++) {
+          result = FS_NATIVE_UNSURE;
+          free(fs_tmp.type);
+          free(fs_tmp.label);
+          free(fs_tmp.uuid);
+        }
+        else {
+          fs_found = fs_tmp;
+        }
+      }
+
+      break;
+    }
+  }
+
+  if(result < 0 || found != 1) {
+    free(fs_found.type);
+    free(fs_found.label);
+    free(fs_found.uuid);
+
+    return 0;
+  }
+
+  *fs = fs_found;
+
+  return 1;
+}
+
+
+/*
+ * Read 'len' bytes at byte position 'pos' via the disk cache.
+ *
+ * Return 1 if ok, else 0.
+ */
+static int fs_native_read(disk_t *disk, uint64_t pos, void *buf, unsigned len)
+{
+  if(pos + len > disk->size_in_bytes) return 0;
+
+  disk->stats.fs_probe_bytes += len;
+
+  return disk_read_bytes(disk, buf, pos, len) ? 0 : 1;
+}
+
+
+/*
+ * Turn label into string the way blkid does.
+ *
+ * The label ends at the first 0 or at 'len' bytes; trailing spaces are
+ * removed. Return NULL if nothing is left.
+ */
+static char *fs_native_label(void *buf, unsigned len)
+{
+  char *label = strndup(buf, len);
+  unsigned u = strlen(label);
+
+  while(u && isspace(label[u - 1])) u--;
+  label[u] = 0;
+
+  if(!*label) {
+    free(label);
+    label = NULL;
+  }
+
+  return label;
+}
+
+
+/*
+ * Format 16 byte uuid.
+ *
+ * Return NULL if it's all zeros.
+ */
+static char *fs_native_uuid(void *buf)
+{
+  uint8_t *u = buf;
+  char *uuid = NULL;
+
+  if(fs_native_is_zero(buf, 16)) return NULL;
+
+  asprintf(&uuid,
+    "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+    u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+    u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]
+  );
+
+  return uuid;
+}
+
+
+/*
+ * Return 1 if buffer contains only zeros.
+ */
+static int fs_native_is_zero(void *buf, unsigned len)
+{
+  uint8_t *data = buf;
+
+  for(unsigned u = 0; u < len; u++) {
+    if(data[u]) return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * CRC32c (Castagnoli), without pre- and post-inversion.
+ */
+static uint32_t fs_native_crc32c(uint32_t crc, void *buf, unsigned len)
+{
+  static uint32_t crc_table[256];
+  uint8_t *data = buf;
+
+  if(!crc_table[1]) {
+    for(unsigned u = 0; u < 256; u++) {
+      uint32_t c = u;
+      for(int i = 0; i < 8; i++) {
+        c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+      }
+      crc_table[u] = c;
+    }
+  }
+
+  for(unsigned u = 0; u < len; u++) {
+    crc = (crc >> 8) ^ crc_table[(crc ^ data[u]) & 0xff];
+  }
+
+  return crc;
+}
+
+
+/*
+ * ext2, ext3, ext4.
+ *
+ * Journal devices and test file systems (ext4dev) are left to blkid, as
+ * are feature combinations that fit none of the three. So are superblocks
+ * with checksum errors: blkid versions differ in how they treat them.
+ */
+static int fs_probe_ext(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag)
+{
+  uint8_t sb[0x400];
+
+  if(!fs_native_read(disk, start + 0x400, sb, sizeof sb)) return FS_NATIVE_NO;
+
+  unsigned compat = read_dword_le(sb + 0x5c);
+  unsigned incompat = read_dword_le(sb + 0x60);
+  unsigned ro_compat = read_dword_le(sb + 0x64);
+
+  if(
+    (ro_compat & EXT4_RO_COMPAT_METADATA_CSUM) &&
+    fs_native_crc32c(~0u, sb, 0x3fc) != read_dword_le(sb + 0x3fc)
+  ) return FS_NATIVE_UNSURE;
+
+  if(incompat & EXT3_INCOMPAT_JOURNAL_DEV) return FS_NATIVE_UNSURE;
+  if(read_dword_le(sb + 0x160) & EXT2_FLAGS_TEST_FILESYS) return FS_NATIVE_UNSURE;
+
+  int ext2_ok = !(ro_compat & ~EXT2_RO_COMPAT_SUPP) && !(incompat & ~EXT2_INCOMPAT_SUPP);
+  int ext3_ok = !(ro_compat & ~EXT2_RO_COMPAT_SUPP) && !(incompat & ~EXT3_INCOMPAT_SUPP);
+
+  if(compat & EXT3_COMPAT_HAS_JOURNAL) {
+    fs->type = strdup(ext3_ok ? "ext3" : "ext4");
+  }
+  else if(ext2_ok) {
+    fs->type = strdup("ext2");
+  }
+  else if(!ext3_ok) {
+    fs->type = strdup("ext4");
+  }
+  else {
+    return FS_NATIVE_UNSURE;
+  }
+
+  fs->label = fs_native_label(sb + 0x78, 16);
+  fs->uuid = fs_native_uuid(sb + 0x68);
+
+  return FS_NATIVE_YES;
+}
+
+
+/*
+ * xfs.
+ *
+ * The superblock sanity checks are those blkid does. Checksum errors are
+ * left to blkid, as with ext4.
+ */
+static int fs_probe_xfs(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag)
+{
+  uint8_t sb[0x200];
+
+  if(!fs_native_read(disk, start, sb, sizeof sb)) return FS_NATIVE_NO;
+
+  unsigned block_size = read_dword_be(sb + 4);
+  uint64_t dblocks = read_qword_be(sb + 8);
+  unsigned rextsize = read_dword_be(sb + 80);
+  unsigned agblocks = read_dword_be(sb + 84);
+  unsigned agcount = read_dword_be(sb + 88);
+  unsigned version = read_word_be(sb + 100);
+  unsigned sect_size = read_word_be(sb + 102);
+  unsigned inode_size = read_word_be(sb + 104);
+  unsigned block_log = sb[120];
+  unsigned sect_log = sb[121];
+  unsigned inode_log = sb[122];
+  unsigned inopb_log = sb[123];
+  unsigned imax_pct = sb[127];
+
+  if(
+    agcount == 0 ||
+    sect_size < 512 || sect_size > 32768 ||
+    sect_log < 9 || sect_log > 15 ||
+    sect_size != 1u << sect_log ||
+    block_size < 512 || block_size > 65536 ||
+    block_log < 9 || block_log > 16 ||
+    block_size != 1u << block_log ||
+    inode_size < 256 || inode_size > 2048 ||
+    inode_log < 8 || inode_log > 11 ||
+    inode_size != 1u << inode_log ||
+    block_log - inode_log != inopb_log ||
+    (uint64_t) rextsize * block_size > 1 << 30 ||
+    (uint64_t) rextsize * block_size < 4096 ||
+    imax_pct > 100 ||
+    dblocks == 0 ||
+    dblocks > (uint64_t) agcount * agblocks ||
+    dblocks < (uint64_t) (agcount - 1) * agblocks + 64
+  ) return FS_NATIVE_NO;
+
+  // v5 superblocks have a checksum
+  if((version & 0xf) == 5) {
+    uint8_t buf[sect_size];
+    static uint8_t zero[4];
+
+    if(!fs_native_read(disk, start, buf, sect_size)) return FS_NATIVE_NO;
+
+    uint32_t crc = fs_native_crc32c(~0u, buf, 224);
+    crc = fs_native_crc32c(crc, zero, sizeof zero);
+    crc = fs_native_crc32c(crc, buf + 228, sect_size - 228);
+
+    if(~crc != read_dword_le(buf + 224)) return FS_NATIVE_UNSURE;
+  }
+
+  fs->type = strdup("xfs");
+  fs->label = fs_native_label(sb + 108, 12);
+  fs->uuid = fs_native_uuid(sb + 32);
+
+  return FS_NATIVE_YES;
+}
+
+
+/*
+ * btrfs.
+ */
+static int fs_probe_btrfs(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag)
+{
+  uint8_t sb[0x200];
+
+  if(!fs_native_read(disk, start + 0x10000, sb, sizeof sb)) return FS_NATIVE_NO;
+
+  fs->type = strdup("btrfs");
+  fs->label = fs_native_label(sb + 0x12b, 0x100);
+  fs->uuid = fs_native_uuid(sb + 0x20);
+
+  return FS_NATIVE_YES;
+}
+
+
+/*
+ * Linux swap space.
+ *
+ * Version 0 has neither label nor uuid. The version 1 header sits at 1 KiB
+ * regardless of page size.
+ */
+static int fs_probe_swap(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag)
+{
+  uint8_t hdr[0x200];
+
+  if(!strcmp(mag->magic, "SWAP-SPACE")) {
+    fs->type = strdup("swap");
+
+    return FS_NATIVE_YES;
+  }
+
+  if(!fs_native_read(disk, start + 0x400, hdr, sizeof hdr)) return FS_NATIVE_NO;
+
+  unsigned version = read_dword_le(hdr);
+
+  if(version != 1 && version != 0x01000000) return FS_NATIVE_UNSURE;
+  if(read_dword_le(hdr + 4) == 0) return FS_NATIVE_UNSURE;
+
+  fs->type = strdup("swap");
+
+  // blkid ignores label and uuid if the padding isn't empty
+  if(!read_dword_le(hdr + 44 + 32 * 4) && !read_dword_le(hdr + 44 + 33 * 4)) {
+    fs->label = fs_native_label(hdr + 28, 16);
+    fs->uuid = fs_native_uuid(hdr + 12);
+  }
+
+  return FS_NATIVE_YES;
+}
+
+
+/*
+ * LVM2 physical volume.
+ *
+ * The label header must point to the sector it's in and pass the crc check.
+ */
+static int fs_probe_lvm2(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag)
+{
+  uint8_t label[0x200];
+  unsigned sector = mag->offset / 0x200;
+
+  if(!fs_native_read(disk, start + sector * 0x200, label, sizeof label)) return FS_NATIVE_NO;
+
+  if(memcmp(label, "LABELONE", 8)) return FS_NATIVE_NO;
+  if(read_qword_le(label + 8) != sector) return FS_NATIVE_NO;
+
+  // LVM's own crc32 variant, computed by nibbles
+  static const uint32_t crctab[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+  };
+  uint32_t crc = 0xf597a6cf;
+
+  for(unsigned u = 0x14; u < sizeof label; u++) {
+    crc ^= label[u];
+    crc = (crc >> 4) ^ crctab[crc & 0xf];
+    crc = (crc >> 4) ^ crctab[crc & 0xf];
+  }
+
+  if(crc != read_dword_le(label + 0x10)) return FS_NATIVE_NO;
+
+  char *id = (char *) label + 0x20;
+
+  fs->type = strdup("LVM2_member");
+  asprintf(&fs->uuid, "%.6s-%.4s-%.4s-%.4s-%.4s-%.4s-%.6s", id, id + 6, id + 10, id + 14, id + 18, id + 22, id + 26);
+
+  return FS_NATIVE_YES;
+}
+
+
+/*
+ * FAT12, FAT16, FAT32.
+ *
+ * As with blkid, the label comes from the volume entry in the root
+ * directory. The label in the boot sector is not used.
+ */
+static int fs_probe_vfat(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag)
+{
+  uint8_t bs[0x200];
+  unsigned char label_buf[11], *label = NULL;
+  uint8_t *serial;
+
+  if(!fs_native_read(disk, start, bs, sizeof bs)) return FS_NATIVE_NO;
+
+  // jump instruction only: require a boot signature and rule out JFS & HPFS
+  if(mag->len <= 2) {
+    if(bs[0x1fe] != 0x55 || bs[0x1ff] != 0xaa) return FS_NATIVE_NO;
+    if(!memcmp(bs + 0x36, "JFS     ", 8) || !memcmp(bs + 0x36, "HPFS    ", 8)) return FS_NATIVE_NO;
+  }
+
+  unsigned sector_size = read_word_le(bs + 11);
+  unsigned cluster_size = bs[13];
+  unsigned reserved = read_word_le(bs + 14);
+  unsigned fats = bs[16];
+  unsigned dir_entries = read_word_le(bs + 17);
+  uint32_t sectors = read_word_le(bs + 19) ?: read_dword_le(bs + 32);
+  unsigned media = bs[21];
+  uint32_t fat_length = read_word_le(bs + 22);
+  uint32_t fat32_length = read_dword_le(bs + 36);
+
+  if(
+    !fats ||
+    !reserved ||
+    !(media >= 0xf8 || media == 0xf0) ||
+    !cluster_size || (cluster_size & (cluster_size - 1)) ||
+    sector_size < 512 || sector_size > 4096 || (sector_size & (sector_size - 1))
+  ) return FS_NATIVE_NO;
+
+  uint32_t fat_size = (fat_length ?: fat32_length) * fats;
+  uint32_t dir_size = (dir_entries * 32 + sector_size - 1) / sector_size;
+  uint32_t clusters = (sectors - (reserved + fat_size + dir_size)) / cluster_size;
+  uint32_t max_clusters = !fat_length && fat32_length ? FAT32_MAX : clusters > FAT12_MAX ? FAT16_MAX : FAT12_MAX;
+
+  if(clusters > max_clusters) return FS_NATIVE_NO;
+
+  if(fat_length) {
+    label = fs_vfat_label(disk, start + (uint64_t) (reserved + fat_size) * sector_size, dir_entries, label_buf);
+    serial = bs + 39;
+  }
+  else if(fat32_length) {
+    uint32_t entries = ((uint64_t) fat32_length * sector_size) / 4;
+    uint32_t next = read_dword_le(bs + 44);
+    int max_loop = 100;
+
+    while(next && next < entries && --max_loop) {
+      uint64_t pos = (uint64_t) (reserved + fat_size + (next - 2) * cluster_size) * sector_size;
+
+      label = fs_vfat_label(disk, start + pos, cluster_size * sector_size / 32, label_buf);
+      if(label) break;
+
+      uint8_t fat_entry[4];
+      if(!fs_native_read(disk, start + (uint64_t) reserved * sector_size + next * 4, fat_entry, 4)) break;
+      next = read_dword_le(fat_entry) & 0x0fffffff;
+    }
+
+    serial = bs + 67;
+
+    // blkid insists on a valid or empty fsinfo block
+    unsigned fsinfo_sector = read_word_le(bs + 48);
+
+    if(fsinfo_sector) {
+      uint8_t fsinfo[0x200];
+
+      if(!fs_native_read(disk, start + (uint64_t) fsinfo_sector * sector_size, fsinfo, sizeof fsinfo)) return FS_NATIVE_UNSURE;
+      if(
+        memcmp(fsinfo, "RRaA", 4) && memcmp(fsinfo, "RRdA", 4) && !fs_native_is_zero(fsinfo, 4)
+      ) return FS_NATIVE_UNSURE;
+      if(
+        memcmp(fsinfo + 0x1e4, "rrAa", 4) && !fs_native_is_zero(fsinfo + 0x1e4, 4)
+      ) return FS_NATIVE_UNSURE;
+    }
+  }
+  else {
+    return FS_NATIVE_UNSURE;
+  }
+
+  fs->type = strdup("vfat");
+  if(label) fs->label = fs_native_label(label, 11);
+  if(!fs_native_is_zero(serial, 4)) {
+    asprintf(&fs->uuid, "%02X%02X-%02X%02X", serial[3], serial[2], serial[1], serial[0]);
+  }
+
+  return FS_NATIVE_YES;
+}
+
+
+/*
+ * Search fat directory at byte position 'pos' for a volume label.
+ *
+ * The label is copied to 'label' (11 bytes). Return 'label' if found, else NULL.
+ */
+static unsigned char *fs_vfat_label(disk_t *disk, uint64_t pos, unsigned entries, unsigned char *label)
+{
+  unsigned char *dir = malloc(entries * 32 + 1), *entry;
+
+  if(entries && !fs_native_read(disk, pos, dir, entries * 32)) entries = 0;
+
+  for(unsigned u = 0; u < entries; u++) {
+    entry = dir + u * 32;
+
+    if(entry[0] == 0) break;
+
+    // skip deleted entries, regular files, long name parts
+    if(
+      entry[0] == 0xe5 ||
+      read_word_le(entry + 20) || read_word_le(entry + 26) ||
+      (entry[11] & 0x3f) == 0x0f
+    ) continue;
+
+    if((entry[11] & 0x18) == 0x08) {
+      memcpy(label, entry, 11);
+      if(label[0] == 0x05) label[0] = 0xe5;
+      free(dir);
+
+      return label;
+    }
+  }
+
+  free(dir);
+
+  return NULL;
+}
+
+
+/*
+ * ISO 9660.
+ *
+ * Images with Joliet or UDF volume descriptors are left to blkid.
+ */
+static int fs_probe_iso9660(fs_detail_t *fs, disk_t *disk, uint64_t start, fs_magic_t *mag)
+{
+  uint8_t vd[0x800], pvd[0x800];
+  int pvd_ok = 0;
+  unsigned u;
+
+  for(u = 0; u < 64; u++) {
+    if(!fs_native_read(disk, start + 0x8000 + u * 0x800, vd, sizeof vd)) return FS_NATIVE_UNSURE;
+
+    // volume descriptor set terminator
+    if(vd[0] == 0xff) break;
+
+    if(vd[0] == 1 && !pvd_ok) {
+      memcpy(pvd, vd, sizeof pvd);
+      pvd_ok = 1;
+    }
+
+    // Joliet
+    if(
+      vd[0] == 2 &&
+      (!memcmp(vd + 88, "%/@", 3) || !memcmp(vd + 88, "%/C", 3) || !memcmp(vd + 88, "%/E", 3))
+    ) return FS_NATIVE_UNSURE;
+  }
+
+  if(!pvd_ok) return FS_NATIVE_NO;
+
+  if(read_word_le(pvd + 128) != 0x800) return FS_NATIVE_UNSURE;
+
+  // UDF volume recognition sequence follows the terminator
+  for(unsigned v = u + 1; v < u + 4; v++) {
+    if(!fs_native_read(disk, start + 0x8000 + v * 0x800, vd, 8)) break;
+    if(!memcmp(vd + 1, "BEA01", 5) || !memcmp(vd + 1, "NSR0", 4)) return FS_NATIVE_UNSURE;
+  }
+
+  fs->type = strdup("iso9660");
+  fs->label = fs_native_label(pvd + 40, 32);
+
+  // uuid from modification date, else creation date
+  if(!fs_iso9660_uuid(fs, pvd + 830)) fs_iso9660_uuid(fs, pvd + 813);
+
+  return FS_NATIVE_YES;
+}
+
+
+/*
+ * Build uuid from ISO 9660 date.
+ *
+ * Return 0 if the date is unset.
+ */
+static int fs_iso9660_uuid(fs_detail_t *fs, uint8_t *date)
+{
+  unsigned zeros = 0;
+
+  for(unsigned u = 0; u < 16; u++) zeros += date[u] == '0';
+
+  if(zeros == 16 && date[16] == 0) return 0;
+
+  if(!fs_native_is_zero(date, 16)) {
+    char *d = (char *) date;
+
+    asprintf(&fs->uuid, "%.4s-%.2s-%.2s-%.2s-%.2s-%.2s-%.2s", d, d + 4, d + 6, d + 8, d + 10, d + 12, d + 14);
+  }
+
+  return 1;
+}
@@ -0,0 +1 @@
+int fs_native_probe(fs_detail_t *fs, disk_t *disk, uint64_t start);
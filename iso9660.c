@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <json-c/json.h>
+
+#include "disk.h"
+#include "filesystem.h"
+#include "iso9660.h"
+#include "util.h"
+
+#define ISO_BLOCK_SIZE		2048
+#define ISO_VD_START		16		// first volume descriptor block
+#define ISO_VD_MAX		64		// volume descriptors to look at, at most
+#define ISO_MAX_DIRS		(1 << 20)	// directories to walk, at most
+#define ISO_MAX_CE		16		// Rock Ridge continuation areas per record, at most
+
+typedef struct {
+  disk_t *disk;
+  uint32_t blocks;		// volume size in blocks
+  unsigned susp_skip;		// bytes to skip in system use areas (from SP entry)
+  unsigned joliet:1;		// names are UCS-2
+  unsigned rock_ridge:1;	// look for Rock Ridge names
+} iso_t;
+
+typedef struct {
+  uint32_t extent;
+  uint32_t size;		// 0 = read it from the '.' entry
+  unsigned parent;		// index of parent directory
+  char *name;			// full path, with trailing '/'
+} iso_dir_t;
+
+typedef struct {
+  iso_dir_t *list;
+  unsigned len, max;
+  unsigned *by_extent;		// list indices, sorted by extent (path table walk only)
+} iso_dirs_t;
+
+static int iso_read_bytes(iso_t *iso, uint64_t pos, void *buf, unsigned len);
+static int iso_path_table(iso_t *iso, uint8_t *vd, iso_dirs_t *dirs);
+static int iso_cmp_extent(const void *a, const void *b, void *dirs);
+static iso_dir_t *iso_find_dir(iso_dirs_t *dirs, uint32_t extent);
+static int iso_add_dir(iso_dirs_t *dirs, uint32_t extent, uint32_t size, unsigned parent, char *name);
+static void iso_walk_dir(iso_t *iso, iso_dirs_t *dirs, unsigned idx, int use_path_table);
+static int iso_is_ancestor(iso_dirs_t *dirs, unsigned idx, uint32_t extent);
+static char *iso_name(iso_t *iso, uint8_t *rec);
+static char *iso_rr_name(iso_t *iso, uint8_t *rec);
+
+
+/*
+ * Read ISO9660 directory tree and register all files via iso_add_file().
+ *
+ * The fs is expected at the start of the disk. File names are taken from
+ * Rock Ridge entries if there are any, else from the Joliet tree, else
+ * the plain ISO9660 names (without version suffix) are used.
+ *
+ * Directories are taken from the path table, so there's no need to
+ * descend recursively into the tree. If the path table is not usable, the
+ * tree is walked breadth-first.
+ *
+ * All data are read via the disk cache.
+ */
+void iso9660_read(disk_t *disk)
+{
+  iso_t iso = { .disk = disk };
+  uint8_t vd[ISO_BLOCK_SIZE], pvd[ISO_BLOCK_SIZE], svd[ISO_BLOCK_SIZE];
+  int pvd_ok = 0, svd_ok = 0;
+
+  for(unsigned u = ISO_VD_START; u < ISO_VD_START + ISO_VD_MAX; u++) {
+    if(iso_read_bytes(&iso, (uint64_t) u * ISO_BLOCK_SIZE, vd, sizeof vd)) return;
+
+    if(memcmp(vd + 1, "CD001", 5) || vd[0] == 0xff) break;
+
+    if(vd[0] == 1 && !pvd_ok) {
+      memcpy(pvd, vd, sizeof pvd);
+      pvd_ok = 1;
+    }
+
+    if(
+      vd[0] == 2 && !svd_ok &&
+      vd[88] == '%' && vd[89] == '/' && (vd[90] == '@' || vd[90] == 'C' || vd[90] == 'E')
+    ) {
+      memcpy(svd, vd, sizeof svd);
+      svd_ok = 1;
+    }
+  }
+
+  if(!pvd_ok || read_word_le(pvd + 128) != ISO_BLOCK_SIZE) return;
+
+  iso.blocks = read_dword_le(pvd + 80);
+
+  // Rock Ridge: look for SUSP 'SP' entry in '.' of the root directory
+  uint8_t *root = pvd + 156;
+  uint8_t dot[ISO_BLOCK_SIZE];
+
+  if(!iso_read_bytes(&iso, (uint64_t) read_dword_le(root + 2) * ISO_BLOCK_SIZE, dot, sizeof dot)) {
+    unsigned rec_len = dot[0];
+    unsigned su = 33 + dot[32] + !(dot[32] & 1);
+
+    if(
+      rec_len >= su + 7 && rec_len <= sizeof dot &&
+      !memcmp(dot + su, "SP", 2) && dot[su + 4] == 0xbe && dot[su + 5] == 0xef
+    ) {
+      iso.rock_ridge = 1;
+      iso.susp_skip = dot[su + 6];
+    }
+  }
+
+  uint8_t *vd_used = pvd;
+
+  if(!iso.rock_ridge && svd_ok) {
+    vd_used = svd;
+    iso.joliet = 1;
+  }
+
+  iso_dirs_t dirs = {};
+
+  int use_path_table = iso_path_table(&iso, vd_used, &dirs);
+
+  if(!use_path_table) {
+    root = vd_used + 156;
+    iso_add_dir(&dirs, read_dword_le(root + 2), read_dword_le(root + 10), 0, strdup("/"));
+  }
+
+  for(unsigned u = 0; u < dirs.len && u < ISO_MAX_DIRS; u++) {
+    iso_walk_dir(&iso, &dirs, u, use_path_table);
+  }
+
+  for(unsigned u = 0; u < dirs.len; u++) free(dirs.list[u].name);
+  free(dirs.list);
+  free(dirs.by_extent);
+}
+
+
+/*
+ * Read 'len' bytes at byte offset 'pos'.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int iso_read_bytes(iso_t *iso, uint64_t pos, void *buf, unsigned len)
+{
+  if(pos + len > iso->disk->size_in_bytes) return 1;
+
+  return disk_read_bytes(iso->disk, buf, pos, len) ? 1 : 0;
+}
+
+
+/*
+ * Get list of all directories from the (little-endian) path table.
+ *
+ * Names are preliminary; the actual names come from the directory records
+ * of the parent directory.
+ *
+ * Return 1 if ok, 0 if the path table is not usable.
+ */
+static int iso_path_table(iso_t *iso, uint8_t *vd, iso_dirs_t *dirs)
+{
+  uint32_t size = read_dword_le(vd + 132);
+  uint32_t start = read_dword_le(vd + 140);
+
+  if(!size || size > (64 << 20) || !start || start >= iso->blocks) return 0;
+
+  uint8_t *table = malloc(size);
+
+  if(!table || iso_read_bytes(iso, (uint64_t) start * ISO_BLOCK_SIZE, table, size)) {
+    free(table);
+
+    return 0;
+  }
+
+  int ok = 1;
+
+  for(uint32_t pos = 0; pos + 8 <= size;) {
+    unsigned name_len = table[pos];
+    uint32_t extent = read_dword_le(table + pos + 2);
+    unsigned parent = read_word_le(table + pos + 6);
+
+    if(!name_len || pos + 8 + name_len > size) break;
+
+    // entries are ordered so that parents always come first; only the root is its own parent
+    if(
+      extent >= iso->blocks ||
+      parent == 0 ||
+      (dirs->len == 0 ? parent != 1 : parent > dirs->len) ||
+      dirs->len >= ISO_MAX_DIRS
+    ) {
+      ok = 0;
+      break;
+    }
+
+    char *name = NULL;
+
+    if(dirs->len == 0) {
+      name = strdup("/");
+    }
+    else {
+      char *s = iso->joliet ? utf16be_to_utf8(table + pos + 8, name_len) : strndup((char *) table + pos + 8, name_len);
+      if(s && asprintf(&name, "%s%s/", dirs->list[parent - 1].name, s) == -1) name = NULL;
+      free(s);
+    }
+
+    if(iso_add_dir(dirs, extent, 0, parent - 1, name)) {
+      ok = 0;
+      break;
+    }
+
+    pos += 8 + name_len + (name_len & 1);
+  }
+
+  free(table);
+
+  if(!ok || !dirs->len) {
+    for(unsigned u = 0; u < dirs->len; u++) free(dirs->list[u].name);
+    dirs->len = 0;
+
+    return 0;
+  }
+
+  dirs->by_extent = malloc(dirs->len * sizeof *dirs->by_extent);
+
+  if(!dirs->by_extent) {
+    for(unsigned u = 0; u < dirs->len; u++) free(dirs->list[u].name);
+    dirs->len = 0;
+
+    return 0;
+  }
+
+  for(unsigned u = 0; u < dirs->len; u++) dirs->by_extent[u] = u;
+  qsort_r(dirs->by_extent, dirs->len, sizeof *dirs->by_extent, iso_cmp_extent, dirs);
+
+  return 1;
+}
+
+
+static int iso_cmp_extent(const void *a, const void *b, void *dirs)
+{
+  iso_dir_t *list = ((iso_dirs_t *) dirs)->list;
+  uint32_t ext_a = list[*(const unsigned *) a].extent;
+  uint32_t ext_b = list[*(const unsigned *) b].extent;
+
+  return ext_a < ext_b ? -1 : ext_a > ext_b;
+}
+
+
+/*
+ * Find directory from path table by extent.
+ */
+static iso_dir_t *iso_find_dir(iso_dirs_t *dirs, uint32_t extent)
+{
+  unsigned lo = 0, hi = dirs->len;
+
+  while(lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    iso_dir_t *dir = dirs->list + dirs->by_extent[mid];
+
+    if(dir->extent == extent) return dir;
+
+    if(dir->extent < extent) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Add directory; it takes over 'name'.
+ *
+ * Return 0 if ok, or 1 if there's not enough memory (the directory is dropped).
+ */
+static int iso_add_dir(iso_dirs_t *dirs, uint32_t extent, uint32_t size, unsigned parent, char *name)
+{
+  if(!name) return 1;
+
+  if(dirs->len == dirs->max) {
+    unsigned max = dirs->max ? 2 * dirs->max : 256;
+    iso_dir_t *list = reallocarray(dirs->list, max, sizeof *list);
+    if(!list) {
+      free(name);
+      return 1;
+    }
+    dirs->list = list;
+    dirs->max = max;
+  }
+
+  dirs->list[dirs->len++] = (iso_dir_t) { .extent = extent, .size = size, .parent = parent, .name = name };
+
+  return 0;
+}
+
+
+/*
+ * Register all entries of a directory.
+ *
+ * Subdirectories get their final name (path table walk) or are queued
+ * (tree walk).
+ */
+static void iso_walk_dir(iso_t *iso, iso_dirs_t *dirs, unsigned idx, int use_path_table)
+{
+  uint32_t extent = dirs->list[idx].extent;
+  uint32_t size = dirs->list[idx].size;
+  uint8_t *buf;
+
+  if(!size) {
+    uint8_t dot[34];
+
+    if(iso_read_bytes(iso, (uint64_t) extent * ISO_BLOCK_SIZE, dot, sizeof dot)) return;
+
+    size = read_dword_le(dot + 10);
+  }
+
+  if(!size || size > (64 << 20) || extent + (size + ISO_BLOCK_SIZE - 1) / ISO_BLOCK_SIZE > iso->blocks) return;
+
+  buf = malloc(size);
+
+  if(!buf || iso_read_bytes(iso, (uint64_t) extent * ISO_BLOCK_SIZE, buf, size)) {
+    free(buf);
+
+    return;
+  }
+
+  for(uint32_t pos = 0; pos < size;) {
+    uint8_t *rec = buf + pos;
+    unsigned rec_len = rec[0];
+
+    // records don't cross block boundaries
+    if(rec_len == 0) {
+      pos = (pos / ISO_BLOCK_SIZE + 1) * ISO_BLOCK_SIZE;
+      continue;
+    }
+
+    if(rec_len < 34 || pos + rec_len > size || 33 + rec[32] > rec_len) break;
+
+    pos += rec_len;
+
+    // skip '.' and '..'
+    if(rec[32] == 1 && rec[33] <= 1) continue;
+
+    uint32_t file_extent = read_dword_le(rec + 2);
+    uint32_t file_size = read_dword_le(rec + 10);
+    char *name = iso_name(iso, rec);
+    char *path;
+
+    if(!name || asprintf(&path, "%s%s", dirs->list[idx].name, name) == -1) {
+      free(name);
+      continue;
+    }
+
+    free(name);
+
+    iso_add_file(iso->disk, (uint64_t) file_extent << 2, file_size, path);
+
+    if((rec[25] & 2)) {
+      if(use_path_table) {
+        iso_dir_t *dir = iso_find_dir(dirs, file_extent);
+        char *dir_name;
+        if(dir && dir > dirs->list + idx && asprintf(&dir_name, "%s/", path) != -1) {
+          free(dir->name);
+          dir->name = dir_name;
+          dir->size = file_size;
+        }
+      }
+      else if(dirs->len < ISO_MAX_DIRS && !iso_is_ancestor(dirs, idx, file_extent)) {
+        // note: dirs->list may move
+        char *dir_name;
+        if(asprintf(&dir_name, "%s/", path) == -1) dir_name = NULL;
+        iso_add_dir(dirs, file_extent, file_size, idx, dir_name);
+      }
+    }
+
+    free(path);
+  }
+
+  free(buf);
+}
+
+
+/*
+ * Check if directory 'idx' or one of its parents starts at 'extent'.
+ *
+ * This catches directory loops in broken file systems.
+ */
+static int iso_is_ancestor(iso_dirs_t *dirs, unsigned idx, uint32_t extent)
+{
+  for(unsigned depth = 0; depth < dirs->len; depth++) {
+    if(dirs->list[idx].extent == extent) return 1;
+    if(idx == 0) break;
+    idx = dirs->list[idx].parent;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Get file name from directory record.
+ *
+ * Return malloc'ed string, or NULL if out of memory.
+ */
+static char *iso_name(iso_t *iso, uint8_t *rec)
+{
+  unsigned name_len = rec[32];
+  char *name, *s;
+
+  if(iso->rock_ridge && (name = iso_rr_name(iso, rec))) return name;
+
+  if(iso->joliet) {
+    name = utf16be_to_utf8(rec + 33, name_len);
+  }
+  else {
+    name = strndup((char *) rec + 33, name_len);
+  }
+
+  if(!name) return NULL;
+
+  // strip version and, for names without extension, the final dot
+  if((s = strrchr(name, ';'))) *s = 0;
+  if(!iso->joliet && (s = strrchr(name, '.')) && !s[1] && s != name) *s = 0;
+
+  return name;
+}
+
+
+/*
+ * Get Rock Ridge name (NM entries) from directory record.
+ *
+ * Continuation areas (CE entries) are followed.
+ *
+ * Return malloc'ed string or NULL if there is none.
+ */
+static char *iso_rr_name(iso_t *iso, uint8_t *rec)
+{
+  unsigned rec_len = rec[0];
+  unsigned su_start = 33 + rec[32] + !(rec[32] & 1) + iso->susp_skip;
+  uint8_t *area = rec + su_start, *ce_buf = NULL;
+  unsigned area_len = su_start < rec_len ? rec_len - su_start : 0;
+  char *name = NULL;
+  unsigned name_len = 0, ce_count = 0;
+  int done = 0;
+
+  while(!done) {
+    uint64_t ce_pos = 0;
+    unsigned ce_len = 0;
+
+    for(unsigned pos = 0; pos + 4 <= area_len && !done;) {
+      uint8_t *entry = area + pos;
+      unsigned len = entry[2];
+
+      if(len < 4 || pos + len > area_len) break;
+
+      if(!memcmp(entry, "NM", 2) && len >= 5) {
+        // skip '.' and '..' entries
+        if(!(entry[4] & 6)) {
+          char *new_name = realloc(name, name_len + len - 5 + 1);
+          if(!new_name) {
+            done = 1;
+            break;
+          }
+          name = new_name;
+          memcpy(name + name_len, entry + 5, len - 5);
+          name_len += len - 5;
+          name[name_len] = 0;
+        }
+        if(!(entry[4] & 1)) done = 1;
+      }
+      else if(!memcmp(entry, "CE", 2) && len >= 28) {
+        ce_pos = (uint64_t) read_dword_le(entry + 4) * ISO_BLOCK_SIZE + read_dword_le(entry + 12);
+        ce_len = read_dword_le(entry + 20);
+      }
+      else if(!memcmp(entry, "ST", 2)) {
+        break;
+      }
+
+      pos += len;
+    }
+
+    if(done || !ce_len || ce_len > ISO_BLOCK_SIZE || ++ce_count > ISO_MAX_CE) break;
+
+    uint8_t *new_buf = realloc(ce_buf, ce_len);
+    if(!new_buf) break;
+    ce_buf = new_buf;
+    if(iso_read_bytes(iso, ce_pos, ce_buf, ce_len)) break;
+
+    area = ce_buf;
+    area_len = ce_len;
+  }
+
+  free(ce_buf);
+
+  if(name && !*name) {
+    free(name);
+    name = NULL;
+  }
+
+  return name;
+}
+
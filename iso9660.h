@@ -0,0 +1 @@
+void iso9660_read(disk_t *disk);
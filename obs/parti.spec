@@ -32,7 +32,6 @@ BuildRequires:  rubygem(asciidoctor)
 BuildRequires:  pkgconfig(blkid)
 BuildRequires:  pkgconfig(json-c)
 BuildRequires:  pkgconfig(uuid)
-Requires:       (mkisofs or xorriso)
 
 %description
 Show partition table information for
@@ -1,7 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <getopt.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "util.h"
 #include "json.h"
@@ -19,6 +23,7 @@
 #endif
 
 void help(void);
+int get_number(const char *str, unsigned long max, unsigned long *value);
 
 struct option options[] = {
   { "help",        0, NULL, 'h'  },
@@ -32,6 +37,13 @@ struct option options[] = {
   { "json",        0, NULL, 1005 },
   { "mkisofs",     0, NULL, 1006 },
   { "xorriso",     0, NULL, 1007 },
+  { "cache-mb",    1, NULL, 1008 },
+  { "direct",      0, NULL, 1009 },
+  { "read-around", 1, NULL, 1010 },
+  { "timeout",     1, NULL, 1011 },
+  { "all-block-sizes", 0, NULL, 1012 },
+  { "cache-dir",   1, NULL, 1013 },
+  { "lookup",      1, NULL, 1014 },
   { }
 };
 
@@ -39,6 +51,7 @@ struct option options[] = {
 int main(int argc, char **argv)
 {
   int i;
+  unsigned long value;
   extern int optind;
   extern int opterr;
 
@@ -81,6 +94,68 @@ int main(int argc, char **argv)
         opt.xorriso = 1;
         break;
 
+      case 1008:
+        opt.cache_mb = strtoul(optarg, NULL, 0);
+        if(!opt.cache_mb) {
+          fprintf(stderr, "--cache-mb: invalid size: %s\n", optarg);
+          return 1;
+        }
+        break;
+
+      case 1009:
+        opt.direct = 1;
+        break;
+
+      case 1010:
+        {
+          int *read_around[3] = { &opt.read_around.hdd, &opt.read_around.ssd, &opt.read_around.file };
+          char *size = optarg;
+
+          if(!strncmp(optarg, "hdd=", 4)) {
+            read_around[1] = read_around[2] = NULL;
+            size += 4;
+          }
+          else if(!strncmp(optarg, "ssd=", 4)) {
+            read_around[0] = read_around[2] = NULL;
+            size += 4;
+          }
+          else if(!strncmp(optarg, "file=", 5)) {
+            read_around[0] = read_around[1] = NULL;
+            size += 5;
+          }
+
+          if(!get_number(size, DISK_READ_AROUND_MAX >> 10, &value)) {
+            fprintf(stderr, "--read-around: invalid size (0 - %d KiB): %s\n", DISK_READ_AROUND_MAX >> 10, optarg);
+            return 1;
+          }
+
+          for(unsigned u = 0; u < 3; u++) {
+            if(read_around[u]) *read_around[u] = (int) value;
+          }
+        }
+        break;
+
+      case 1011:
+        if(!get_number(optarg, UINT_MAX, &value) || !value) {
+          fprintf(stderr, "--timeout: invalid number of seconds: %s\n", optarg);
+          return 1;
+        }
+        opt.timeout = value;
+        break;
+
+      case 1012:
+        opt.all_block_sizes = 1;
+        break;
+
+      case 1013:
+        opt.cache_dir = optarg;
+        break;
+
+      case 1014:
+        opt.lookup.list = reallocarray(opt.lookup.list, opt.lookup.len + 1, sizeof *opt.lookup.list);
+        opt.lookup.list[opt.lookup.len++] = strtoull(optarg, NULL, 0);
+        break;
+
       default:
         help();
         return i == 'h' ? 0 : 1;
@@ -90,15 +165,6 @@ int main(int argc, char **argv)
   argc -= optind;
   argv += optind;
 
-  if(!opt.xorriso && !opt.mkisofs) {
-    if(access("/usr/bin/isoinfo", X_OK)) {
-      opt.mkisofs = 1;
-    }
-    else if(access("/usr/bin/xorriso", X_OK)) {
-      opt.xorriso = 1;
-    }
-  }
-
   while(*argv) disk_init(*argv++);
 
   if(!disk_list_size) {
@@ -107,6 +173,12 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  disk_range_t *read_plans[] = {
+    fs_read_plan, mbr_read_plan, gpt_read_plan, apple_read_plan, eltorito_read_plan, zipl_read_plan, NULL
+  };
+
+  disk_prefetch(NULL, read_plans);
+
   for(unsigned u = 0; u < disk_list_size; u++) {
     dump_fs(disk_list + u, 0, 0);
     dump_mbr_ptable(disk_list + u);
@@ -114,6 +186,12 @@ int main(int argc, char **argv)
     dump_apple_ptables(disk_list + u);
     dump_eltorito(disk_list + u);
     dump_zipl(disk_list + u);
+    fs_show_lookups(disk_list + u);
+    disk_show_unreadable(disk_list + u);
+    if(opt.verbose) {
+      disk_show_stats(disk_list + u);
+      fs_show_probes(disk_list + u);
+    }
   }
 
   if(opt.export_file) {
@@ -123,10 +201,20 @@ int main(int argc, char **argv)
     }
   }
 
+  if(opt.cache_dir) {
+    for(unsigned u = 0; u < disk_list_size; u++) {
+      disk_cache_save(disk_list + u);
+    }
+  }
+
   json_print();
 
   json_done();
 
+  for(unsigned u = 0; u < disk_list_size; u++) {
+    disk_free(disk_list + u);
+  }
+
   return 0;
 }
 
@@ -145,10 +233,46 @@ void help()
     "  --export-disk FILE  Export all relevant disk data to FILE. FILE can then be used\n"
     "                      with --import-disk to reproduce the results.\n"
     "  --import-disk FILE  Import relevant disk data from FILE.\n"
-    "  --mkisofs           Use isoinfo to read ISO9660 fs info (default).\n"
-    "  --xorriso           Use xorriso to read ISO9660 fs info.\n"
+    "  --mkisofs           Use isoinfo (and strace) to read ISO9660 fs info, instead of\n"
+    "                      the built-in reader.\n"
+    "  --xorriso           Use xorriso (and strace) to read ISO9660 fs info, instead of\n"
+    "                      the built-in reader.\n"
+    "  --cache-mb N        Use at most N MiB memory for caching disk data; the limit is\n"
+    "                      for all disks together (default: 512).\n"
+    "                      With --export-disk, all data read are kept, regardless of N.\n"
+    "  --direct            Read block devices with O_DIRECT, bypassing the page cache.\n"
+    "  --read-around [CLASS=]N\n"
+    "                      On a cache miss, read the surrounding N KiB. CLASS is one of\n"
+    "                      hdd (rotating disks), ssd (all other block devices), or file;\n"
+    "                      without CLASS, N applies to all. Default: optimal i/o size\n"
+    "                      of the device, else 64 (hdd), 4 (ssd), 0 (file); at most 1024.\n"
+    "  --timeout N         Give up on a disk if a read takes longer than N seconds.\n"
+    "                      Image files are then read normally, not memory-mapped.\n"
+    "  --all-block-sizes   Look for partition tables with all block sizes (512 - 4096), not\n"
+    "                      just the one reported by the device and 2048.\n"
+    "  --cache-dir DIR     Keep disk data and ISO9660 file lists in DIR and use them again\n"
+    "                      in the next run if the disk has not changed.\n"
+    "  --lookup LBA        Show which file contains block LBA (in units of the disk's\n"
+    "                      block size). Works for ISO9660, UDF, FAT, and ext2/3/4 file\n"
+    "                      systems. Can be repeated.\n"
     "  --verbose           Report more details.\n"
     "  --version           Show version.\n"
     "  --help              Print this help text.\n"
   );
 }
+
+
+/*
+ * Parse number (decimal, or hex with 0x prefix) in the range 0 - max.
+ *
+ * Return 1 if ok, else 0.
+ */
+int get_number(const char *str, unsigned long max, unsigned long *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtoul(str, &end, 0);
+
+  return !errno && end != str && !*end && !strchr(str, '-') && *value <= max;
+}
@@ -13,9 +13,19 @@
 
 #include "ptable_apple.h"
 
+// partition map (block 1 + some entries) for block sizes 0x200 - 0x1000
+disk_range_t apple_read_plan[] = {
+  { 0x200, 0x4000 },
+  { }
+};
+
 void dump_apple_ptables(disk_t *disk)
 {
-  for(disk->block_size = 0x200; disk->block_size <= 0x1000; disk->block_size <<= 1) {
+  unsigned block_sizes[DISK_BLOCK_SIZES];
+  unsigned block_sizes_len = disk_block_sizes(disk, block_sizes);
+
+  for(unsigned i = 0; i < block_sizes_len; i++) {
+    disk->block_size = block_sizes[i];
     if(dump_apple_ptable(disk)) return;
   }
 }
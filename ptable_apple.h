@@ -13,5 +13,7 @@ typedef struct {
   uint32_t status;
 } apple_entry_t;
 
+extern disk_range_t apple_read_plan[];
+
 void dump_apple_ptables(disk_t *disk);
 int dump_apple_ptable(disk_t *disk);
@@ -47,11 +47,17 @@ typedef struct {
   uint16_t name[36];
 } gpt_entry_t;
 
+// primary and backup gpt (header + 128 entries) for block sizes 0x200 - 0x1000
+disk_range_t gpt_read_plan[] = {
+  { 0x200, 0x6000 - 0x200 },
+  { -0x6000, 0x6000 },
+  { }
+};
+
 uint64_t dump_gpt_ptable(disk_t *disk, uint64_t addr);
 uint32_t chksum_crc32(void *buf, unsigned len);
 char *guid_decode(uuid_t guid);
 char *efi_partition_type(char *guid);
-char *utf8_encode(unsigned uc);
 
 
 uint32_t chksum_crc32(void *buf, unsigned len)
@@ -120,58 +126,6 @@ char *efi_partition_type(char *guid)
 }
 
 
-char *utf8_encode(unsigned uc)
-{
-  static char buf[7];
-  char *s = buf;
-
-  uc &= 0x7fffffff;
-
-  if(uc < 0x80) {			// 7 bits
-    *s++ = uc;
-  }
-  else {
-    if(uc < (1 << 11)) {		// 11 (5 + 6) bits
-      *s++ = 0xc0 + (uc >> 6);
-      goto utf8_encode_2;
-    }
-    else if(uc < (1 << 16)) {		// 16 (4 + 6 + 6) bits
-      *s++ = 0xe0 + (uc >> 12);
-      goto utf8_encode_3;
-    }
-    else if(uc < (1 << 21)) {		// 21 (3 + 6 + 6 + 6) bits
-      *s++ = 0xf0 + (uc >> 18);
-      goto utf8_encode_4;
-    }
-    else if(uc < (1 << 26)) {		// 26 (2 + 6 + 6 + 6 + 6) bits
-      *s++ = 0xf8 + (uc >> 24);
-      goto utf8_encode_5;
-    }
-    else {				// 31 (1 + 6 + 6 + 6 + 6 + 6) bits
-      *s++ = 0xfc + (uc >> 30);
-    }
-
-    *s++ = 0x80 + ((uc >> 24) & ((1 << 6) - 1));
-
-    utf8_encode_5:
-      *s++ = 0x80 + ((uc >> 18) & ((1 << 6) - 1));
-
-    utf8_encode_4:
-      *s++ = 0x80 + ((uc >> 12) & ((1 << 6) - 1));
-
-    utf8_encode_3:
-      *s++ = 0x80 + ((uc >> 6) & ((1 << 6) - 1));
-
-    utf8_encode_2:
-      *s++ = 0x80 + (uc & ((1 << 6) - 1));
-  }
-
-  *s = 0;
-
-  return buf;
-}
-
-
 uint64_t dump_gpt_ptable(disk_t *disk, uint64_t addr)
 {
   int i, j, name_len;
@@ -413,8 +367,11 @@ uint64_t dump_gpt_ptable(disk_t *disk, uint64_t addr)
 void dump_gpt_ptables(disk_t *disk)
 {
   uint64_t u;
+  unsigned block_sizes[DISK_BLOCK_SIZES];
+  unsigned block_sizes_len = disk_block_sizes(disk, block_sizes);
 
-  for(disk->block_size = 0x200; disk->block_size <= 0x1000; disk->block_size <<= 1) {
+  for(unsigned i = 0; i < block_sizes_len; i++) {
+    disk->block_size = block_sizes[i];
     u = dump_gpt_ptable(disk, 1);
     if(!u) continue;
     dump_gpt_ptable(disk, u);
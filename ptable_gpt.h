@@ -1 +1,3 @@
+extern disk_range_t gpt_read_plan[];
+
 void dump_gpt_ptables(disk_t *disk);
@@ -8,6 +8,8 @@
 
 #include "disk.h"
 #include "filesystem.h"
+#include "ext4.h"
+#include "fat.h"
 #include "util.h"
 #include "json.h"
 
@@ -30,6 +32,12 @@ typedef struct {
 } ptable_t;
 
 
+// mbr
+disk_range_t mbr_read_plan[] = {
+  { 0, 0x200 },
+  { }
+};
+
 unsigned cs2s(unsigned cs);
 unsigned cs2c(unsigned cs);
 char *mbr_partition_type(unsigned id);
@@ -312,6 +320,7 @@ void dump_mbr_ptable(disk_t *disk)
 
   if(bi_start) {
     char *s;
+    char file_name[ISO_NAME_SIZE];
     char *bi_type = "bootinfo";
     if(memmem(buf, disk->block_size, "isolinux.bin", sizeof "isolinux.bin" - 1)) {
       bi_type = "isolinux";
@@ -324,8 +333,21 @@ void dump_mbr_ptable(disk_t *disk)
       bi_start -= 4;
     }
 
+    // it may point into a FAT or ext2/3/4 partition
+    for(unsigned u = 0; u < 4; u++) {
+      uint64_t start = (uint64_t) ptable[u].start.lin * disk->block_size;
+      uint64_t end = (uint64_t) ptable[u].end.lin * disk->block_size;
+
+      if(!ptable[u].valid || is_ext_ptable(ptable + u) || bi_start < start / 512 || bi_start >= end / 512) continue;
+
+      fat_probe(disk, start);
+      ext4_probe(disk, start);
+
+      break;
+    }
+
     log_info("  %s: %"PRIu64, bi_type, bi_start);
-    if((s = iso_block_to_name(disk, bi_start, NULL))) {
+    if((s = iso_block_to_name(disk, bi_start, NULL, file_name, sizeof file_name))) {
       log_info(", \"%s\"", s);
     }
     log_info("\n");
@@ -1 +1,3 @@
+extern disk_range_t mbr_read_plan[];
+
 void dump_mbr_ptable(disk_t *disk);
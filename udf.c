@@ -0,0 +1,854 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <json-c/json.h>
+
+#include "disk.h"
+#include "filesystem.h"
+#include "udf.h"
+#include "util.h"
+
+#define UDF_VRS_START		0x8000		// volume recognition sequence
+#define UDF_VRS_MAX		64		// volume structure descriptors to look at, at most
+#define UDF_AVDP_BLOCK		256		// anchor volume descriptor pointer
+#define UDF_VDS_MAX		64		// volume descriptors to look at, at most
+#define UDF_MAX_PARTS		8		// partition maps
+#define UDF_MAX_DIRS		(1 << 20)	// directories to walk, at most
+#define UDF_MAX_EXTENTS		(1 << 16)	// extents per file, at most
+#define UDF_MAX_AED		256		// allocation extent descriptors per file, at most
+#define UDF_MAX_DIR_SIZE	(64 << 20)	// directory size, at most
+
+// descriptor tag ids
+#define UDF_TAG_AVDP		2
+#define UDF_TAG_VDP		3
+#define UDF_TAG_PD		5
+#define UDF_TAG_LVD		6
+#define UDF_TAG_TD		8
+#define UDF_TAG_FSD		256
+#define UDF_TAG_FID		257
+#define UDF_TAG_AED		258
+#define UDF_TAG_FE		261
+#define UDF_TAG_EFE		266
+
+// ICB file types
+#define UDF_FT_DIR		4
+
+// file identifier characteristics
+#define UDF_FID_DIR		2
+#define UDF_FID_DELETED		4
+#define UDF_FID_PARENT		8
+
+// a part of a file
+typedef struct {
+  uint64_t block;		// physical block
+  uint32_t len;			// in bytes
+  unsigned recorded:1;		// block is valid, else the extent is a hole
+} udf_extent_t;
+
+// file data location, from file entry
+typedef struct {
+  udf_extent_t *list;
+  unsigned len, max;
+  unsigned type;		// ICB file type
+  uint64_t size;		// information length
+  uint8_t *data;		// embedded data, if any
+  unsigned data_len;
+} udf_file_t;
+
+// partition, as referenced via partition map index
+typedef struct {
+  uint32_t start;		// physical start block
+  uint32_t len;			// in blocks
+  unsigned ok:1;		// partition can be used
+  unsigned metadata:1;		// metadata partition, mapped via 'meta'
+  udf_file_t meta;		// metadata file
+} udf_part_t;
+
+typedef struct {
+  disk_t *disk;
+  unsigned block_size;
+  uint64_t blocks;		// disk size in blocks
+  unsigned parts_len;
+  udf_part_t parts[UDF_MAX_PARTS];
+} udf_t;
+
+typedef struct {
+  uint32_t lbn;			// file entry location
+  unsigned part;		// partition reference
+  unsigned parent;		// index of parent directory
+  char *name;			// full path, with trailing '/'
+} udf_dir_t;
+
+typedef struct {
+  udf_dir_t *list;
+  unsigned len, max;
+} udf_dirs_t;
+
+static int udf_read_bytes(udf_t *udf, uint64_t pos, void *buf, unsigned len);
+static int udf_read_tag(udf_t *udf, uint64_t block, uint32_t location, unsigned id, uint8_t *buf);
+static int udf_read_lb(udf_t *udf, unsigned part, uint32_t lbn, unsigned id, uint8_t *buf);
+static int udf_vrs(udf_t *udf);
+static int udf_anchor(udf_t *udf, uint8_t *avdp);
+static int udf_volume(udf_t *udf, uint8_t *avdp, uint8_t *lvd);
+static void udf_partitions(udf_t *udf, uint8_t *lvd, unsigned pd_len, uint32_t pd[][3]);
+static int udf_map(udf_t *udf, unsigned part, uint32_t lbn, uint64_t *block, uint64_t *count);
+static int udf_read_fe(udf_t *udf, unsigned part, uint32_t lbn, udf_file_t *file);
+static void udf_add_ads(udf_t *udf, udf_file_t *file, unsigned part, uint8_t *ads, unsigned len, unsigned ad_type);
+static void udf_add_extent(udf_t *udf, udf_file_t *file, unsigned part, uint32_t lbn, uint32_t len, int recorded);
+static uint8_t *udf_read_data(udf_t *udf, udf_file_t *file, unsigned *len);
+static void udf_register(udf_t *udf, udf_file_t *file, char *name);
+static void udf_free_file(udf_file_t *file);
+static void udf_add_dir(udf_dirs_t *dirs, uint32_t lbn, unsigned part, unsigned parent, char *name);
+static void udf_walk_dir(udf_t *udf, udf_dirs_t *dirs, unsigned idx);
+static int udf_is_ancestor(udf_dirs_t *dirs, unsigned idx, uint32_t lbn, unsigned part);
+static char *udf_name(uint8_t *buf, unsigned len);
+
+
+/*
+ * Read UDF directory tree and register all file extents via iso_add_extent().
+ *
+ * The fs is expected at the start of the disk. This also covers UDF bridge
+ * images that have an ISO9660 tree, too.
+ *
+ * Only metadata are read (descriptors, file entries, and directories), all
+ * via the disk cache.
+ */
+void udf_read(disk_t *disk)
+{
+  udf_t udf = { .disk = disk };
+  uint8_t avdp[4096], lvd[4096];
+
+  if(udf_anchor(&udf, avdp) || udf_volume(&udf, avdp, lvd)) return;
+
+  // root directory from file set descriptor
+  uint8_t fsd[udf.block_size];
+  uint32_t fsd_lbn = read_dword_le(lvd + 252);
+  unsigned fsd_part = read_word_le(lvd + 256);
+
+  if(udf_read_lb(&udf, fsd_part, fsd_lbn, UDF_TAG_FSD, fsd) == 0) {
+    udf_dirs_t dirs = {};
+
+    udf_add_dir(&dirs, read_dword_le(fsd + 404), read_word_le(fsd + 408), 0, strdup("/"));
+
+    for(unsigned u = 0; u < dirs.len && u < UDF_MAX_DIRS; u++) {
+      udf_walk_dir(&udf, &dirs, u);
+    }
+
+    for(unsigned u = 0; u < dirs.len; u++) free(dirs.list[u].name);
+    free(dirs.list);
+  }
+
+  for(unsigned u = 0; u < udf.parts_len; u++) udf_free_file(&udf.parts[u].meta);
+}
+
+
+/*
+ * Add UDF anchor and main volume descriptor sequence to digest.
+ *
+ * Return 0 if ok, 1 if there's no UDF fs.
+ */
+int udf_digest(disk_t *disk, uint64_t *digest)
+{
+  udf_t udf = { .disk = disk };
+  uint8_t avdp[4096];
+
+  if(udf_anchor(&udf, avdp)) return 1;
+
+  *digest = fnv1a_hash(avdp, udf.block_size, *digest);
+
+  uint8_t buf[udf.block_size];
+  uint32_t vds_len = read_dword_le(avdp + 16) / udf.block_size;
+  uint32_t vds_start = read_dword_le(avdp + 20);
+
+  for(uint32_t u = 0; u < vds_len && u < UDF_VDS_MAX; u++) {
+    if(udf_read_tag(&udf, (uint64_t) vds_start + u, vds_start + u, 0, buf)) break;
+    *digest = fnv1a_hash(buf, udf.block_size, *digest);
+    if(read_word_le(buf) == UDF_TAG_TD) break;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Read 'len' bytes at byte offset 'pos'.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int udf_read_bytes(udf_t *udf, uint64_t pos, void *buf, unsigned len)
+{
+  if(pos + len > udf->disk->size_in_bytes) return 1;
+
+  return disk_read_bytes(udf->disk, buf, pos, len) ? 1 : 0;
+}
+
+
+/*
+ * Read descriptor from physical block and verify its tag.
+ *
+ * id is the expected tag id (0 = any), location the expected tag location.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int udf_read_tag(udf_t *udf, uint64_t block, uint32_t location, unsigned id, uint8_t *buf)
+{
+  unsigned sum = 0;
+
+  if(block >= udf->blocks) return 1;
+
+  if(udf_read_bytes(udf, block * udf->block_size, buf, udf->block_size)) return 1;
+
+  for(unsigned u = 0; u < 16; u++) {
+    if(u != 4) sum += buf[u];
+  }
+
+  if((sum & 0xff) != buf[4] || read_dword_le(buf + 12) != location) return 1;
+
+  if(id && read_word_le(buf) != id) return 1;
+
+  return 0;
+}
+
+
+/*
+ * Read descriptor from logical block 'lbn' in partition 'part'.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int udf_read_lb(udf_t *udf, unsigned part, uint32_t lbn, unsigned id, uint8_t *buf)
+{
+  uint64_t block, count;
+
+  if(udf_map(udf, part, lbn, &block, &count)) return 1;
+
+  return udf_read_tag(udf, block, lbn, id, buf);
+}
+
+
+/*
+ * Check volume recognition sequence for NSR descriptor.
+ *
+ * Return 1 if it indicates a UDF fs, else 0.
+ */
+static int udf_vrs(udf_t *udf)
+{
+  static char *ids[] = { "CD001", "BEA01", "TEA01", "BOOT2", "CDW02", "NSR02", "NSR03" };
+  unsigned step = udf->block_size > 2048 ? udf->block_size : 2048;
+  uint8_t vsd[6];
+
+  for(unsigned u = 0; u < UDF_VRS_MAX; u++) {
+    unsigned i;
+
+    if(udf_read_bytes(udf, UDF_VRS_START + (uint64_t) u * step, vsd, sizeof vsd)) break;
+
+    for(i = 0; i < sizeof ids / sizeof *ids; i++) {
+      if(!memcmp(vsd + 1, ids[i], 5)) break;
+    }
+
+    if(i == sizeof ids / sizeof *ids) break;
+
+    if(!memcmp(vsd + 1, "NSR0", 4)) return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Find anchor volume descriptor pointer.
+ *
+ * Block sizes 2048 (optical media), 512, 4096, and 1024 are tried. The
+ * anchor is looked for in block 256, then in the last block and 256
+ * blocks before.
+ *
+ * Sets udf->block_size and udf->blocks.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int udf_anchor(udf_t *udf, uint8_t *avdp)
+{
+  static unsigned sizes[] = { 2048, 512, 4096, 1024 };
+
+  for(unsigned u = 0; u < sizeof sizes / sizeof *sizes; u++) {
+    udf->block_size = sizes[u];
+    udf->blocks = udf->disk->size_in_bytes / udf->block_size;
+
+    if(udf->blocks <= UDF_AVDP_BLOCK || !udf_vrs(udf)) continue;
+
+    uint64_t locations[] = { UDF_AVDP_BLOCK, udf->blocks - 1, udf->blocks - 1 - UDF_AVDP_BLOCK };
+
+    for(unsigned i = 0; i < sizeof locations / sizeof *locations; i++) {
+      if(!udf_read_tag(udf, locations[i], locations[i], UDF_TAG_AVDP, avdp)) return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/*
+ * Read main volume descriptor sequence and set up partitions.
+ *
+ * The logical volume descriptor is stored in lvd.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int udf_volume(udf_t *udf, uint8_t *avdp, uint8_t *lvd)
+{
+  unsigned block_size = udf->block_size;
+  uint8_t buf[block_size];
+  uint32_t pd[UDF_MAX_PARTS][3];	// partition number, start, length
+  unsigned pd_len = 0, count = 0;
+  int lvd_ok = 0;
+
+  uint64_t block = read_dword_le(avdp + 20);
+  uint64_t end = block + read_dword_le(avdp + 16) / block_size;
+
+  for(; block < end && count < UDF_VDS_MAX; block++, count++) {
+    if(udf_read_tag(udf, block, block, 0, buf)) break;
+
+    unsigned id = read_word_le(buf);
+
+    if(id == UDF_TAG_TD) break;
+
+    if(id == UDF_TAG_VDP) {
+      // continue with next extent
+      block = read_dword_le(buf + 24);
+      end = block + read_dword_le(buf + 20) / block_size;
+      block--;
+    }
+    else if(id == UDF_TAG_PD) {
+      unsigned number = read_word_le(buf + 22), u;
+
+      for(u = 0; u < pd_len && pd[u][0] != number; u++);
+
+      if(u < UDF_MAX_PARTS) {
+        pd[u][0] = number;
+        pd[u][1] = read_dword_le(buf + 188);
+        pd[u][2] = read_dword_le(buf + 192);
+        if(u == pd_len) pd_len++;
+      }
+    }
+    else if(id == UDF_TAG_LVD) {
+      memcpy(lvd, buf, block_size);
+      lvd_ok = 1;
+    }
+  }
+
+  if(!lvd_ok || read_dword_le(lvd + 212) != block_size) return 1;
+
+  udf_partitions(udf, lvd, pd_len, pd);
+
+  return 0;
+}
+
+
+/*
+ * Set up partitions from partition maps in logical volume descriptor.
+ *
+ * Type 1 maps and sparable partitions are used directly (spared blocks
+ * are not looked up). Metadata partitions are mapped via the metadata
+ * file (or its mirror). Virtual partitions are not supported.
+ */
+static void udf_partitions(udf_t *udf, uint8_t *lvd, unsigned pd_len, uint32_t pd[][3])
+{
+  uint32_t map_len = read_dword_le(lvd + 264);
+  uint32_t maps = read_dword_le(lvd + 268);
+  uint8_t *map = lvd + 440;
+  uint32_t meta_lbn[UDF_MAX_PARTS][2] = {};
+  unsigned number[UDF_MAX_PARTS];
+
+  if(map_len > udf->block_size - 440) return;
+
+  uint8_t *map_end = map + map_len;
+
+  for(; udf->parts_len < maps && udf->parts_len < UDF_MAX_PARTS; map += map[1]) {
+    if(map + 2 > map_end || map[1] < 6 || map + map[1] > map_end) break;
+
+    udf_part_t *part = udf->parts + udf->parts_len;
+    unsigned u, ok = 1;
+
+    number[udf->parts_len++] = read_word_le(map + 4);
+
+    if(map[0] == 2) {
+      ok = 0;
+      if(map[1] >= 64) {
+        number[udf->parts_len - 1] = read_word_le(map + 38);
+        if(!memcmp(map + 5, "*UDF Sparable Partition", 23)) ok = 1;
+        if(!memcmp(map + 5, "*UDF Metadata Partition", 23)) {
+          part->metadata = 1;
+          meta_lbn[udf->parts_len - 1][0] = read_dword_le(map + 40);
+          meta_lbn[udf->parts_len - 1][1] = read_dword_le(map + 44);
+        }
+      }
+    }
+    else if(map[0] != 1) {
+      ok = 0;
+    }
+
+    for(u = 0; u < pd_len && pd[u][0] != number[udf->parts_len - 1]; u++);
+
+    if(u == pd_len) continue;
+
+    part->start = pd[u][1];
+    part->len = pd[u][2];
+    part->ok = ok;
+  }
+
+  // metadata partitions need the physical partition they live in
+  for(unsigned u = 0; u < udf->parts_len; u++) {
+    udf_part_t *part = udf->parts + u;
+    unsigned phys;
+
+    if(!part->metadata) continue;
+
+    for(phys = 0; phys < udf->parts_len; phys++) {
+      if(udf->parts[phys].ok && !udf->parts[phys].metadata && number[phys] == number[u]) break;
+    }
+
+    if(phys == udf->parts_len) continue;
+
+    for(unsigned i = 0; i < 2 && !part->ok; i++) {
+      udf_free_file(&part->meta);
+      if(!udf_read_fe(udf, phys, meta_lbn[u][i], &part->meta) && part->meta.len) part->ok = 1;
+    }
+  }
+}
+
+
+/*
+ * Map logical block in partition to physical block.
+ *
+ * count is set to the number of consecutive blocks starting there.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int udf_map(udf_t *udf, unsigned part, uint32_t lbn, uint64_t *block, uint64_t *count)
+{
+  if(part >= udf->parts_len || !udf->parts[part].ok) return 1;
+
+  udf_part_t *p = udf->parts + part;
+
+  if(p->metadata) {
+    uint64_t pos = lbn;
+    unsigned u;
+
+    for(u = 0; u < p->meta.len; u++) {
+      udf_extent_t *ext = p->meta.list + u;
+      uint64_t blocks = ext->len / udf->block_size;
+
+      if(pos < blocks) {
+        if(!ext->recorded) return 1;
+        *block = ext->block + pos;
+        *count = blocks - pos;
+        break;
+      }
+
+      pos -= blocks;
+    }
+
+    if(u == p->meta.len) return 1;
+  }
+  else {
+    if(lbn >= p->len) return 1;
+
+    *block = (uint64_t) p->start + lbn;
+    *count = p->len - lbn;
+  }
+
+  if(*block >= udf->blocks) return 1;
+
+  if(*count > udf->blocks - *block) *count = udf->blocks - *block;
+
+  return 0;
+}
+
+
+/*
+ * Read (extended) file entry and get file type, size, and data location.
+ *
+ * Return 0 if ok, else 1.
+ */
+static int udf_read_fe(udf_t *udf, unsigned part, uint32_t lbn, udf_file_t *file)
+{
+  unsigned block_size = udf->block_size;
+  uint8_t buf[block_size];
+  uint32_t ea_len, ad_len, ad_start;
+
+  if(udf_read_lb(udf, part, lbn, 0, buf)) return 1;
+
+  switch(read_word_le(buf)) {
+    case UDF_TAG_FE:
+      ea_len = read_dword_le(buf + 168);
+      ad_len = read_dword_le(buf + 172);
+      ad_start = 176;
+      break;
+
+    case UDF_TAG_EFE:
+      ea_len = read_dword_le(buf + 208);
+      ad_len = read_dword_le(buf + 212);
+      ad_start = 216;
+      break;
+
+    default:
+      return 1;
+  }
+
+  // only strategy 4 (a single direct entry) is used in practice
+  if(read_word_le(buf + 20) != 4) return 1;
+
+  if(ea_len > block_size || ad_len > block_size || ad_start + ea_len + ad_len > block_size) return 1;
+
+  ad_start += ea_len;
+
+  file->type = buf[27];
+  file->size = read_qword_le(buf + 56);
+
+  unsigned ad_type = read_word_le(buf + 34) & 7;
+
+  if(ad_type == 3) {
+    file->data = malloc(ad_len + 1);
+    if(!file->data) return 1;
+    memcpy(file->data, buf + ad_start, ad_len);
+    file->data_len = ad_len;
+  }
+  else {
+    udf_add_ads(udf, file, part, buf + ad_start, ad_len, ad_type);
+  }
+
+  return 0;
+}
+
+
+/*
+ * Add extents from allocation descriptors to file.
+ *
+ * ad_type: 0 = short, 1 = long, 2 = extended allocation descriptors.
+ * Short descriptors refer to partition 'part'.
+ *
+ * Continuations via allocation extent descriptors are followed.
+ */
+static void udf_add_ads(udf_t *udf, udf_file_t *file, unsigned part, uint8_t *ads, unsigned len, unsigned ad_type)
+{
+  static unsigned ad_sizes[] = { 8, 16, 20 };
+  uint8_t buf[udf->block_size];
+  unsigned aed_count = 0;
+
+  if(ad_type > 2) return;
+
+  unsigned ad_size = ad_sizes[ad_type];
+
+  for(unsigned pos = 0; pos + ad_size <= len;) {
+    uint8_t *ad = ads + pos;
+    uint32_t ext_len = read_dword_le(ad) & 0x3fffffff;
+    unsigned ext_type = read_dword_le(ad) >> 30;
+    uint32_t ext_lbn = read_dword_le(ad + (ad_type == 2 ? 12 : 4));
+    unsigned ext_part = ad_type == 0 ? part : read_word_le(ad + (ad_type == 2 ? 16 : 8));
+
+    if(!ext_len) break;
+
+    pos += ad_size;
+
+    if(ext_type == 3) {
+      // continued in allocation extent descriptor; note: overwrites 'ads'
+      if(++aed_count > UDF_MAX_AED || udf_read_lb(udf, ext_part, ext_lbn, UDF_TAG_AED, buf)) break;
+      len = read_dword_le(buf + 20);
+      if(len > udf->block_size - 24) break;
+      ads = buf + 24;
+      pos = 0;
+      continue;
+    }
+
+    // type 0: recorded; 1: allocated, not recorded; 2: not allocated
+    udf_add_extent(udf, file, ext_part, ext_lbn, ext_len, ext_type == 0);
+  }
+}
+
+
+/*
+ * Add extent to file.
+ *
+ * The extent is split if it is not physically contiguous (metadata
+ * partition); adjacent extents are merged.
+ */
+static void udf_add_extent(udf_t *udf, udf_file_t *file, unsigned part, uint32_t lbn, uint32_t len, int recorded)
+{
+  unsigned block_size = udf->block_size;
+
+  while(len && file->len < UDF_MAX_EXTENTS) {
+    uint64_t block = 0, count = 0;
+    uint32_t chunk = len;
+
+    if(recorded && !udf_map(udf, part, lbn, &block, &count)) {
+      if(count * block_size < chunk) chunk = count * block_size;
+    }
+    else {
+      recorded = 0;
+    }
+
+    udf_extent_t *last = file->len ? file->list + file->len - 1 : NULL;
+
+    if(
+      last &&
+      last->recorded == recorded &&
+      !(last->len % block_size) &&
+      (!recorded || last->block + last->len / block_size == block) &&
+      (uint64_t) last->len + chunk <= UINT32_MAX
+    ) {
+      last->len += chunk;
+    }
+    else {
+      if(file->len == file->max) {
+        unsigned max = file->max ? 2 * file->max : 16;
+        udf_extent_t *list = reallocarray(file->list, max, sizeof *list);
+        if(!list) return;
+        file->list = list;
+        file->max = max;
+      }
+      file->list[file->len++] = (udf_extent_t) { .block = block, .len = chunk, .recorded = recorded };
+    }
+
+    len -= chunk;
+    lbn += (chunk + block_size - 1) / block_size;
+  }
+}
+
+
+/*
+ * Read file data (for directories).
+ *
+ * Return malloc'ed buffer with 'len' bytes, or NULL.
+ */
+static uint8_t *udf_read_data(udf_t *udf, udf_file_t *file, unsigned *len)
+{
+  uint8_t *buf;
+  uint64_t pos = 0, size = file->size;
+
+  if(size > UDF_MAX_DIR_SIZE) return NULL;
+
+  if(file->data) {
+    if(size > file->data_len) size = file->data_len;
+    buf = malloc(size + 1);
+    if(!buf) return NULL;
+    memcpy(buf, file->data, size);
+    *len = size;
+
+    return buf;
+  }
+
+  buf = calloc(1, size + 1);
+
+  if(!buf) return NULL;
+
+  for(unsigned u = 0; u < file->len && pos < size; u++) {
+    udf_extent_t *ext = file->list + u;
+    unsigned chunk = ext->len < size - pos ? ext->len : size - pos;
+
+    if(ext->recorded && udf_read_bytes(udf, ext->block * udf->block_size, buf + pos, chunk)) {
+      free(buf);
+
+      return NULL;
+    }
+
+    pos += chunk;
+  }
+
+  *len = size;
+
+  return buf;
+}
+
+
+/*
+ * Register all recorded extents of a file.
+ */
+static void udf_register(udf_t *udf, udf_file_t *file, char *name)
+{
+  unsigned factor = udf->block_size / 512;
+  uint64_t offset = 0;
+
+  for(unsigned u = 0; u < file->len && offset < file->size; u++) {
+    udf_extent_t *ext = file->list + u;
+    uint64_t size = ext->len < file->size - offset ? ext->len : file->size - offset;
+
+    if(ext->recorded) iso_add_extent(udf->disk, ext->block * factor, size, offset >> 9, file->size, name);
+
+    offset += ext->len;
+  }
+}
+
+
+static void udf_free_file(udf_file_t *file)
+{
+  free(file->list);
+  free(file->data);
+
+  *file = (udf_file_t) {};
+}
+
+
+/*
+ * Queue directory; it takes over 'name'.
+ *
+ * If there's not enough memory, the directory is dropped.
+ */
+static void udf_add_dir(udf_dirs_t *dirs, uint32_t lbn, unsigned part, unsigned parent, char *name)
+{
+  if(!name) return;
+
+  if(dirs->len == dirs->max) {
+    unsigned max = dirs->max ? 2 * dirs->max : 256;
+    udf_dir_t *list = reallocarray(dirs->list, max, sizeof *list);
+    if(!list) {
+      free(name);
+      return;
+    }
+    dirs->list = list;
+    dirs->max = max;
+  }
+
+  dirs->list[dirs->len++] = (udf_dir_t) { .lbn = lbn, .part = part, .parent = parent, .name = name };
+}
+
+
+/*
+ * Register all entries of a directory and queue its subdirectories.
+ *
+ * The directory itself is registered, too (except the root directory).
+ */
+static void udf_walk_dir(udf_t *udf, udf_dirs_t *dirs, unsigned idx)
+{
+  udf_file_t dir = {};
+  uint8_t *buf = NULL;
+  unsigned len = 0;
+
+  if(
+    udf_read_fe(udf, dirs->list[idx].part, dirs->list[idx].lbn, &dir) ||
+    dir.type != UDF_FT_DIR ||
+    !(buf = udf_read_data(udf, &dir, &len))
+  ) {
+    udf_free_file(&dir);
+
+    return;
+  }
+
+  if(idx) {
+    char *name = strdup(dirs->list[idx].name);
+    if(name) {
+      name[strlen(name) - 1] = 0;
+      udf_register(udf, &dir, name);
+      free(name);
+    }
+  }
+
+  udf_free_file(&dir);
+
+  for(unsigned pos = 0; pos + 38 <= len;) {
+    uint8_t *fid = buf + pos;
+    unsigned sum = 0;
+
+    for(unsigned u = 0; u < 16; u++) {
+      if(u != 4) sum += fid[u];
+    }
+
+    if(read_word_le(fid) != UDF_TAG_FID || (sum & 0xff) != fid[4]) break;
+
+    unsigned flags = fid[18];
+    unsigned name_len = fid[19];
+    unsigned iu_len = read_word_le(fid + 36);
+
+    if(pos + 38 + iu_len + name_len > len) break;
+
+    pos += (38 + iu_len + name_len + 3) & ~3u;
+
+    if((flags & (UDF_FID_DELETED | UDF_FID_PARENT))) continue;
+
+    uint32_t lbn = read_dword_le(fid + 24);
+    unsigned part = read_word_le(fid + 28);
+    char *name = udf_name(fid + 38 + iu_len, name_len);
+    char *path;
+
+    if(!name || !*name || asprintf(&path, "%s%s", dirs->list[idx].name, name) == -1) {
+      free(name);
+      continue;
+    }
+
+    free(name);
+
+    if((flags & UDF_FID_DIR)) {
+      if(dirs->len < UDF_MAX_DIRS && !udf_is_ancestor(dirs, idx, lbn, part)) {
+        // note: dirs->list may move
+        char *dir_name;
+        if(asprintf(&dir_name, "%s/", path) == -1) dir_name = NULL;
+        udf_add_dir(dirs, lbn, part, idx, dir_name);
+      }
+    }
+    else {
+      udf_file_t file = {};
+      if(!udf_read_fe(udf, part, lbn, &file)) udf_register(udf, &file, path);
+      udf_free_file(&file);
+    }
+
+    free(path);
+  }
+
+  free(buf);
+}
+
+
+/*
+ * Check if directory 'idx' or one of its parents has its file entry at
+ * 'lbn' in partition 'part'.
+ *
+ * This catches directory loops in broken file systems.
+ */
+static int udf_is_ancestor(udf_dirs_t *dirs, unsigned idx, uint32_t lbn, unsigned part)
+{
+  for(unsigned depth = 0; depth < dirs->len; depth++) {
+    if(dirs->list[idx].lbn == lbn && dirs->list[idx].part == part) return 1;
+    if(idx == 0) break;
+    idx = dirs->list[idx].parent;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Convert file identifier (OSTA compressed unicode) to UTF-8.
+ *
+ * Return malloc'ed string, or NULL if out of memory.
+ */
+static char *udf_name(uint8_t *buf, unsigned len)
+{
+  char *name;
+
+  if(!len) return strdup("");
+
+  switch(buf[0]) {
+    case 8:
+    case 254:
+      name = malloc(2 * len + 1);
+      if(!name) break;
+      *name = 0;
+      for(unsigned u = 1; u < len && buf[u]; u++) {
+        strcat(name, utf8_encode(buf[u]));
+      }
+      break;
+
+    case 16:
+    case 255:
+      name = utf16be_to_utf8(buf + 1, len - 1);
+      break;
+
+    default:
+      name = strdup("");
+      break;
+  }
+
+  return name;
+}
@@ -0,0 +1,2 @@
+void udf_read(disk_t *disk);
+int udf_digest(disk_t *disk, uint64_t *digest);
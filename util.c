@@ -9,7 +9,7 @@
 
 #include "util.h"
 
-opt_t opt;
+opt_t opt = { .read_around = { -1, -1, -1 } };
 
 
 char *cname(void *buf, int len)
@@ -88,6 +88,111 @@ uint64_t read_qword_be(void *buf)
 }
 
 
+/*
+ * FNV-1a hash (64 bit) of 'buf', continuing from 'hash'.
+ *
+ * Start with FNV1A_INIT.
+ */
+uint64_t fnv1a_hash(void *buf, size_t len, uint64_t hash)
+{
+  uint8_t *data = buf;
+
+  for(size_t u = 0; u < len; u++) {
+    hash ^= data[u];
+    hash *= 0x100000001b3ull;
+  }
+
+  return hash;
+}
+
+
+char *utf8_encode(unsigned uc)
+{
+  static char buf[7];
+  char *s = buf;
+
+  uc &= 0x7fffffff;
+
+  if(uc < 0x80) {			// 7 bits
+    *s++ = uc;
+  }
+  else {
+    if(uc < (1 << 11)) {		// 11 (5 + 6) bits
+      *s++ = 0xc0 + (uc >> 6);
+      goto utf8_encode_2;
+    }
+    else if(uc < (1 << 16)) {		// 16 (4 + 6 + 6) bits
+      *s++ = 0xe0 + (uc >> 12);
+      goto utf8_encode_3;
+    }
+    else if(uc < (1 << 21)) {		// 21 (3 + 6 + 6 + 6) bits
+      *s++ = 0xf0 + (uc >> 18);
+      goto utf8_encode_4;
+    }
+    else if(uc < (1 << 26)) {		// 26 (2 + 6 + 6 + 6 + 6) bits
+      *s++ = 0xf8 + (uc >> 24);
+      goto utf8_encode_5;
+    }
+    else {				// 31 (1 + 6 + 6 + 6 + 6 + 6) bits
+      *s++ = 0xfc + (uc >> 30);
+    }
+
+    *s++ = 0x80 + ((uc >> 24) & ((1 << 6) - 1));
+
+    utf8_encode_5:
+      *s++ = 0x80 + ((uc >> 18) & ((1 << 6) - 1));
+
+    utf8_encode_4:
+      *s++ = 0x80 + ((uc >> 12) & ((1 << 6) - 1));
+
+    utf8_encode_3:
+      *s++ = 0x80 + ((uc >> 6) & ((1 << 6) - 1));
+
+    utf8_encode_2:
+      *s++ = 0x80 + (uc & ((1 << 6) - 1));
+  }
+
+  *s = 0;
+
+  return buf;
+}
+
+
+/*
+ * Convert UTF-16 (big-endian) string of 'len' bytes to UTF-8.
+ *
+ * Surrogate pairs are combined; conversion stops at a 0 character.
+ *
+ * Return malloc'ed string, or NULL if out of memory.
+ */
+char *utf16be_to_utf8(uint8_t *buf, unsigned len)
+{
+  char *name = malloc(len / 2 * 4 + 1);
+
+  if(!name) return NULL;
+
+  *name = 0;
+
+  for(unsigned u = 0; u + 1 < len; u += 2) {
+    unsigned c = read_word_be(buf + u);
+
+    if(c >= 0xd800 && c < 0xdc00 && u + 3 < len) {
+      unsigned c2 = read_word_be(buf + u + 2);
+      if(c2 >= 0xdc00 && c2 < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+        u += 2;
+      }
+    }
+
+    if(!c) break;
+
+    strcat(name, utf8_encode(c));
+  }
+
+  return name;
+}
+
+
 void log_info(const char *format, ...)
 {
   if(opt.json) return;
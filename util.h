@@ -1,5 +1,8 @@
 #define SEP		"- - - - - - - - - - - - - - - -"
 
+// initial value for fnv1a_hash()
+#define FNV1A_INIT	0xcbf29ce484222325ull
+
 char *cname(void *buf, int len);
 
 unsigned read_byte(void *buf);
@@ -10,6 +13,11 @@ unsigned read_dword_be(void *buf);
 uint64_t read_qword_le(void *buf);
 uint64_t read_qword_be(void *buf);
 
+uint64_t fnv1a_hash(void *buf, size_t len, uint64_t hash);
+
+char *utf8_encode(unsigned uc);
+char *utf16be_to_utf8(uint8_t *buf, unsigned len);
+
 void log_info(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
 
 typedef struct {
@@ -18,6 +26,18 @@ typedef struct {
     unsigned raw:1;
   } show;
   char *export_file;
+  unsigned cache_mb;
+  unsigned timeout;
+  char *cache_dir;
+  struct {
+    uint64_t *list;		// blocks to look up, in disk->block_size units
+    unsigned len;
+  } lookup;
+  struct {
+    int hdd, ssd, file;		// read-around size in KiB (-1 = automatic)
+  } read_around;
+  unsigned direct:1;
+  unsigned all_block_sizes:1;
   unsigned json:1;
   unsigned mkisofs:1;
   unsigned xorriso:1;
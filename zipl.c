@@ -22,6 +22,12 @@
 #define ZIPL_PSW_LOAD   0x0008000080000000ll
 
 
+// zipl boot record
+disk_range_t zipl_read_plan[] = {
+  { 0, 0x200 },
+  { }
+};
+
 void dump_zipl_components(disk_t *disk, uint64_t sec)
 {
   unsigned char buf[disk->block_size];
@@ -31,6 +37,7 @@ void dump_zipl_components(disk_t *disk, uint64_t sec)
   uint64_t start, load, start2;
   unsigned size, type, size2, len2;
   char *s;
+  char file_name[ISO_NAME_SIZE];
   zipl_stage3_head_t zh = {};
 
   i = disk_read(disk, buf, sec, 1);
@@ -69,7 +76,7 @@ void dump_zipl_components(disk_t *disk, uint64_t sec)
             len2
           );
           if(size2 != disk->block_size || opt.show.raw) log_info(", blksize %d", size2);
-          if((s = iso_block_to_name(disk, start2, NULL))) {
+          if((s = iso_block_to_name(disk, start2, NULL, file_name, sizeof file_name))) {
             log_info(", \"%s\"", s);
           }
           log_info("\n");
@@ -152,6 +159,7 @@ void dump_zipl(disk_t *disk)
   uint64_t pt_sec, sec;
   unsigned size;
   char *s;
+  char file_name[ISO_NAME_SIZE];
 
   i = disk_read(disk, buf, 0, 1);
 
@@ -170,7 +178,7 @@ void dump_zipl(disk_t *disk)
 
   log_info("  program table: %llu", (unsigned long long) pt_sec);
   if(size != disk->block_size || opt.show.raw) log_info(", blksize %u", size);
-  if((s = iso_block_to_name(disk, pt_sec, NULL))) {
+  if((s = iso_block_to_name(disk, pt_sec, NULL, file_name, sizeof file_name))) {
     log_info(", \"%s\"", s);
   }
   log_info("\n");
@@ -10,5 +10,7 @@ typedef struct {
 } zipl_stage3_head_t;
 
 
+extern disk_range_t zipl_read_plan[];
+
 void dump_zipl_components(disk_t *disk, uint64_t sec);
 void dump_zipl(disk_t *disk);